@@ -9,11 +9,14 @@
 #include "xs_regex.h"
 #include "xs_time.h"
 #include "xs_set.h"
+#include "xs_vec.h"
 #include "xs_match.h"
 
 #include "snac.h"
 
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 const char *public_address = "https:/" "/www.w3.org/ns/activitystreams#Public";
 
@@ -60,7 +63,7 @@ const char *default_avatar_base64(void)
 }
 
 
-int activitypub_request(snac *user, const char *url, xs_dict **data)
+static int _activitypub_request(snac *user, const char *url, xs_dict **data)
 /* request an object */
 {
     int status = 0;
@@ -115,10 +118,146 @@ int activitypub_request(snac *user, const char *url, xs_dict **data)
 }
 
 
+/* Concurrent requests for the same URL by the same signer are merged:
+   the first one (the leader) does the fetch, and the rest wait for it
+   and get a copy of its result (signed fetches can be answered
+   differently for each actor, so they are never shared among them).
+   Entries only live while the fetch is in flight. */
+
+typedef struct _fetch_flight {
+    struct _fetch_flight *next;
+    xs_str *url;
+    xs_str *signer;         /* actor signing the request, or "" */
+    int waiters;            /* threads waiting for the result */
+    int done;
+    int status;
+    xs_dict *data;
+} fetch_flight;
+
+static pthread_mutex_t fetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fetch_cond = PTHREAD_COND_INITIALIZER;
+static fetch_flight *fetch_flights = NULL;
+
+
+static int _activitypub_request_sf(snac *user, const char *url, xs_dict **data, int *leader)
+/* requests an object, sharing the fetch with other threads asking for the same */
+{
+    fetch_flight *f;
+    const char *signer = user ? user->actor : "";
+    int status;
+
+    /* failed recently? don't even try */
+    if ((status = fetch_fail_get(signer, url)) != 0) {
+        srv_debug(1, xs_fmt("activitypub_request cached failure %s %d", url, status));
+
+        *data   = NULL;
+        *leader = 0;
+        return status;
+    }
+
+    pthread_mutex_lock(&fetch_mutex);
+
+    for (f = fetch_flights; f != NULL; f = f->next) {
+        if (!f->done && strcmp(f->url, url) == 0 && strcmp(f->signer, signer) == 0)
+            break;
+    }
+
+    if (f != NULL) {
+        /* already being fetched: wait for it */
+        f->waiters++;
+
+        while (!f->done)
+            pthread_cond_wait(&fetch_cond, &fetch_mutex);
+
+        status = f->status;
+        *data  = f->data ? xs_dup(f->data) : NULL;
+
+        /* the last one out frees it */
+        if (--f->waiters == 0) {
+            xs_free(f->url);
+            xs_free(f->signer);
+            xs_free(f->data);
+            xs_free(f);
+        }
+
+        if (p_state != NULL)
+            p_state->fetch_shared++;
+
+        pthread_mutex_unlock(&fetch_mutex);
+
+        *leader = 0;
+        return status;
+    }
+
+    /* be the leader */
+    int h = xs_arena_hold(1);
+
+    f = xs_realloc(NULL, sizeof(fetch_flight));
+    *f = (fetch_flight){ fetch_flights, xs_dup(url), xs_dup(signer), 0, 0, 0, NULL };
+
+    xs_arena_hold(h);
+
+    fetch_flights = f;
+
+    pthread_mutex_unlock(&fetch_mutex);
+
+    status = _activitypub_request(user, url, data);
+
+    if (!valid_status(status))
+        fetch_fail_add(signer, url, status);
+
+    /* the host answered something */
+    if (status > 0 && status != 599)
+        fetch_fail_ok(url);
+
+    pthread_mutex_lock(&fetch_mutex);
+
+    /* unlink */
+    fetch_flight **p = &fetch_flights;
+
+    while (*p != f)
+        p = &(*p)->next;
+
+    *p = f->next;
+
+    if (f->waiters) {
+        /* share the result */
+        h = xs_arena_hold(1);
+        f->data = *data ? xs_dup(*data) : NULL;
+        xs_arena_hold(h);
+
+        f->status = status;
+        f->done   = 1;
+
+        pthread_cond_broadcast(&fetch_cond);
+    }
+    else {
+        xs_free(f->url);
+        xs_free(f->signer);
+        xs_free(f);
+    }
+
+    pthread_mutex_unlock(&fetch_mutex);
+
+    *leader = 1;
+    return status;
+}
+
+
+int activitypub_request(snac *user, const char *url, xs_dict **data)
+/* request an object */
+{
+    int leader;
+
+    return _activitypub_request_sf(user, url, data, &leader);
+}
+
+
 int actor_request(snac *user, const char *actor, xs_dict **data)
 /* request an actor */
 {
     int status;
+    int leader;
     xs *payload = NULL;
 
     if (data)
@@ -129,11 +268,12 @@ int actor_request(snac *user, const char *actor, xs_dict **data)
 
     if (!valid_status(status)) {
         /* actor data non-existent: get from the net */
-        status = activitypub_request(user, actor, &payload);
+        status = _activitypub_request_sf(user, actor, &payload, &leader);
 
         if (valid_status(status)) {
-            /* renew data */
-            status = actor_add(actor, payload);
+            /* renew data (only once if the fetch was shared) */
+            if (leader)
+                status = actor_add(actor, payload);
 
             if (data != NULL) {
                 *data   = payload;
@@ -145,7 +285,7 @@ int actor_request(snac *user, const char *actor, xs_dict **data)
     }
 
     /* collect the (presumed) shared inbox in this actor */
-    if (xs_type(xs_dict_get(srv_config, "disable_inbox_collection")) != XSTYPE_TRUE) {
+    if (!srv_conf->disable_inbox_collection) {
         if (valid_status(status) && data && *data)
             inbox_add_by_actor(*data);
     }
@@ -319,6 +459,52 @@ xs_list *get_attachments(const xs_dict *msg)
 }
 
 
+/* The ancestors of a timeline entry are not requested in the same job,
+   but one level at a time in queued jobs (so a long conversation only
+   has one request in flight and doesn't hold a thread for long). The
+   number of these queued ancestor requests is limited server-wide;
+   beyond that, they are requested right away as before. */
+
+static pthread_mutex_t backfill_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int backfill_acquire(void)
+/* takes a slot for a queued ancestor request; returns 0 if there are none */
+{
+    int ok = 0;
+
+    if (p_state == NULL)
+        return 0;
+
+    pthread_mutex_lock(&backfill_mutex);
+
+    if (p_state->backfills < srv_conf->backfill_max) {
+        p_state->backfills++;
+        ok = 1;
+    }
+
+    pthread_mutex_unlock(&backfill_mutex);
+
+    return ok;
+}
+
+
+static void backfill_release(void)
+/* releases a slot for a queued ancestor request */
+{
+    if (p_state == NULL)
+        return;
+
+    pthread_mutex_lock(&backfill_mutex);
+
+    /* queued before a restart? */
+    if (p_state->backfills > 0)
+        p_state->backfills--;
+
+    pthread_mutex_unlock(&backfill_mutex);
+}
+
+
 int timeline_request(snac *snac, const char **id, xs_str **wrk, int level)
 /* ensures that an entry and its ancestors are in the timeline */
 {
@@ -393,8 +579,13 @@ int timeline_request(snac *snac, const char **id, xs_str **wrk, int level)
                             /* redistribute to lists for this user */
                             list_distribute(snac, actor, object);
 
-                            /* recurse! */
-                            timeline_request(snac, &in_reply_to, NULL, level + 1);
+                            /* get the ancestors (if not already here) */
+                            if (!xs_is_null(in_reply_to) && *in_reply_to && !object_here(in_reply_to)) {
+                                if (level + 1 < MAX_CONVERSATION_LEVELS && backfill_acquire())
+                                    enqueue_ancestor_request(snac, in_reply_to, level + 1);
+                                else
+                                    timeline_request(snac, &in_reply_to, NULL, level + 1);
+                            }
                         }
                     }
                 }
@@ -906,7 +1097,7 @@ void notify(snac *snac, const char *type, const char *utype, const char *actor,
 
     const char *email = "[disabled by admin]";
 
-    if (xs_type(xs_dict_get(srv_config, "disable_email_notifications")) != XSTYPE_TRUE) {
+    if (!srv_conf->disable_email_notifications) {
         email = xs_dict_get(snac->config_o, "email");
         if (xs_is_null(email)) {
             email = xs_dict_get(snac->config, "email");
@@ -1272,7 +1463,7 @@ xs_dict *msg_actor(snac *snac)
     }
 
     /* use shared inboxes? */
-    if (xs_type(xs_dict_get(srv_config, "shared_inboxes")) == XSTYPE_TRUE) {
+    if (srv_conf->shared_inboxes) {
         xs *d = xs_dict_new();
         xs *si = xs_fmt("%s/shared-inbox", srv_baseurl);
         d = xs_dict_append(d, "sharedInbox", si);
@@ -1295,6 +1486,165 @@ xs_dict *msg_actor(snac *snac)
 }
 
 
+/* The actor documents of local users are built once and kept in memory,
+   both as a dict and serialized, until their user.json or key.json
+   change (or user_persist() is called, or the server settings are
+   reloaded). They are built from the files, not from the caller's
+   (maybe outdated) copy of the user, and not stored if they were
+   invalidated while being built. */
+
+typedef struct _actor_cache_entry {
+    struct _actor_cache_entry *next;
+    xs_str *uid;
+    double mtime;               /* of user.json and key.json */
+    const srv_cfg *conf;        /* server settings used */
+    xs_dict *actor;
+    xs_str *json;               /* compact JSON */
+    xs_str *etag;
+} actor_cache_entry;
+
+static pthread_mutex_t actor_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static actor_cache_entry *actor_cache = NULL;
+static unsigned int actor_cache_gen = 0;   /* bumped by msg_actor_invalidate() */
+
+
+static double _actor_cache_mtime(snac *snac)
+/* returns the combined mtimes of the files the actor depends on */
+{
+    xs *cfg = xs_fmt("%s/user.json", snac->basedir);
+    xs *key = xs_fmt("%s/key.json", snac->basedir);
+
+    return mtime(cfg) * 2.0 + mtime(key);
+}
+
+
+static void _actor_cache_get(snac *user, xs_dict **actor, xs_str **json, xs_str **etag)
+/* gets copies of the (up to date) cached actor document of a user */
+{
+    actor_cache_entry *e;
+    double mt = _actor_cache_mtime(user);
+
+    pthread_mutex_lock(&actor_cache_mutex);
+
+    for (e = actor_cache; e != NULL; e = e->next) {
+        if (strcmp(e->uid, user->uid) == 0)
+            break;
+    }
+
+    if (e == NULL || e->mtime != mt || e->conf != srv_conf) {
+        unsigned int gen = actor_cache_gen;
+        snac u;
+        int fresh;
+
+        /* build it outside the lock, as it may be slow */
+        pthread_mutex_unlock(&actor_cache_mutex);
+
+        const srv_cfg *conf = srv_conf;
+
+        if ((fresh = user_open(&u, user->uid)) == 0)
+            u = *user;
+
+        xs *a   = msg_actor(&u);
+        xs *j   = xs_json_dumps(a, 0);
+        xs *md5 = xs_md5_hex(j, strlen(j));
+
+        if (fresh)
+            user_free(&u);
+
+        pthread_mutex_lock(&actor_cache_mutex);
+
+        if (!fresh || gen != actor_cache_gen) {
+            /* outdated already: don't store it */
+            pthread_mutex_unlock(&actor_cache_mutex);
+
+            if (actor != NULL)
+                *actor = xs_dup(a);
+            if (json != NULL)
+                *json = xs_dup(j);
+            if (etag != NULL)
+                *etag = xs_fmt("\"%s\"", md5);
+
+            return;
+        }
+
+        for (e = actor_cache; e != NULL; e = e->next) {
+            if (strcmp(e->uid, user->uid) == 0)
+                break;
+        }
+
+        int h = xs_arena_hold(1);
+
+        if (e == NULL) {
+            e = xs_realloc(NULL, sizeof(actor_cache_entry));
+            *e = (actor_cache_entry){ actor_cache, xs_dup(user->uid), 0.0, NULL, NULL, NULL, NULL };
+            actor_cache = e;
+        }
+        else {
+            xs_free(e->actor);
+            xs_free(e->json);
+            xs_free(e->etag);
+        }
+
+        e->mtime = mt;
+        e->conf  = conf;
+        e->actor = xs_dup(a);
+        e->json  = xs_dup(j);
+        e->etag  = xs_fmt("\"%s\"", md5);
+
+        xs_arena_hold(h);
+    }
+
+    if (actor != NULL)
+        *actor = xs_dup(e->actor);
+    if (json != NULL)
+        *json = xs_dup(e->json);
+    if (etag != NULL)
+        *etag = xs_dup(e->etag);
+
+    pthread_mutex_unlock(&actor_cache_mutex);
+}
+
+
+xs_dict *msg_actor_cached(snac *snac)
+/* returns the Person message for this actor, from the cache if possible */
+{
+    xs_dict *msg = NULL;
+
+    _actor_cache_get(snac, &msg, NULL, NULL);
+
+    return msg;
+}
+
+
+xs_str *msg_actor_json(snac *snac, xs_str **etag)
+/* returns the Person message for this actor, serialized, and its etag */
+{
+    xs_str *json = NULL;
+
+    _actor_cache_get(snac, NULL, &json, etag);
+
+    return json;
+}
+
+
+void msg_actor_invalidate(snac *snac)
+/* forces the actor document of a user to be built again */
+{
+    actor_cache_entry *e;
+
+    pthread_mutex_lock(&actor_cache_mutex);
+
+    for (e = actor_cache; e != NULL; e = e->next) {
+        if (strcmp(e->uid, snac->uid) == 0)
+            e->conf = NULL;
+    }
+
+    actor_cache_gen++;
+
+    pthread_mutex_unlock(&actor_cache_mutex);
+}
+
+
 xs_dict *msg_create(snac *snac, const xs_dict *object)
 /* creates a 'Create' message */
 {
@@ -1761,6 +2111,123 @@ int update_question(snac *user, const char *id)
 
 /** queues **/
 
+/* Recently accepted input messages are remembered in a pair of bloom
+   filters (the current one and the previous one, swapped every
+   INBOX_SEEN_WINDOW seconds), so that further copies of the same message
+   to the same inbox (retries, or the same activity sent again) can be
+   accepted right away without being parsed, checked and queued.
+   Messages are only marked as seen after their signature has been
+   verified, and bloom filter hits are confirmed against a table of the
+   exact keys, so a false positive is never taken as a duplicate. */
+
+#define INBOX_SEEN_BITS   (1 << 21)
+#define INBOX_SEEN_WINDOW (15 * 60)
+#define INBOX_SEEN_SLOTS  (1 << 16)
+
+static pthread_mutex_t inbox_seen_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char *inbox_seen[2] = { NULL, NULL };
+static time_t inbox_seen_rotated = 0;
+
+static struct inbox_seen_slot {
+    time_t t;
+    char key[MD5_HEX_SIZE];
+} *inbox_seen_slots = NULL;
+
+
+static xs_str *inbox_seen_key(const char *q_path, const char *payload, int p_size)
+/* returns the key of a message to an inbox */
+{
+    xs *s = xs_fmt("%s\n", q_path);
+    s = xs_append_m(s, payload, p_size);
+
+    return xs_md5_hex(s, strlen(q_path) + 1 + p_size);
+}
+
+
+static int inbox_seen_check(const char *key, int add)
+/* checks if a message to an inbox was seen recently; if add is set, marks it as seen */
+{
+    unsigned int keys[4];
+    int seen = 0;
+    int n, g;
+
+    if (xs_is_null(key) || strlen(key) != MD5_HEX_SIZE - 1)
+        return 0;
+
+    /* the bloom filter positions */
+    for (n = 0; n < 4; n++) {
+        char tmp[9];
+
+        memcpy(tmp, key + n * 8, 8);
+        tmp[8] = '\0';
+
+        keys[n] = strtoul(tmp, NULL, 16) & (INBOX_SEEN_BITS - 1);
+    }
+
+    struct inbox_seen_slot *slot;
+
+    pthread_mutex_lock(&inbox_seen_mutex);
+
+    time_t t = time(NULL);
+
+    if (inbox_seen[0] == NULL) {
+        int h = xs_arena_hold(1);
+
+        for (g = 0; g < 2; g++) {
+            inbox_seen[g] = xs_realloc(NULL, INBOX_SEEN_BITS / 8);
+            memset(inbox_seen[g], '\0', INBOX_SEEN_BITS / 8);
+        }
+
+        inbox_seen_slots = xs_realloc(NULL, INBOX_SEEN_SLOTS * sizeof(*inbox_seen_slots));
+        memset(inbox_seen_slots, '\0', INBOX_SEEN_SLOTS * sizeof(*inbox_seen_slots));
+
+        xs_arena_hold(h);
+
+        inbox_seen_rotated = t;
+    }
+
+    if (t - inbox_seen_rotated > INBOX_SEEN_WINDOW) {
+        /* the current one becomes the previous one */
+        unsigned char *p = inbox_seen[1];
+
+        inbox_seen[1] = inbox_seen[0];
+        inbox_seen[0] = p;
+        memset(inbox_seen[0], '\0', INBOX_SEEN_BITS / 8);
+
+        inbox_seen_rotated = t;
+    }
+
+    for (g = 0; g < 2 && !seen; g++) {
+        for (n = 0; n < 4; n++) {
+            if (!(inbox_seen[g][keys[n] >> 3] & (1 << (keys[n] & 7))))
+                break;
+        }
+
+        if (n == 4)
+            seen = 1;
+    }
+
+    /* confirm it's really the same key (and recent enough) */
+    slot = &inbox_seen_slots[keys[0] & (INBOX_SEEN_SLOTS - 1)];
+
+    if (seen && (strcmp(slot->key, key) != 0 || t - slot->t > 2 * INBOX_SEEN_WINDOW))
+        seen = 0;
+
+    if (!seen && add) {
+        for (n = 0; n < 4; n++)
+            inbox_seen[0][keys[n] >> 3] |= 1 << (keys[n] & 7);
+
+        /* a collision just forgets the older one */
+        strcpy(slot->key, key);
+        slot->t = t;
+    }
+
+    pthread_mutex_unlock(&inbox_seen_mutex);
+
+    return seen;
+}
+
+
 int process_input_message(snac *snac, const xs_dict *msg, const xs_dict *req)
 /* processes an ActivityPub message from the input queue */
 /* return values: -1, fatal error; 0, transient error, retry;
@@ -1859,6 +2326,9 @@ int process_input_message(snac *snac, const xs_dict *msg, const xs_dict *req)
         return -1;
     }
 
+    /* take note of the software the actor's host runs */
+    inbox_host_software(actor, xs_dict_get(req, "user-agent"));
+
     /* if no user is set, no further checks can be done; propagate */
     if (snac == NULL)
         return 2;
@@ -1881,7 +2351,7 @@ int process_input_message(snac *snac, const xs_dict *msg, const xs_dict *req)
     }
 
     /* check the minimum acceptable account age */
-    int min_account_age = xs_number_get(xs_dict_get(srv_config, "min_account_age"));
+    int min_account_age = srv_conf->min_account_age;
 
     if (min_account_age > 0) {
         const char *actor_date = xs_dict_get(actor_o, "published");
@@ -2248,7 +2718,7 @@ int process_input_message(snac *snac, const xs_dict *msg, const xs_dict *req)
         /* should we MUTE the actor back? */
         /* mute(snac, actor); */
 
-        if (!xs_is_true(xs_dict_get(srv_config, "disable_block_notifications")))
+        if (!srv_conf->disable_block_notifications)
             do_notify = 1;
     }
     else
@@ -2362,7 +2832,7 @@ void process_user_queue_item(snac *snac, xs_dict *q_item)
 /* processes an item from the user queue */
 {
     const char *type;
-    int queue_retry_max = xs_number_get(xs_dict_get(srv_config, "queue_retry_max"));
+    int queue_retry_max = srv_conf->queue_retry_max;
 
     if ((type = xs_dict_get(q_item, "type")) == NULL)
         type = "output";
@@ -2392,7 +2862,7 @@ void process_user_queue_item(snac *snac, xs_dict *q_item)
 
         /* if it's a public note or question, send to the collected inboxes */
         if (xs_match(xs_dict_get_def(msg, "type", ""), "Create|Update") && is_msg_public(msg)) {
-            if (xs_type(xs_dict_get(srv_config, "disable_inbox_collection")) != XSTYPE_TRUE) {
+            if (!srv_conf->disable_inbox_collection) {
                 xs *shibx = inbox_list();
                 const xs_str *inbox;
 
@@ -2411,20 +2881,28 @@ void process_user_queue_item(snac *snac, xs_dict *q_item)
         /* process the message */
         const xs_dict *msg = xs_dict_get(q_item, "message");
         const xs_dict *req = xs_dict_get(q_item, "req");
+        const char *seen   = xs_dict_get(q_item, "seen");
         int retries  = xs_number_get(xs_dict_get(q_item, "retries"));
 
         if (xs_is_null(msg))
             return;
 
-        if (!process_input_message(snac, msg, req)) {
+        int r = process_input_message(snac, msg, req);
+
+        if (r == 0) {
             if (retries > queue_retry_max)
                 snac_log(snac, xs_fmt("input giving up"));
             else {
                 /* reenqueue */
-                enqueue_input(snac, msg, req, retries + 1);
+                enqueue_input(snac, msg, req, seen, retries + 1);
                 snac_log(snac, xs_fmt("input requeue #%d", retries + 1));
             }
         }
+        else
+        if (r == 1) {
+            /* the signature was good: further copies can be skipped */
+            inbox_seen_check(seen, 1);
+        }
     }
     else
     if (strcmp(type, "close_question") == 0) {
@@ -2504,7 +2982,7 @@ void process_queue_item(xs_dict *q_item)
 /* processes an item from the global queue */
 {
     const char *type = xs_dict_get(q_item, "type");
-    int queue_retry_max = xs_number_get(xs_dict_get(srv_config, "queue_retry_max"));
+    int queue_retry_max = srv_conf->queue_retry_max;
 
     if (strcmp(type, "output") == 0) {
         int status;
@@ -2558,6 +3036,8 @@ void process_queue_item(xs_dict *q_item)
 
         srv_log(xs_fmt("output message: sent to inbox %s %d%s", inbox, status, payload));
 
+        inbox_host_status(inbox, status);
+
         if (!valid_status(status)) {
             retries++;
 
@@ -2656,6 +3136,35 @@ void process_queue_item(xs_dict *q_item)
         srv_debug(0, xs_fmt("ntfy post %d", status));
     }
     else
+    if (strcmp(type, "ancestor_request") == 0) {
+        const char *uid = xs_dict_get(q_item, "uid");
+        const char *id  = xs_dict_get(q_item, "message");
+        int level = xs_number_get(xs_dict_get(q_item, "level"));
+        snac user;
+
+        backfill_release();
+
+        if (!xs_is_null(id) && !xs_is_null(uid) && user_open(&user, uid)) {
+            timeline_request(&user, &id, NULL, level);
+            user_free(&user);
+        }
+    }
+    else
+    if (strcmp(type, "home_restore") == 0 || strcmp(type, "home_drop") == 0) {
+        const char *uid   = xs_dict_get(q_item, "uid");
+        const char *actor = xs_dict_get(q_item, "message");
+        snac user;
+
+        if (!xs_is_null(actor) && !xs_is_null(uid) && user_open(&user, uid)) {
+            if (strcmp(type, "home_restore") == 0)
+                timeline_home_restore(&user, actor);
+            else
+                timeline_home_drop(&user, actor);
+
+            user_free(&user);
+        }
+    }
+    else
     if (strcmp(type, "purge") == 0) {
         srv_log(xs_dup("purge start"));
 
@@ -2667,6 +3176,7 @@ void process_queue_item(xs_dict *q_item)
     if (strcmp(type, "input") == 0) {
         const xs_dict *msg = xs_dict_get(q_item, "message");
         const xs_dict *req = xs_dict_get(q_item, "req");
+        const char *seen   = xs_dict_get(q_item, "seen");
         int retries  = xs_number_get(xs_dict_get(q_item, "retries"));
 
         /* do some instance-level checks */
@@ -2678,7 +3188,7 @@ void process_queue_item(xs_dict *q_item)
                 srv_log(xs_fmt("shared input giving up"));
             else {
                 /* reenqueue */
-                enqueue_shared_input(msg, req, retries + 1);
+                enqueue_shared_input(msg, req, seen, retries + 1);
                 srv_log(xs_fmt("shared input requeue #%d", retries + 1));
             }
         }
@@ -2807,8 +3317,263 @@ int migrate_account(snac *user)
 
 /** HTTP handlers */
 
+/* The outbox, followers and following collections are served as an
+   OrderedCollection with the number of items and a link to the first
+   page. Pages are OrderedCollectionPage objects whose next and prev
+   links hold positions in the backing index, so any page costs the
+   same to build. Built pages are cached until the index changes (or
+   for a while, as the objects themselves may be edited). */
+
+#define COLL_PAGE_SIZE 20
+#define COLL_CACHE_MAX 128
+#define COLL_CACHE_TTL 300
+
+typedef struct _coll_cache_entry {
+    struct _coll_cache_entry *next;
+    xs_str *key;                /* page id */
+    xs_str *sig;                /* state of the index when built */
+    time_t t;
+    xs_str *json;
+} coll_cache_entry;
+
+static pthread_mutex_t coll_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static coll_cache_entry *coll_cache = NULL;
+
+
+static xs_str *_coll_sig(const char *fn)
+/* returns a string that changes when the index (or directory) changes */
+{
+    struct stat st;
+
+    if (stat(fn, &st) == -1)
+        return xs_str_new("-");
+
+    return xs_fmt("%ld:%ld.%09ld", (long)st.st_size,
+        (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+}
+
+
+static xs_str *_coll_cache_get(const char *key, const char *sig)
+/* returns a cached page, or NULL */
+{
+    coll_cache_entry *e;
+    xs_str *json = NULL;
+    time_t t = time(NULL);
+
+    pthread_mutex_lock(&coll_cache_mutex);
+
+    for (e = coll_cache; e != NULL; e = e->next) {
+        if (strcmp(e->key, key) == 0) {
+            if (strcmp(e->sig, sig) == 0 && t - e->t < COLL_CACHE_TTL)
+                json = xs_dup(e->json);
+
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&coll_cache_mutex);
+
+    return json;
+}
+
+
+static void _coll_cache_put(const char *key, const char *sig, const char *json)
+/* caches a page */
+{
+    coll_cache_entry *e, **p;
+    int n = 0;
+
+    pthread_mutex_lock(&coll_cache_mutex);
+
+    int h = xs_arena_hold(1);
+
+    /* delete the previous one, and the oldest if it's full */
+    for (p = &coll_cache; *p != NULL; ) {
+        e = *p;
+
+        if (strcmp(e->key, key) == 0 || ++n >= COLL_CACHE_MAX) {
+            *p = e->next;
+
+            xs_free(e->key);
+            xs_free(e->sig);
+            xs_free(e->json);
+            xs_free(e);
+        }
+        else
+            p = &e->next;
+    }
+
+    e = xs_realloc(NULL, sizeof(coll_cache_entry));
+    *e = (coll_cache_entry){ coll_cache, xs_dup(key), xs_dup(sig), time(NULL), xs_dup(json) };
+    coll_cache = e;
+
+    xs_arena_hold(h);
+
+    pthread_mutex_unlock(&coll_cache_mutex);
+}
+
+
+static int _coll_outbox_item(snac *snac, const xs_dict *i)
+/* returns true if an object from the public index is shown in the outbox */
+{
+    const char *type = xs_dict_get(i, "type");
+    const char *id   = xs_dict_get(i, "id");
+
+    return type && id && strcmp(type, "Note") == 0 && xs_startswith(id, snac->actor);
+}
+
+
+static xs_list *_coll_items(snac *snac, const char *name, int *pos, int show, int *total)
+/* returns the items of a collection before position *pos (from the end if negative) */
+{
+    xs_list *items = NULL;
+
+    if (strcmp(name, "outbox") == 0) {
+        xs *idx = user_index_fn(snac, "public");
+        xs *list = index_list_desc_pos(idx, pos, show);
+        const char *v;
+        int c = 0;
+
+        /* the length of the index (constant work per page), so it
+           also counts the deleted entries and boosts that are skipped */
+        *total = index_len(idx);
+        items  = xs_list_new();
+
+        while (xs_list_next(list, &v, &c)) {
+            xs *i = NULL;
+
+            if (valid_status(object_get_by_md5(v, &i)) && _coll_outbox_item(snac, i)) {
+                xs *c_msg = msg_create(snac, i);
+                items = xs_list_append(items, c_msg);
+            }
+        }
+    }
+    else
+    if (strcmp(name, "followers") == 0)
+        items = follower_list_page(snac, pos, show, total);
+    else {
+        /* following: there is no index, so use the positions in the list */
+        xs *list = following_list(snac);
+        xs_vec lv;
+        int p = *pos;
+        int n = 0;
+
+        xs_vec_from_list(&lv, list);
+
+        *total = xs_vec_len(&lv);
+        items  = xs_list_new();
+
+        if (p < 0 || p > *total)
+            p = *total;
+
+        for (; n < show && p > 0; n++)
+            items = xs_list_append(items, xs_vec_get(&lv, --p));
+
+        xs_vec_free(&lv);
+
+        *pos = p;
+    }
+
+    return items;
+}
+
+
+static xs_str *_coll_get(snac *snac, const char *name, const xs_dict *q_vars)
+/* returns a collection (or one of its pages) as JSON */
+{
+    xs *id = xs_fmt("%s/%s", snac->actor, name);
+    xs *fn = NULL;
+    int total = 0;
+    int pos = -1;
+    const char *v;
+
+    if (strcmp(name, "outbox") == 0)
+        fn = user_index_fn(snac, "public");
+    else
+    if (strcmp(name, "followers") == 0)
+        fn = xs_fmt("%s/followers.idx", snac->basedir);
+    else
+        fn = xs_fmt("%s/following", snac->basedir);
+
+    /* the social graph is only shown if allowed */
+    if (strcmp(name, "outbox") != 0 && !srv_conf->public_social_graph) {
+        xs *msg = msg_collection(snac, id);
+        return xs_json_dumps(msg, 4);
+    }
+
+    if ((v = xs_dict_get(q_vars, "max")) != NULL)
+        pos = atoi(v);
+
+    xs *page_id = NULL;
+
+    if (xs_dict_get(q_vars, "page") == NULL)
+        page_id = xs_dup(id);
+    else
+    if (pos >= 0)
+        page_id = xs_fmt("%s?page=true&max=%d", id, pos);
+    else
+        page_id = xs_fmt("%s?page=true", id);
+
+    xs *sig = _coll_sig(fn);
+    xs_str *json;
+
+    if ((json = _coll_cache_get(page_id, sig)) != NULL)
+        return json;
+
+    xs *msg = NULL;
+
+    if (xs_dict_get(q_vars, "page") == NULL) {
+        /* the collection itself */
+        xs *l = _coll_items(snac, name, &pos, 0, &total);
+        xs *t = xs_number_new(total);
+        xs *first = xs_fmt("%s?page=true", id);
+
+        msg = msg_base(snac, "OrderedCollection", id, NULL, NULL, NULL);
+        msg = xs_dict_append(msg, "attributedTo", snac->actor);
+        msg = xs_dict_append(msg, "totalItems",   t);
+        msg = xs_dict_append(msg, "first",        first);
+    }
+    else {
+        int start = pos;
+        xs *l = _coll_items(snac, name, &pos, COLL_PAGE_SIZE, &total);
+        xs *t = xs_number_new(total);
+
+        /* positions are in the index, that may have more entries than items */
+        int end = strcmp(name, "following") == 0 ? total : index_len(fn);
+
+        msg = msg_base(snac, "OrderedCollectionPage", page_id, NULL, NULL, NULL);
+        msg = xs_dict_append(msg, "partOf",       id);
+        msg = xs_dict_append(msg, "totalItems",   t);
+        msg = xs_dict_append(msg, "orderedItems", l);
+
+        if (pos > 0) {
+            xs *next = xs_fmt("%s?page=true&max=%d", id, pos);
+            msg = xs_dict_append(msg, "next", next);
+        }
+
+        if (start >= 0 && start < end) {
+            int max = start + COLL_PAGE_SIZE;
+            xs *prev = NULL;
+
+            if (max >= end)
+                prev = xs_fmt("%s?page=true", id);
+            else
+                prev = xs_fmt("%s?page=true&max=%d", id, max);
+
+            msg = xs_dict_append(msg, "prev", prev);
+        }
+    }
+
+    json = xs_json_dumps(msg, 4);
+
+    _coll_cache_put(page_id, sig, json);
+
+    return json;
+}
+
+
 int activitypub_get_handler(const xs_dict *req, const char *q_path,
-                            char **body, int *b_size, char **ctype)
+                            char **body, int *b_size, char **ctype, xs_str **etag)
 {
     int status = HTTP_STATUS_OK;
     const char *accept = xs_dict_get(req, "accept");
@@ -2839,23 +3604,39 @@ int activitypub_get_handler(const xs_dict *req, const char *q_path,
 
     if (p_path == NULL) {
         /* if there was no component after the user, it's an actor request */
-        msg = msg_actor(&snac);
+        const char *inm = xs_dict_get(req, "if-none-match");
+
+        *body  = msg_actor_json(&snac, etag);
         *ctype = "application/ld+json; profile=\"https://www.w3.org/ns/activitystreams\"";
 
+        if (inm && strcmp(inm, *etag) == 0) {
+            /* client has the newest version */
+            *body  = xs_free(*body);
+            status = HTTP_STATUS_NOT_MODIFIED;
+        }
+        else
+            *b_size = strlen(*body);
+
         const char *ua = xs_dict_get(req, "user-agent");
 
         snac_debug(&snac, 0, xs_fmt("serving actor [%s]", ua ? ua : "No UA"));
     }
     else
-    if (strcmp(p_path, "outbox") == 0 || strcmp(p_path, "featured") == 0) {
+    if (strcmp(p_path, "outbox") == 0 || strcmp(p_path, "followers") == 0 ||
+        strcmp(p_path, "following") == 0) {
+        *body   = _coll_get(&snac, p_path, xs_dict_get(req, "q_vars"));
+        *b_size = strlen(*body);
+    }
+    else
+    if (strcmp(p_path, "featured") == 0) {
         xs *id = xs_fmt("%s/%s", snac.actor, p_path);
         xs *list = xs_list_new();
         msg = msg_collection(&snac, id);
         const char *v;
         int tc = 0;
 
-        /* get the public outbox or the pinned list */
-        xs *elems = *p_path == 'o' ? timeline_simple_list(&snac, "public", 0, 20) : pinned_list(&snac);
+        /* get the pinned list */
+        xs *elems = pinned_list(&snac);
 
         while (xs_list_next(elems, &v, &tc)) {
             xs *i = NULL;
@@ -2871,17 +3652,12 @@ int activitypub_get_handler(const xs_dict *req, const char *q_path,
             }
         }
 
-        /* replace the 'orderedItems' with the latest posts */
+        /* replace the 'orderedItems' with the pinned posts */
         xs *items = xs_number_new(xs_list_len(list));
         msg = xs_dict_set(msg, "orderedItems", list);
         msg = xs_dict_set(msg, "totalItems",   items);
     }
     else
-    if (strcmp(p_path, "followers") == 0 || strcmp(p_path, "following") == 0) {
-        xs *id = xs_fmt("%s/%s", snac.actor, p_path);
-        msg = msg_collection(&snac, id);
-    }
-    else
     if (xs_startswith(p_path, "p/")) {
         xs *id = xs_fmt("%s/%s", snac.actor, p_path);
 
@@ -2907,6 +3683,169 @@ int activitypub_get_handler(const xs_dict *req, const char *q_path,
 }
 
 
+/* Each address messages come from (as seen by the socket or appended
+   by the proxy) has a token bucket of input messages: it holds up to
+   inbox_rate_burst of them and refills at inbox_rate messages per second.
+   Hosts with their own rate in inbox_rate_hosts (as told by the keyId
+   of the HTTP signature) get a bucket for each address instead. The
+   keyId is not verified yet, so it's never used alone: nobody can
+   drain the bucket of a big host from elsewhere, and made-up keyIds
+   don't get a fresh burst each time. Buckets live in a fixed-size
+   table indexed by the hash of the key; on collision, the newcomer
+   takes the slot over. */
+
+#define INBOX_RATE_SLOTS 4096
+
+typedef struct {
+    char key[128];          /* host and address */
+    double tokens;
+    double t;               /* last refill */
+} inbox_rate_bucket;
+
+static pthread_mutex_t inbox_rate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static inbox_rate_bucket *inbox_rate_tbl = NULL;
+
+
+static int _inbox_rate_host(const xs_dict *req, char *host, int size)
+/* gets the host a message claims to come from; returns 0 if unknown */
+{
+    const char *p = xs_dict_get(req, "signature");
+    int n = 0;
+
+    if (p && (p = strstr(p, "keyId=\"")) != NULL) {
+        p += 7;
+
+        const char *s = strstr(p, "://");
+        const char *q = strchr(p, '"');
+
+        if (s != NULL && (q == NULL || s < q))
+            p = s + 3;
+
+        while (*p && !strchr("/:\"#?", *p) && n < size - 1)
+            host[n++] = tolower((unsigned char)*p++);
+    }
+
+    host[n] = '\0';
+
+    return n;
+}
+
+
+static int _inbox_rate_addr(const xs_dict *req, const char *peer, char *addr, int size)
+/* gets the address a message comes from; returns 0 if unknown */
+{
+    const char *p;
+    int n = 0;
+
+    if ((p = xs_dict_get(req, "x-forwarded-for")) != NULL) {
+        /* the last one is the one the proxy saw (the ones
+           before it are whatever the client sent) */
+        const char *l = strrchr(p, ',');
+
+        if (l != NULL)
+            p = l + 1;
+    }
+    else
+    if ((p = xs_dict_get(req, "x-real-ip")) == NULL)
+        p = peer;
+
+    if (p != NULL) {
+        while (*p == ' ')
+            p++;
+
+        while (*p && *p != ',' && *p != ' ' && n < size - 1)
+            addr[n++] = *p++;
+    }
+
+    addr[n] = '\0';
+
+    return n;
+}
+
+
+int inbox_rate_check(const xs_dict *req, const char *peer, int *retry_after)
+/* takes a token from the bucket of the sender; returns 0 if there are none left */
+{
+    char host[64];
+    char addr[64];
+    char key[128];
+    double rate  = srv_conf->inbox_rate;
+    double burst = srv_conf->inbox_rate_burst;
+    int ok = 1;
+
+    if (rate <= 0.0 || !_inbox_rate_addr(req, peer, addr, sizeof(addr)))
+        return 1;
+
+    /* trusted hosts may have a bigger rate */
+    const xs_number *v = NULL;
+
+    if (_inbox_rate_host(req, host, sizeof(host)))
+        v = xs_dict_get(srv_conf->inbox_rate_hosts, host);
+
+    if (xs_type(v) == XSTYPE_NUMBER) {
+        double r = xs_number_get(v);
+
+        if (r <= 0.0)
+            return 1;
+
+        burst = burst * r / rate;
+        rate  = r;
+
+        snprintf(key, sizeof(key), "%s %s", host, addr);
+    }
+    else
+        snprintf(key, sizeof(key), "%s", addr);
+
+    if (burst < 1.0)
+        burst = 1.0;
+
+    pthread_mutex_lock(&inbox_rate_mutex);
+
+    if (inbox_rate_tbl == NULL) {
+        int h = xs_arena_hold(1);
+
+        inbox_rate_tbl = xs_realloc(NULL, INBOX_RATE_SLOTS * sizeof(inbox_rate_bucket));
+        memset(inbox_rate_tbl, '\0', INBOX_RATE_SLOTS * sizeof(inbox_rate_bucket));
+
+        xs_arena_hold(h);
+    }
+
+    inbox_rate_bucket *b = &inbox_rate_tbl[xs_hash_func(key, strlen(key)) % INBOX_RATE_SLOTS];
+    double t = ftime();
+
+    if (strcmp(b->key, key) != 0) {
+        /* new (or evicted) sender: full bucket */
+        strcpy(b->key, key);
+        b->tokens = burst;
+    }
+    else {
+        b->tokens += (t - b->t) * rate;
+
+        if (b->tokens > burst)
+            b->tokens = burst;
+    }
+
+    b->t = t;
+
+    if (b->tokens >= 1.0)
+        b->tokens -= 1.0;
+    else {
+        ok = 0;
+        *retry_after = (int)((1.0 - b->tokens) / rate) + 1;
+
+        if (p_state != NULL)
+            p_state->inbox_limited++;
+    }
+
+    pthread_mutex_unlock(&inbox_rate_mutex);
+
+    if (!ok)
+        srv_debug(1, xs_fmt("inbox_rate_check too many messages from %s", key));
+
+    return ok;
+}
+
+
 int activitypub_post_handler(const xs_dict *req, const char *q_path,
                              char *payload, int p_size,
                              char **body, int *b_size, char **ctype)
@@ -2935,6 +3874,21 @@ int activitypub_post_handler(const xs_dict *req, const char *q_path,
         xs_str_in(i_ctype, "application/ld+json") == -1)
         return 0;
 
+    /* already got this very same message? */
+    xs *seen = inbox_seen_key(q_path, payload, p_size);
+
+    if (inbox_seen_check(seen, 0)) {
+        srv_debug(1, xs_fmt("activitypub_post_handler duplicate message to %s", q_path));
+
+        if (p_state != NULL) {
+            p_state->inbox_dups++;
+            p_state->inbox_dup_bytes += p_size;
+        }
+
+        *ctype = "application/activity+json";
+        return HTTP_STATUS_ACCEPTED;
+    }
+
     /* decode the message */
     xs *msg = xs_json_loads(payload);
     const char *id = xs_dict_get(msg, "id");
@@ -2961,7 +3915,7 @@ int activitypub_post_handler(const xs_dict *req, const char *q_path,
     xs *l = xs_split_n(q_path, "/", 2);
 
     if (xs_list_len(l) == 2 && strcmp(xs_list_get(l, 1), "shared-inbox") == 0) {
-        enqueue_shared_input(msg, req, 0);
+        enqueue_shared_input(msg, req, seen, 0);
         return HTTP_STATUS_ACCEPTED;
     }
 
@@ -3005,7 +3959,7 @@ int activitypub_post_handler(const xs_dict *req, const char *q_path,
     }
 
     if (valid_status(status)) {
-        enqueue_input(&snac, msg, req, 0);
+        enqueue_input(&snac, msg, req, seen, 0);
         *ctype = "application/activity+json";
     }
 
@@ -0,0 +1,939 @@
+/* snac - A simple, minimalistic ActivityPub instance */
+/* copyright (c) 2022 - 2024 grunfink et al. / MIT license */
+
+#include "xs.h"
+#include "xs_io.h"
+#include "xs_json.h"
+#include "xs_curl.h"
+#include "xs_openssl.h"
+#include "xs_socket.h"
+#include "xs_httpd.h"
+#include "xs_time.h"
+#include "xs_random.h"
+#include "xs_glob.h"
+
+#include "snac.h"
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/* A load-replay benchmark. It creates a throwaway instance in a
+   temporary directory, seeds it with users, followers and posts,
+   starts the real httpd in a child process together with a stub
+   'remote instance' (that serves the follower actors and accepts
+   deliveries) and drives a realistic traffic mix against it,
+   reporting latency percentiles, throughput and the CPU and
+   block i/o used by the server process. */
+
+#define BENCH_PASSWD "bench"
+#define BENCH_PUBLIC "https:/" "/www.w3.org/ns/activitystreams#Public"
+
+struct bench_opts {
+    int users;          /* number of local users */
+    int followers;      /* number of remote actors (following and followed) */
+    int posts;          /* number of seeded posts per user */
+    int requests;       /* number of requests to send */
+    int concurrency;    /* number of client threads */
+    int rate;           /* requests per second (0, as fast as possible) */
+    int threads;        /* server num_threads (0, server default) */
+    int drain;          /* max seconds to wait for the queues to drain */
+    int keep;           /* don't delete the instance directory */
+    int arena;          /* use per-job memory arenas in the server */
+};
+
+struct bench_req {
+    xs_str *kind;       /* traffic class for the report */
+    xs_str *method;
+    xs_str *url;
+    xs_dict *headers;
+    xs_str *body;
+    int signer;         /* remote actor that signs it, or -1 */
+    double latency;     /* measured, in seconds */
+    int status;         /* measured */
+};
+
+static struct {
+    struct bench_opts o;
+    struct bench_req *reqs;
+    int n_reqs;
+    int next;
+    double t_start;
+    xs_list *remote_actors;
+    xs_list *remote_keys;
+    pthread_mutex_t mutex;
+} bench_st;
+
+
+static double bench_now(void)
+/* returns a monotonic time in seconds */
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+
+static int bench_free_port(void)
+/* asks the kernel for a free TCP port */
+{
+    struct sockaddr_in sa;
+    socklen_t sl = sizeof(sa);
+    int s, port = -1;
+
+    if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        return -1;
+
+    memset(&sa, '\0', sizeof(sa));
+    sa.sin_family      = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(s, (struct sockaddr *)&sa, sizeof(sa)) != -1 &&
+        getsockname(s, (struct sockaddr *)&sa, &sl) != -1)
+        port = ntohs(sa.sin_port);
+
+    close(s);
+
+    return port;
+}
+
+
+static int bench_parse_opts(struct bench_opts *o, const char *spec)
+/* parses a key=value,key=value benchmark specification */
+{
+    *o = (struct bench_opts) {
+        .users = 2, .followers = 8, .posts = 20, .requests = 1000,
+        .concurrency = 8, .rate = 0, .threads = 0, .drain = 30, .keep = 0, .arena = 0
+    };
+
+    if (spec == NULL || *spec == '\0' || strcmp(spec, "default") == 0)
+        return 1;
+
+    xs *l = xs_split(spec, ",");
+    const char *v;
+
+    xs_list_foreach(l, v) {
+        xs *kv = xs_split_n(v, "=", 1);
+        const char *k = xs_list_get(kv, 0);
+        const char *n = xs_list_get(kv, 1);
+        int i;
+
+        if (n == NULL || (i = atoi(n)) < 0) {
+            fprintf(stderr, "bench: bad option '%s'\n", v);
+            return 0;
+        }
+
+        if (strcmp(k, "users") == 0)
+            o->users = i;
+        else
+        if (strcmp(k, "followers") == 0)
+            o->followers = i;
+        else
+        if (strcmp(k, "posts") == 0)
+            o->posts = i;
+        else
+        if (strcmp(k, "requests") == 0)
+            o->requests = i;
+        else
+        if (strcmp(k, "concurrency") == 0)
+            o->concurrency = i;
+        else
+        if (strcmp(k, "rate") == 0)
+            o->rate = i;
+        else
+        if (strcmp(k, "threads") == 0)
+            o->threads = i;
+        else
+        if (strcmp(k, "drain") == 0)
+            o->drain = i;
+        else
+        if (strcmp(k, "keep") == 0)
+            o->keep = i;
+        else
+        if (strcmp(k, "arena") == 0)
+            o->arena = i;
+        else {
+            fprintf(stderr, "bench: unknown option '%s'\n", k);
+            return 0;
+        }
+    }
+
+    if (o->users < 1)
+        o->users = 1;
+    if (o->followers < 1)
+        o->followers = 1;
+    if (o->concurrency < 1)
+        o->concurrency = 1;
+
+    return 1;
+}
+
+
+static xs_dict *bench_remote_actor(const char *base, int n, const char *pubkey)
+/* creates the actor object for a stub remote actor */
+{
+    xs *id    = xs_fmt("%s/actor/%d", base, n);
+    xs *name  = xs_fmt("remote%d", n);
+    xs *inbox = xs_fmt("%s/inbox", id);
+    xs *shib  = xs_fmt("%s/inbox", base);
+    xs *kid   = xs_fmt("%s#main-key", id);
+    xs *date  = xs_str_utctime(time(NULL) - 365 * 24 * 3600, ISO_DATE_SPEC);
+    xs *pkey  = xs_dict_new();
+    xs *ep    = xs_dict_new();
+    xs_dict *a = xs_dict_new();
+
+    pkey = xs_dict_append(pkey, "id",           kid);
+    pkey = xs_dict_append(pkey, "owner",        id);
+    pkey = xs_dict_append(pkey, "publicKeyPem", pubkey);
+
+    ep = xs_dict_append(ep, "sharedInbox", shib);
+
+    a = xs_dict_append(a, "@context",          "https:/" "/www.w3.org/ns/activitystreams");
+    a = xs_dict_append(a, "id",                id);
+    a = xs_dict_append(a, "type",              "Person");
+    a = xs_dict_append(a, "preferredUsername", name);
+    a = xs_dict_append(a, "name",              name);
+    a = xs_dict_append(a, "summary",           "");
+    a = xs_dict_append(a, "published",         date);
+    a = xs_dict_append(a, "inbox",             inbox);
+    a = xs_dict_append(a, "endpoints",         ep);
+    a = xs_dict_append(a, "publicKey",         pkey);
+
+    return a;
+}
+
+
+static void bench_stub(int port)
+/* the stub remote instance: serves actors and accepts everything else */
+{
+    xs *sport = xs_fmt("%d", port);
+    int rs;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((rs = xs_socket_server("127.0.0.1", sport)) == -1) {
+        fprintf(stderr, "bench: cannot bind stub server to port %d\n", port);
+        return;
+    }
+
+    for (;;) {
+        int cs = xs_socket_accept(rs);
+        FILE *f;
+
+        if (cs == -1)
+            continue;
+
+        if ((f = fdopen(cs, "r+")) == NULL) {
+            close(cs);
+            continue;
+        }
+
+        xs *payload = NULL;
+        int p_size  = 0;
+        xs *req     = xs_httpd_request(f, &payload, &p_size);
+
+        if (req != NULL) {
+            const char *method = xs_dict_get(req, "method");
+            const char *path   = xs_dict_get(req, "path");
+            xs *headers = xs_dict_new();
+            int status  = HTTP_STATUS_ACCEPTED;
+            xs *body    = NULL;
+            int n;
+
+            if (strcmp(method, "GET") == 0) {
+                status = HTTP_STATUS_NOT_FOUND;
+
+                if (sscanf(path, "/actor/%d", &n) == 1 &&
+                    n >= 0 && n < xs_list_len(bench_st.remote_actors)) {
+                    body   = xs_json_dumps(xs_list_get(bench_st.remote_actors, n), 4);
+                    status = HTTP_STATUS_OK;
+
+                    headers = xs_dict_append(headers, "content-type", "application/activity+json");
+                }
+            }
+
+            xs_httpd_response(f, status, http_status_text(status),
+                              headers, body, body ? strlen(body) : 0);
+        }
+
+        fclose(f);
+    }
+}
+
+
+static void bench_add_req(const char *kind, const char *method,
+                          const char *url, const xs_dict *headers,
+                          const char *body, int signer)
+/* adds a request to the traffic list */
+{
+    struct bench_req *r;
+
+    bench_st.reqs = xs_realloc(bench_st.reqs, (bench_st.n_reqs + 1) * sizeof(*r));
+    r = &bench_st.reqs[bench_st.n_reqs++];
+
+    *r = (struct bench_req) { 0 };
+
+    r->kind    = xs_dup(kind);
+    r->method  = xs_dup(method);
+    r->url     = xs_dup(url);
+    r->headers = headers ? xs_dup(headers) : xs_dict_new();
+    r->body    = body ? xs_dup(body) : NULL;
+    r->signer  = signer;
+}
+
+
+static int bench_synth_traffic(xs_list *tokens)
+/* builds a synthetic traffic mix */
+{
+    const struct bench_opts *o = &bench_st.o;
+    xs *users = user_list();
+    int n;
+
+    for (n = 0; n < o->requests; n++) {
+        const char *uid = xs_list_get(users, n % xs_list_len(users));
+        const char *tok = xs_list_get(tokens, n % xs_list_len(tokens));
+        xs *actor = xs_fmt("%s/%s", srv_baseurl, uid);
+        int slot = n % 20;
+
+        if (slot < 6) {
+            /* federation: a signed public Create from a remote actor */
+            int ra = n % xs_list_len(bench_st.remote_actors);
+            const xs_dict *a = xs_list_get(bench_st.remote_actors, ra);
+            const char *aid = xs_dict_get(a, "id");
+            xs *nid  = xs_fmt("%s/note/%d", aid, n);
+            xs *cid  = xs_fmt("%s/activity", nid);
+            xs *date = xs_str_utctime(0, ISO_DATE_SPEC);
+            xs *cont = xs_fmt("<p>benchmark note #%d for <a href=\"%s\">@%s</a></p>", n, actor, uid);
+            xs *to   = xs_list_append(xs_list_new(), BENCH_PUBLIC);
+            xs *cc   = xs_list_append(xs_list_new(), actor);
+            xs *note = xs_dict_new();
+            xs *msg  = xs_dict_new();
+
+            note = xs_dict_append(note, "id",           nid);
+            note = xs_dict_append(note, "type",         "Note");
+            note = xs_dict_append(note, "attributedTo", aid);
+            note = xs_dict_append(note, "published",    date);
+            note = xs_dict_append(note, "content",      cont);
+            note = xs_dict_append(note, "to",           to);
+            note = xs_dict_append(note, "cc",           cc);
+
+            msg = xs_dict_append(msg, "@context",  "https:/" "/www.w3.org/ns/activitystreams");
+            msg = xs_dict_append(msg, "id",        cid);
+            msg = xs_dict_append(msg, "type",      "Create");
+            msg = xs_dict_append(msg, "actor",     aid);
+            msg = xs_dict_append(msg, "published", date);
+            msg = xs_dict_append(msg, "to",        to);
+            msg = xs_dict_append(msg, "cc",        cc);
+            msg = xs_dict_append(msg, "object",    note);
+
+            xs *body = xs_json_dumps(msg, 4);
+            xs *url  = xs_fmt("%s/inbox", actor);
+            xs *hdrs = xs_dict_new();
+
+            hdrs = xs_dict_append(hdrs, "content-type", "application/activity+json");
+
+            bench_add_req("inbox", "POST", url, hdrs, body, ra);
+        }
+        else
+        if (slot < 10) {
+            /* anonymous visitors to the public timeline */
+            xs *hdrs = xs_dict_new();
+            hdrs = xs_dict_append(hdrs, "accept", "text/html");
+
+            bench_add_req("html_public", "GET", actor, hdrs, NULL, -1);
+        }
+        else
+        if (slot < 12) {
+            /* the user reading the private timeline in the web UI */
+            xs *url  = xs_fmt("%s/admin", actor);
+            xs *cred = xs_fmt("%s:%s", uid, BENCH_PASSWD);
+            xs *b64  = xs_base64_enc(cred, strlen(cred));
+            xs *auth = xs_fmt("Basic %s", b64);
+            xs *hdrs = xs_dict_new();
+
+            hdrs = xs_dict_append(hdrs, "accept",        "text/html");
+            hdrs = xs_dict_append(hdrs, "authorization", auth);
+
+            bench_add_req("html_admin", "GET", url, hdrs, NULL, -1);
+        }
+        else
+        if (slot < 17) {
+            /* Mastodon API client polling */
+            static const char *paths[] = {
+                "/api/v1/timelines/home", "/api/v1/notifications",
+                "/api/v1/timelines/public?local=true", "/api/v1/instance",
+                "/api/v1/accounts/verify_credentials"
+            };
+            xs *url  = xs_fmt("%s%s", srv_baseurl, paths[slot - 12]);
+            xs *auth = xs_fmt("Bearer %s", tok ? tok : "");
+            xs *hdrs = xs_dict_new();
+
+            hdrs = xs_dict_append(hdrs, "accept", "application/json");
+
+            if (tok != NULL)
+                hdrs = xs_dict_append(hdrs, "authorization", auth);
+
+            bench_add_req("mastoapi", "GET", url, hdrs, NULL, -1);
+        }
+        else
+        if (slot < 19) {
+            /* remote instances resolving the user */
+            xs *url  = xs_fmt("%s/.well-known/webfinger?resource=acct:%s@%s",
+                        srv_baseurl, uid, xs_dict_get(srv_config, "host"));
+
+            bench_add_req("webfinger", "GET", url, NULL, NULL, -1);
+        }
+        else {
+            /* remote instances fetching the actor */
+            xs *hdrs = xs_dict_new();
+            hdrs = xs_dict_append(hdrs, "accept", "application/activity+json");
+
+            bench_add_req("actor", "GET", actor, hdrs, NULL, -1);
+        }
+    }
+
+    return n;
+}
+
+
+static int bench_file_traffic(const char *fn, xs_list *tokens)
+/* loads a traffic file (one JSON object per line) */
+{
+    FILE *f;
+    int n = 0;
+
+    if ((f = fopen(fn, "r")) == NULL) {
+        fprintf(stderr, "bench: cannot open '%s'\n", fn);
+        return -1;
+    }
+
+    while (!feof(f)) {
+        xs *line = xs_strip_i(xs_readline(f));
+
+        if (*line == '\0' || *line == '#')
+            continue;
+
+        xs *e = xs_json_loads(line);
+
+        if (xs_type(e) != XSTYPE_DICT) {
+            fprintf(stderr, "bench: bad line in '%s'\n", fn);
+            continue;
+        }
+
+        const char *method = xs_dict_get(e, "method");
+        const char *path   = xs_dict_get(e, "path");
+        const char *kind   = xs_dict_get(e, "kind");
+        const xs_dict *h   = xs_dict_get(e, "headers");
+        const xs_val *body = xs_dict_get(e, "body");
+        const char *v;
+        xs *hdrs = xs_type(h) == XSTYPE_DICT ? xs_dup(h) : xs_dict_new();
+        xs *sbody = NULL;
+        int signer = -1;
+
+        if (xs_type(path) != XSTYPE_STRING)
+            continue;
+
+        if (xs_type(method) != XSTYPE_STRING)
+            method = "GET";
+
+        if (xs_type(body) == XSTYPE_DICT || xs_type(body) == XSTYPE_LIST)
+            sbody = xs_json_dumps(body, 4);
+        else
+        if (xs_type(body) == XSTYPE_STRING)
+            sbody = xs_dup(body);
+
+        if (xs_type(v = xs_dict_get(e, "accept")) == XSTYPE_STRING)
+            hdrs = xs_dict_set(hdrs, "accept", v);
+
+        if (xs_type(xs_dict_get(e, "signed")) == XSTYPE_TRUE)
+            signer = n % xs_list_len(bench_st.remote_actors);
+
+        if (xs_type(xs_dict_get(e, "token")) == XSTYPE_TRUE) {
+            const char *tok = xs_list_get(tokens, n % xs_list_len(tokens));
+
+            if (tok != NULL) {
+                xs *auth = xs_fmt("Bearer %s", tok);
+                hdrs = xs_dict_set(hdrs, "authorization", auth);
+            }
+        }
+
+        if (sbody != NULL && xs_is_null(xs_dict_get(hdrs, "content-type")))
+            hdrs = xs_dict_set(hdrs, "content-type", "application/activity+json");
+
+        xs *url = xs_fmt("%s%s", srv_baseurl, path);
+
+        bench_add_req(xs_type(kind) == XSTYPE_STRING ? kind : "replay",
+                      method, url, hdrs, sbody, signer);
+        n++;
+    }
+
+    fclose(f);
+
+    return n;
+}
+
+
+static void *bench_client(void *arg)
+/* a client thread */
+{
+    (void)arg;
+
+    for (;;) {
+        struct bench_req *r;
+        int i;
+
+        pthread_mutex_lock(&bench_st.mutex);
+        i = bench_st.next++;
+        pthread_mutex_unlock(&bench_st.mutex);
+
+        if (i >= bench_st.n_reqs)
+            break;
+
+        r = &bench_st.reqs[i];
+
+        if (bench_st.o.rate > 0) {
+            /* open loop: wait until this request is scheduled */
+            double t = bench_st.t_start + (double)i / (double)bench_st.o.rate;
+            double w = t - bench_now();
+
+            if (w > 0.0)
+                usleep((useconds_t)(w * 1000000.0));
+        }
+
+        xs *payload = NULL;
+        xs *rsp     = NULL;
+        int p_size  = 0;
+        int b_size  = r->body ? strlen(r->body) : 0;
+        double t0   = bench_now();
+
+        if (r->signer >= 0) {
+            const xs_dict *a = xs_list_get(bench_st.remote_actors, r->signer);
+            const xs_dict *k = xs_list_get(bench_st.remote_keys, r->signer);
+            xs *keyid = xs_fmt("%s#main-key", xs_dict_get(a, "id"));
+
+            rsp = http_signed_request_raw(keyid, xs_dict_get(k, "secret"),
+                        r->method, r->url, r->headers, r->body, b_size,
+                        &r->status, &payload, &p_size, 30);
+        }
+        else
+            rsp = xs_http_request(r->method, r->url, r->headers, r->body, b_size,
+                        &r->status, &payload, &p_size, 30);
+
+        r->latency = bench_now() - t0;
+    }
+
+    return NULL;
+}
+
+
+static int bench_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+static void bench_report_kind(const char *kind)
+/* prints the latency percentiles of a traffic class (or all, if NULL) */
+{
+    double *lat = malloc(sizeof(double) * (bench_st.n_reqs + 1));
+    int n = 0, ok = 0, errs = 0, i;
+
+    for (i = 0; i < bench_st.n_reqs; i++) {
+        const struct bench_req *r = &bench_st.reqs[i];
+
+        if (kind == NULL || strcmp(kind, r->kind) == 0) {
+            lat[n++] = r->latency;
+
+            if (valid_status(r->status) || r->status == HTTP_STATUS_NOT_MODIFIED)
+                ok++;
+            else
+                errs++;
+        }
+    }
+
+    if (n > 0) {
+        const char *k = kind ? kind : "all";
+
+        qsort(lat, n, sizeof(double), bench_cmp);
+
+        printf("%s.requests: %d\n", k, n);
+        printf("%s.ok: %d\n", k, ok);
+        printf("%s.errors: %d\n", k, errs);
+        printf("%s.p50_ms: %.3f\n", k, lat[(n - 1) * 50 / 100] * 1000.0);
+        printf("%s.p90_ms: %.3f\n", k, lat[(n - 1) * 90 / 100] * 1000.0);
+        printf("%s.p99_ms: %.3f\n", k, lat[(n - 1) * 99 / 100] * 1000.0);
+        printf("%s.max_ms: %.3f\n", k, lat[n - 1] * 1000.0);
+    }
+
+    free(lat);
+}
+
+
+static int bench_queue_len(void)
+/* returns the number of pending queue items (global and users) */
+{
+    xs *spec = xs_fmt("%s/queue/" "*.json", srv_basedir);
+    xs *l = xs_glob(spec, 0, 0);
+    int n = xs_list_len(l);
+
+    xs *spec2 = xs_fmt("%s/user/" "*/queue/" "*.json", srv_basedir);
+    xs *l2 = xs_glob(spec2, 0, 0);
+
+    return n + xs_list_len(l2);
+}
+
+
+static int bench_seed(xs_list **tokens)
+/* creates the users, the remote actors and the posts */
+{
+    const struct bench_opts *o = &bench_st.o;
+    int n, m;
+
+    /* adduser() is chatty; silence it */
+    fflush(stdout);
+    int saved_fd = dup(1);
+    int null_fd  = open("/dev/null", O_WRONLY);
+    dup2(null_fd, 1);
+
+    for (n = 0; n < o->users; n++) {
+        xs *uid = xs_fmt("bench%d", n);
+
+        if (adduser(uid) != 0)
+            break;
+    }
+
+    fflush(stdout);
+    dup2(saved_fd, 1);
+    close(saved_fd);
+    close(null_fd);
+
+    if (n < o->users) {
+        fprintf(stderr, "bench: cannot create users\n");
+        return 0;
+    }
+
+    xs *users = user_list();
+    const char *uid;
+
+    xs_list_foreach(users, uid) {
+        snac user;
+
+        if (!user_open(&user, uid))
+            continue;
+
+        /* set a known password */
+        xs *pwd = hash_password(uid, BENCH_PASSWD, NULL);
+        user.config = xs_dict_set(user.config, "passwd", pwd);
+        user_persist(&user, 0);
+
+        /* each user follows and is followed by all remote actors */
+        const xs_dict *a;
+        xs_list_foreach(bench_st.remote_actors, a) {
+            const char *aid = xs_dict_get(a, "id");
+            xs *follow = msg_follow(&user, aid);
+
+            if (follow == NULL)
+                continue;
+
+            xs *accept = xs_dict_new();
+            accept = xs_dict_append(accept, "type",   "Accept");
+            accept = xs_dict_append(accept, "actor",  aid);
+            accept = xs_dict_append(accept, "object", follow);
+
+            following_add(&user, aid, accept);
+            follower_add(&user, aid);
+        }
+
+        /* the user's own posts */
+        for (m = 0; m < o->posts; m++) {
+            xs *content = xs_fmt("Benchmark post #%d by %s. #bench", m, uid);
+            xs *msg = msg_note(&user, content, NULL, NULL, NULL, 0);
+            const char *id = xs_dict_get(msg, "id");
+
+            timeline_add(&user, id, msg);
+        }
+
+#ifndef NO_MASTODON_API
+        {
+            /* a Mastodon API token */
+            char rnd[16];
+            xs_rnd_buf(rnd, sizeof(rnd));
+            xs *tokid = xs_md5_hex(rnd, sizeof(rnd));
+            xs *token = xs_dict_new();
+
+            token = xs_dict_append(token, "token",     tokid);
+            token = xs_dict_append(token, "client_id", "bench");
+            token = xs_dict_append(token, "me",        user.actor);
+            token = xs_dict_append(token, "uid",       uid);
+            token = xs_dict_append(token, "code",      "");
+
+            if (token_add(tokid, token) == HTTP_STATUS_CREATED)
+                *tokens = xs_list_append(*tokens, tokid);
+        }
+#endif
+
+        user_free(&user);
+    }
+
+    return 1;
+}
+
+
+int bench(const char *spec, const char *traffic_fn)
+/* runs a load benchmark against a temporary instance */
+{
+    char tmpl[] = "/tmp/snac-bench-XXXXXX";
+    xs *tokens = xs_list_new();
+    pid_t stub_pid = -1, srv_pid = -1;
+    int ret = 1;
+    int n;
+
+    if (!bench_parse_opts(&bench_st.o, spec))
+        return 1;
+
+    if (mkdtemp(tmpl) == NULL) {
+        fprintf(stderr, "bench: cannot create temporary directory\n");
+        return 1;
+    }
+
+    int port = bench_free_port();
+    int stub_port = bench_free_port();
+
+    if (port == -1 || stub_port == -1 || port == stub_port) {
+        fprintf(stderr, "bench: cannot find free ports\n");
+        goto end;
+    }
+
+    {
+        /* create the instance */
+        xs *host = xs_fmt("127.0.0.1:%d", port);
+        xs *cfg  = xs_dict_new();
+        xs *lay  = xs_number_new(disk_layout);
+        xs *prt  = xs_number_new(port);
+        xs *thr  = xs_number_new(bench_st.o.threads);
+        xs *zero = xs_number_new(0);
+        const char *dirs[] = { "user", "object", "queue", NULL };
+        FILE *f;
+
+        cfg = xs_dict_append(cfg, "host",                 host);
+        cfg = xs_dict_append(cfg, "prefix",               "");
+        cfg = xs_dict_append(cfg, "address",              "127.0.0.1");
+        cfg = xs_dict_append(cfg, "port",                 prt);
+        cfg = xs_dict_append(cfg, "layout",               lay);
+        cfg = xs_dict_append(cfg, "dbglevel",             zero);
+        cfg = xs_dict_append(cfg, "num_threads",          thr);
+        cfg = xs_dict_append(cfg, "protocol",             "http");
+        cfg = xs_dict_append(cfg, "short_description",    "snac benchmark instance");
+        cfg = xs_dict_append(cfg, "job_arena",            xs_stock(bench_st.o.arena ? XSTYPE_TRUE : XSTYPE_FALSE));
+
+        for (n = 0; dirs[n]; n++) {
+            xs *d = xs_fmt("%s/%s", tmpl, dirs[n]);
+            mkdirx(d);
+        }
+
+        xs *cfn = xs_fmt("%s/server.json", tmpl);
+        if ((f = fopen(cfn, "w")) == NULL) {
+            fprintf(stderr, "bench: cannot create '%s'\n", cfn);
+            goto end;
+        }
+
+        xs_json_dump(cfg, 4, f);
+        fclose(f);
+
+        if (!srv_open(tmpl, 0)) {
+            fprintf(stderr, "bench: cannot open instance at %s\n", tmpl);
+            goto end;
+        }
+
+        write_default_css();
+    }
+
+    /* the stub remote actors */
+    bench_st.remote_actors = xs_list_new();
+    bench_st.remote_keys   = xs_list_new();
+
+    {
+        xs *base = xs_fmt("http:/" "/localhost:%d", stub_port);
+
+        for (n = 0; n < bench_st.o.followers; n++) {
+            xs *key   = xs_evp_genkey(2048);
+            xs *actor = bench_remote_actor(base, n, xs_dict_get(key, "public"));
+
+            actor_add(xs_dict_get(actor, "id"), actor);
+
+            bench_st.remote_actors = xs_list_append(bench_st.remote_actors, actor);
+            bench_st.remote_keys   = xs_list_append(bench_st.remote_keys, key);
+        }
+    }
+
+    fprintf(stderr, "bench: seeding %s\n", tmpl);
+
+    if (!bench_seed(&tokens))
+        goto end;
+
+    /* build the traffic */
+    if (traffic_fn != NULL)
+        n = bench_file_traffic(traffic_fn, tokens);
+    else
+        n = bench_synth_traffic(tokens);
+
+    if (n <= 0) {
+        fprintf(stderr, "bench: no traffic\n");
+        goto end;
+    }
+
+    /* start the stub and the server */
+    fflush(stdout);
+    fflush(stderr);
+
+    if ((stub_pid = fork()) == 0) {
+        bench_stub(stub_port);
+        _exit(0);
+    }
+
+    if ((srv_pid = fork()) == 0) {
+        /* keep the server quiet */
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, 2);
+        close(null_fd);
+
+        httpd();
+        _exit(0);
+    }
+
+    if (stub_pid == -1 || srv_pid == -1) {
+        fprintf(stderr, "bench: fork error\n");
+        goto end;
+    }
+
+    {
+        /* wait until the server answers (this also initializes curl) */
+        xs *url = xs_fmt("%s/robots.txt", srv_baseurl);
+        int status = 0;
+
+        for (n = 0; n < 100; n++) {
+            xs *rsp = xs_http_request("GET", url, NULL, NULL, 0, &status, NULL, NULL, 1);
+
+            if (valid_status(status))
+                break;
+
+            usleep(100000);
+        }
+
+        if (!valid_status(status)) {
+            fprintf(stderr, "bench: server did not start\n");
+            goto end;
+        }
+    }
+
+    fprintf(stderr, "bench: sending %d requests (concurrency %d)\n",
+        bench_st.n_reqs, bench_st.o.concurrency);
+
+    {
+        pthread_t *th = calloc(bench_st.o.concurrency, sizeof(pthread_t));
+        double elapsed, drained;
+
+        pthread_mutex_init(&bench_st.mutex, NULL);
+        bench_st.next    = 0;
+        bench_st.t_start = bench_now();
+
+        for (n = 0; n < bench_st.o.concurrency; n++)
+            pthread_create(&th[n], NULL, bench_client, NULL);
+
+        for (n = 0; n < bench_st.o.concurrency; n++)
+            pthread_join(th[n], NULL);
+
+        elapsed = bench_now() - bench_st.t_start;
+        free(th);
+
+        /* wait for the background work to finish */
+        for (n = 0; n < bench_st.o.drain * 10 && bench_queue_len(); n++)
+            usleep(100000);
+
+        drained = bench_now() - bench_st.t_start;
+
+        /* stop the server and collect its resource usage */
+        struct rusage ru;
+
+        kill(srv_pid, SIGTERM);
+        waitpid(srv_pid, NULL, 0);
+        srv_pid = -1;
+
+        getrusage(RUSAGE_CHILDREN, &ru);
+
+        printf("version: %s\n", VERSION);
+        printf("users: %d\n", bench_st.o.users);
+        printf("followers: %d\n", bench_st.o.followers);
+        printf("posts: %d\n", bench_st.o.posts);
+        printf("concurrency: %d\n", bench_st.o.concurrency);
+        printf("rate: %d\n", bench_st.o.rate);
+        printf("arena: %d\n", bench_st.o.arena);
+        printf("elapsed_s: %.3f\n", elapsed);
+        printf("drained_s: %.3f\n", drained);
+        printf("pending_queue: %d\n", bench_queue_len());
+        printf("throughput_rps: %.1f\n", (double)bench_st.n_reqs / elapsed);
+
+        bench_report_kind(NULL);
+
+        const char *kinds[] = { "inbox", "html_public", "html_admin", "mastoapi",
+                                "webfinger", "actor", "replay", NULL };
+
+        for (n = 0; kinds[n]; n++)
+            bench_report_kind(kinds[n]);
+
+        printf("server.cpu_user_s: %.3f\n", (double)ru.ru_utime.tv_sec +
+                    (double)ru.ru_utime.tv_usec / 1000000.0);
+        printf("server.cpu_sys_s: %.3f\n", (double)ru.ru_stime.tv_sec +
+                    (double)ru.ru_stime.tv_usec / 1000000.0);
+        printf("server.maxrss_kb: %ld\n", (long)ru.ru_maxrss);
+        printf("server.blocks_in: %ld\n", (long)ru.ru_inblock);
+        printf("server.blocks_out: %ld\n", (long)ru.ru_oublock);
+        printf("server.ctx_switches: %ld\n", (long)(ru.ru_nvcsw + ru.ru_nivcsw));
+    }
+
+    ret = 0;
+
+end:
+    if (srv_pid > 0) {
+        kill(srv_pid, SIGTERM);
+        waitpid(srv_pid, NULL, 0);
+    }
+
+    if (stub_pid > 0) {
+        kill(stub_pid, SIGKILL);
+        waitpid(stub_pid, NULL, 0);
+    }
+
+    for (n = 0; n < bench_st.n_reqs; n++) {
+        struct bench_req *r = &bench_st.reqs[n];
+
+        xs_free(r->kind);
+        xs_free(r->method);
+        xs_free(r->url);
+        xs_free(r->headers);
+        xs_free(r->body);
+    }
+
+    bench_st.reqs = xs_free(bench_st.reqs);
+    bench_st.n_reqs = 0;
+
+    bench_st.remote_actors = xs_free(bench_st.remote_actors);
+    bench_st.remote_keys   = xs_free(bench_st.remote_keys);
+
+    if (bench_st.o.keep)
+        fprintf(stderr, "bench: instance kept at %s\n", tmpl);
+    else
+        rm_rf(tmpl);
+
+    return ret;
+}
@@ -8,6 +8,7 @@
 #include "xs_openssl.h"
 #include "xs_glob.h"
 #include "xs_set.h"
+#include "xs_vec.h"
 #include "xs_time.h"
 #include "xs_regex.h"
 #include "xs_match.h"
@@ -22,14 +23,157 @@
 #include <sys/time.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <regex.h>
 
-double disk_layout = 2.7;
+double disk_layout = 3.0;
 
 /* storage serializer */
 pthread_mutex_t data_mutex = {0};
+static pthread_mutex_t stats_mutex = {0};
+static pthread_mutex_t inbox_mutex = {0};
+static pthread_mutex_t block_mutex = {0};
+static pthread_mutex_t cfilter_mutex = {0};
+static pthread_mutex_t fetch_fail_mutex = {0};
+
+#define HOME_LOCKS 16
+static pthread_mutex_t home_mutex[HOME_LOCKS];  /* by hash of the uid */
 
 int snac_upgrade(xs_str **error);
 
+/* the server settings replaced by a reload, freed in srv_free() */
+static void **srv_retired = NULL;
+static int srv_n_retired = 0;
+
+
+static const srv_cfg *_srv_cfg_build(const xs_dict *cfg)
+/* creates the typed server settings from a config dict */
+{
+    srv_cfg *c = xs_realloc(NULL, sizeof(srv_cfg));
+    const char *v;
+
+#define CFG_NUM(f, def, min) \
+    c->f = (v = xs_dict_get(cfg, #f)) != NULL ? (int)xs_number_get(v) : (def); \
+    if (c->f < (min)) { \
+        srv_log(xs_fmt("server.json: invalid value for '" #f "' (%d), using %d", c->f, (def))); \
+        c->f = (def); \
+    }
+#define CFG_BOOL(f) c->f = xs_is_true(xs_dict_get(cfg, #f))
+
+    CFG_NUM(max_timeline_entries, 50, 1);
+    CFG_NUM(queue_retry_minutes, 2, 0);
+    CFG_NUM(queue_retry_max, 10, 0);
+    CFG_NUM(min_account_age, 0, 0);
+    CFG_NUM(timeline_purge_days, 120, 0);
+    CFG_NUM(local_purge_days, 0, 0);
+    CFG_NUM(shed_inbox_queue, 5000, 0);
+    CFG_NUM(shed_html_queue, 64, 0);
+    CFG_NUM(shed_api_queue, 128, 0);
+    CFG_NUM(shed_retry_after, 60, 1);
+    CFG_NUM(inbox_rate, 10, 0);
+    CFG_NUM(inbox_rate_burst, 300, 1);
+    CFG_NUM(backfill_max, 256, 0);
+
+    CFG_BOOL(proxy_media);
+    CFG_BOOL(strict_public_timelines);
+    CFG_BOOL(show_instance_timeline);
+    CFG_BOOL(shared_inboxes);
+    CFG_BOOL(disable_inbox_collection);
+    CFG_BOOL(disable_history);
+    CFG_BOOL(disable_cache);
+    CFG_BOOL(disable_email_notifications);
+    CFG_BOOL(disable_block_notifications);
+    CFG_BOOL(hide_delete_post_button);
+    CFG_BOOL(public_social_graph);
+
+#undef CFG_NUM
+#undef CFG_BOOL
+
+    /* per-status overrides of the fetch failure TTLs */
+    if (xs_type(v = xs_dict_get(cfg, "fetch_fail_ttl")) == XSTYPE_DICT)
+        c->fetch_fail_ttl = xs_dup(v);
+    else
+        c->fetch_fail_ttl = xs_dict_new();
+
+    /* per-host overrides of inbox_rate */
+    if (xs_type(v = xs_dict_get(cfg, "inbox_rate_hosts")) == XSTYPE_DICT)
+        c->inbox_rate_hosts = xs_dup(v);
+    else
+        c->inbox_rate_hosts = xs_dict_new();
+
+    return c;
+}
+
+
+int srv_reload(void)
+/* rereads server.json and replaces the server settings */
+{
+    xs *cfg_file = xs_fmt("%s/server.json", srv_basedir);
+    FILE *f;
+
+    if ((f = fopen(cfg_file, "r")) == NULL) {
+        srv_log(xs_fmt("reload: cannot open '%s'", cfg_file));
+        return 0;
+    }
+
+    xs *cfg = xs_json_load(f);
+    fclose(f);
+
+    if (xs_type(cfg) != XSTYPE_DICT) {
+        srv_log(xs_fmt("reload: cannot parse '%s'", cfg_file));
+        return 0;
+    }
+
+    /* these are only used when the server starts */
+    static const char *restart_keys[] = {
+        "host", "prefix", "protocol", "address", "port", "fastcgi",
+        "num_threads", "job_arena", "job_arena_max_mb", "layout", NULL };
+    int n;
+
+    int h = xs_arena_hold(1);
+    xs_dict *ncfg = xs_dup(cfg);
+
+    for (n = 0; restart_keys[n]; n++) {
+        const char *k = restart_keys[n];
+        const xs_val *ov = xs_dict_get(srv_config, k);
+        const xs_val *nv = xs_dict_get(cfg, k);
+        int same = (ov == NULL && nv == NULL) || (ov != NULL && nv != NULL &&
+            xs_size(ov) == xs_size(nv) && memcmp(ov, nv, xs_size(ov)) == 0);
+
+        if (!same && strcmp(k, "layout") != 0)
+            srv_log(xs_fmt("reload: changes to '%s' need a restart", k));
+
+        /* keep the running value */
+        if (ov != NULL)
+            ncfg = xs_dict_set(ncfg, k, ov);
+        else
+            ncfg = xs_dict_del(ncfg, k);
+    }
+
+    const srv_cfg *nconf = _srv_cfg_build(ncfg);
+
+    /* the previous ones are kept, as other threads may still be
+       reading them; they're small and reloads are rare */
+    srv_retired = xs_realloc(srv_retired, (srv_n_retired + 2) * sizeof(void *));
+    srv_retired[srv_n_retired++] = srv_config;
+    srv_retired[srv_n_retired++] = (srv_cfg *)srv_conf;
+
+    xs_arena_hold(h);
+
+    /* the other threads read the settings without locking:
+       they must be complete in memory before being published */
+    __sync_synchronize();
+
+    srv_config = ncfg;
+    srv_conf   = nconf;
+
+    if (getenv("DEBUG") == NULL)
+        dbglevel = (int) xs_number_get(xs_dict_get(cfg, "dbglevel"));
+
+    srv_log(xs_fmt("server settings reloaded from %s", cfg_file));
+
+    return 1;
+}
+
 
 int srv_open(const char *basedir, int auto_upgrade)
 /* opens a server */
@@ -40,6 +184,14 @@ int srv_open(const char *basedir, int auto_upgrade)
     xs_str *error = NULL;
 
     pthread_mutex_init(&data_mutex, NULL);
+    pthread_mutex_init(&stats_mutex, NULL);
+    pthread_mutex_init(&inbox_mutex, NULL);
+    pthread_mutex_init(&block_mutex, NULL);
+    pthread_mutex_init(&cfilter_mutex, NULL);
+    pthread_mutex_init(&fetch_fail_mutex, NULL);
+
+    for (int n = 0; n < HOME_LOCKS; n++)
+        pthread_mutex_init(&home_mutex[n], NULL);
 
     srv_basedir = xs_str_new(basedir);
 
@@ -98,6 +250,8 @@ int srv_open(const char *basedir, int auto_upgrade)
     if (error != NULL)
         srv_log(error);
 
+    srv_conf = _srv_cfg_build(srv_config);
+
     /* create the queue/ subdir, just in case */
     xs *qdir = xs_fmt("%s/queue", srv_basedir);
     mkdirx(qdir);
@@ -108,19 +262,12 @@ int srv_open(const char *basedir, int auto_upgrade)
     xs *tmpdir = xs_fmt("%s/tmp", srv_basedir);
     mkdirx(tmpdir);
 
-#ifdef __APPLE__
-/* Apple uses st_atimespec instead of st_atim etc */
-#define st_atim st_atimespec
-#define st_ctim st_ctimespec
-#define st_mtim st_mtimespec
-#endif
-
 #ifdef __OpenBSD__
     if (xs_is_true(xs_dict_get(srv_config, "disable_openbsd_security"))) {
         srv_debug(1, xs_dup("OpenBSD security disabled by admin"));
     }
     else {
-        int smail = !xs_is_true(xs_dict_get(srv_config, "disable_email_notifications"));
+        int smail = !srv_conf->disable_email_notifications;
         const char *address = xs_dict_get(srv_config, "address");
 
         srv_debug(1, xs_fmt("Calling unveil()"));
@@ -182,8 +329,22 @@ void srv_free(void)
     xs_free(srv_basedir);
     xs_free(srv_config);
     xs_free(srv_baseurl);
+    xs_free((srv_cfg *)srv_conf);
+
+    for (int n = 0; n < srv_n_retired; n++)
+        xs_free(srv_retired[n]);
+
+    xs_free(srv_retired);
 
     pthread_mutex_destroy(&data_mutex);
+    pthread_mutex_destroy(&stats_mutex);
+    pthread_mutex_destroy(&inbox_mutex);
+    pthread_mutex_destroy(&block_mutex);
+    pthread_mutex_destroy(&cfilter_mutex);
+    pthread_mutex_destroy(&fetch_fail_mutex);
+
+    for (int n = 0; n < HOME_LOCKS; n++)
+        pthread_mutex_destroy(&home_mutex[n]);
 }
 
 
@@ -377,8 +538,11 @@ int user_persist(snac *snac, int publish)
     history_del(snac, "timeline.html_");
     timeline_touch(snac);
 
+    /* the actor document must be built again */
+    msg_actor_invalidate(snac);
+
     if (publish) {
-        xs *a_msg = msg_actor(snac);
+        xs *a_msg = msg_actor_cached(snac);
         xs *u_msg = msg_update(snac, a_msg);
 
         enqueue_message(snac, u_msg);
@@ -724,6 +888,46 @@ xs_list *index_list_desc(const char *fn, int skip, int show)
 }
 
 
+xs_list *index_list_desc_pos(const char *fn, int *pos, int show)
+/* returns up to show entries before position *pos (or the end, if it's
+   negative), in reverse order; *pos is set to the position of the last one */
+{
+    xs_list *list = xs_list_new();
+    int len = index_len(fn);
+    int p = *pos;
+    FILE *f;
+
+    if (p < 0 || p > len)
+        p = len;
+
+    if ((f = fopen(fn, "r")) != NULL) {
+        char md5[MD5_HEX_SIZE];
+        int n = 0;
+
+        while (n < show && p > 0) {
+            p--;
+
+            if (fseek(f, (long)p * MD5_HEX_SIZE, SEEK_SET) == -1 || !fread(md5, MD5_HEX_SIZE, 1, f))
+                break;
+
+            /* deleted? */
+            if (md5[0] == '-')
+                continue;
+
+            md5[MD5_HEX_SIZE - 1] = '\0';
+            list = xs_list_append(list, md5);
+            n++;
+        }
+
+        fclose(f);
+    }
+
+    *pos = p;
+
+    return list;
+}
+
+
 /** objects **/
 
 static xs_str *_object_fn_by_md5(const char *md5, const char *func)
@@ -850,6 +1054,16 @@ int _object_add(const char *id, const xs_dict *obj, int ow)
                 index_add(p_idx, in_reply_to);
                 srv_debug(1, xs_fmt("object_add added parent %s to %s", in_reply_to, p_idx));
             }
+
+            /* update the conversation indexes */
+            xs *t_idx = xs_replace(fn, ".json", "_t.idx");
+
+            if (mtime(t_idx) == 0.0) {
+                xs *md5   = xs_md5_hex(id, strlen(id));
+                xs *p_md5 = xs_md5_hex(in_reply_to, strlen(in_reply_to));
+
+                object_thread_add(md5, p_md5);
+            }
         }
     }
     else {
@@ -1022,6 +1236,278 @@ int object_parent(const char *md5, char parent[MD5_HEX_SIZE])
 }
 
 
+/** conversations **/
+
+/* Every reply has a _t.idx with its chain of ancestors (root first,
+   so its length is the depth) and every object with replies has a
+   _d.idx with all its descendants, in order of arrival, and a _dt.idx
+   with the same descendants followed by their parents (one 'md5 parent'
+   line each), to build the tree without opening each of them. */
+
+static xs_str *_object_thread_fn(const char *md5, const char *idxsfx)
+/* returns the file name of a conversation index */
+{
+    xs_str *fn = _object_fn_by_md5(md5, "_object_thread_fn");
+    return xs_replace_i(fn, ".json", idxsfx);
+}
+
+
+static void _object_thread_link(const char *md5, const xs_list *chain, const xs_list *new_anc)
+/* stores the ancestor chain of an object and adds it
+   to the descendant indexes of its new ancestors */
+{
+    xs *t_idx = _object_thread_fn(md5, "_t.idx");
+    const char *v;
+    int c;
+    FILE *f;
+
+    if ((f = fopen(t_idx, "w")) != NULL) {
+        flock(fileno(f), LOCK_EX);
+
+        c = 0;
+        while (xs_list_next(chain, &v, &c))
+            fprintf(f, "%s\n", v);
+
+        fclose(f);
+    }
+
+    const char *p_md5 = xs_list_get(chain, -1);
+
+    c = 0;
+    while (xs_list_next(new_anc, &v, &c)) {
+        xs *d_idx  = _object_thread_fn(v, "_d.idx");
+        xs *dt_idx = _object_thread_fn(v, "_dt.idx");
+
+        index_add_md5(d_idx, md5);
+
+        pthread_mutex_lock(&data_mutex);
+
+        if ((f = fopen(dt_idx, "a")) != NULL) {
+            flock(fileno(f), LOCK_EX);
+            fseek(f, 0, SEEK_END);
+
+            fprintf(f, "%s %s\n", md5, p_md5);
+            fclose(f);
+        }
+
+        pthread_mutex_unlock(&data_mutex);
+    }
+}
+
+
+void object_thread_add(const char *md5, const char *p_md5)
+/* updates the conversation indexes with a new reply */
+{
+    xs *anc = object_ancestors(p_md5);
+    const char *v;
+    int c;
+
+    /* loops are never welcome */
+    if (strcmp(md5, p_md5) == 0 || xs_list_in(anc, md5) != -1)
+        return;
+
+    anc = xs_list_append(anc, p_md5);
+    _object_thread_link(md5, anc, anc);
+
+    /* replies that arrived before this object
+       had it as their root: move them to the real one */
+    xs *desc = object_descendants(md5);
+
+    c = 0;
+    while (xs_list_next(desc, &v, &c)) {
+        xs *t_idx = _object_thread_fn(v, "_t.idx");
+        xs *old   = index_list(t_idx, XS_ALL);
+        const char *root = xs_list_get(old, 0);
+
+        if (root == NULL || strcmp(root, md5) != 0 || xs_list_in(anc, v) != -1)
+            continue;
+
+        xs *chain = xs_dup(anc);
+        chain = xs_list_cat(chain, old);
+
+        _object_thread_link(v, chain, anc);
+
+        srv_debug(1, xs_fmt("object_thread_add moved %s under %s", v, xs_list_get(anc, 0)));
+    }
+}
+
+
+xs_list *object_ancestors(const char *md5)
+/* returns the ancestors of an object, from the conversation root down to its parent */
+{
+    xs *t_idx = _object_thread_fn(md5, "_t.idx");
+
+    if (mtime(t_idx) > 0.0)
+        return index_list(t_idx, XS_ALL);
+
+    /* not indexed: walk up the parents */
+    xs_list *list = xs_list_new();
+    char pid[MD5_HEX_SIZE];
+    int n = 0;
+
+    strncpy(pid, md5, sizeof(pid));
+
+    while (n++ < MAX_CONVERSATION_LEVELS && object_parent(pid, pid))
+        list = xs_list_insert(list, 0, pid);
+
+    return list;
+}
+
+
+int object_root(const char *md5, char root[MD5_HEX_SIZE])
+/* returns the root of the conversation of a reply */
+{
+    xs *t_idx = _object_thread_fn(md5, "_t.idx");
+
+    if (index_first(t_idx, root))
+        return 1;
+
+    xs *anc = object_ancestors(md5);
+    const char *v = xs_list_get(anc, 0);
+
+    if (v == NULL)
+        return 0;
+
+    strncpy(root, v, MD5_HEX_SIZE);
+    return 1;
+}
+
+
+xs_list *object_descendants(const char *md5)
+/* returns all the descendants of an object, in order of arrival */
+{
+    xs *d_idx = _object_thread_fn(md5, "_d.idx");
+    return index_list(d_idx, XS_ALL);
+}
+
+
+static xs_list *_object_tree_walk(xs_list *out, const xs_vec *desc,
+                                  const int *child, const int *next, int node)
+/* appends the subtree of node (the top is the last position) in depth-first order */
+{
+    int n;
+
+    for (n = child[node]; n != -1; n = next[n]) {
+        out = xs_list_append(out, xs_vec_get(desc, n));
+        out = _object_tree_walk(out, desc, child, next, n);
+    }
+
+    return out;
+}
+
+
+xs_list *object_descendants_tree(const char *md5)
+/* returns all the descendants of an object, in thread (depth-first) order */
+{
+    xs *list    = object_descendants(md5);
+    xs *dt_idx  = _object_thread_fn(md5, "_dt.idx");
+    xs *parents = xs_dict_new();
+    xs *posd    = xs_dict_new();
+    xs_list *out = xs_list_new();
+    xs_vec desc;
+    FILE *f;
+    int n, len;
+
+    /* the parents of the descendants */
+    if ((f = fopen(dt_idx, "r")) != NULL) {
+        flock(fileno(f), LOCK_SH);
+
+        char line[256];
+
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (strlen(line) < 2 * MD5_HEX_SIZE)
+                continue;
+
+            line[MD5_HEX_SIZE - 1]     = '\0';
+            line[2 * MD5_HEX_SIZE - 1] = '\0';
+            parents = xs_dict_set(parents, line, &line[MD5_HEX_SIZE]);
+        }
+
+        fclose(f);
+    }
+
+    xs_vec_from_list(&desc, list);
+    len = xs_vec_len(&desc);
+
+    /* the position of each one */
+    for (n = 0; n < len; n++) {
+        xs *v = xs_number_new(n);
+        posd = xs_dict_set(posd, xs_vec_get(&desc, n), v);
+    }
+
+    /* parent, first child and next sibling of each (by position);
+       the top is at len */
+    int *par   = xs_realloc(NULL, (len + 1) * sizeof(int));
+    int *child = xs_realloc(NULL, (len + 1) * sizeof(int));
+    int *last  = xs_realloc(NULL, (len + 1) * sizeof(int));
+    int *next  = xs_realloc(NULL, (len + 1) * sizeof(int));
+
+    for (n = 0; n < len; n++) {
+        const char *d = xs_vec_get(&desc, n);
+        const char *p = xs_dict_get(parents, d);
+        const xs_number *pn = NULL;
+        char p_md5[MD5_HEX_SIZE];
+
+        /* not there? (indexed before the parents were stored) */
+        if (p == NULL && object_parent(d, p_md5))
+            p = p_md5;
+
+        if (p != NULL)
+            pn = xs_dict_get(posd, p);
+
+        /* unknown parents go to the top */
+        par[n] = pn != NULL ? (int)xs_number_get(pn) : len;
+
+        if (par[n] == n)
+            par[n] = len;
+    }
+
+    /* break loops, if any, by moving an entry of them to the top
+       (last[] holds the state: 0, not seen; 1, in this path; 2, done) */
+    memset(last, '\0', (len + 1) * sizeof(int));
+
+    for (n = 0; n < len; n++) {
+        int k = n;
+
+        while (k != len && last[k] == 0) {
+            last[k] = 1;
+            k = par[k];
+        }
+
+        if (k != len && last[k] == 1)
+            par[k] = len;
+
+        for (k = n; k != len && last[k] == 1; k = par[k])
+            last[k] = 2;
+    }
+
+    for (n = 0; n <= len; n++)
+        child[n] = last[n] = next[n] = -1;
+
+    /* the children of each, in order of arrival */
+    for (n = 0; n < len; n++) {
+        int p = par[n];
+
+        if (last[p] == -1)
+            child[p] = n;
+        else
+            next[last[p]] = n;
+
+        last[p] = n;
+    }
+
+    out = _object_tree_walk(out, &desc, child, next, len);
+
+    xs_free(par);
+    xs_free(child);
+    xs_free(last);
+    xs_free(next);
+    xs_vec_free(&desc);
+
+    return out;
+}
+
+
 int object_admire(const char *id, const char *actor, int like)
 /* actor likes or announces this object */
 {
@@ -1079,6 +1565,15 @@ xs_str *object_user_cache_index_fn(snac *user, const char *cachedir)
 }
 
 
+static pthread_mutex_t *_home_lock(snac *user)
+/* returns the lock that serializes the writes to the home index of a user
+   other than appends (the snapshot of the rebuilds would undo them, or
+   the rebuilds would apply their offset to another file) */
+{
+    return &home_mutex[xs_hash_func(user->uid, strlen(user->uid)) % HOME_LOCKS];
+}
+
+
 int _object_user_cache(snac *user, const char *id, const char *cachedir, int del)
 /* adds or deletes from a user cache */
 {
@@ -1088,16 +1583,30 @@ int _object_user_cache(snac *user, const char *id, const char *cachedir, int del
     int ret;
 
     if (del) {
-        ret = unlink(cfn);
-        index_del(idx, id);
+        if ((ret = unlink(cfn)) != -1 && strcmp(cachedir, "public") == 0)
+            stats_post_del();
+
+        if (strcmp(cachedir, "home") == 0) {
+            pthread_mutex_t *lock = _home_lock(user);
+
+            pthread_mutex_lock(lock);
+            index_del(idx, id);
+            pthread_mutex_unlock(lock);
+        }
+        else
+            index_del(idx, id);
     }
     else {
         /* create the subfolder, if it does not exist */
         xs *dir = xs_fmt("%s/%s/", user->basedir, cachedir);
         mkdirx(dir);
 
-        if ((ret = link(ofn, cfn)) != -1)
+        if ((ret = link(ofn, cfn)) != -1) {
             index_add(idx, id);
+
+            if (strcmp(cachedir, "public") == 0)
+                stats_post_add();
+        }
     }
 
     return ret;
@@ -1205,6 +1714,33 @@ xs_list *follower_list(snac *snac)
 }
 
 
+xs_list *follower_list_page(snac *snac, int *pos, int show, int *total)
+/* returns up to show followers before position *pos, newest first (see index_list_desc_pos()) */
+{
+    xs *idx        = object_user_cache_index_fn(snac, "followers");
+    xs *list       = index_list_desc_pos(idx, pos, show);
+    xs_list *fwers = xs_list_new();
+    const char *v;
+    int c = 0;
+
+    *total = index_len(idx);
+
+    while (xs_list_next(list, &v, &c)) {
+        xs *a_obj = NULL;
+
+        if (object_user_cache_in_by_md5(snac, v, "followers") &&
+            valid_status(object_get_by_md5(v, &a_obj))) {
+            const char *actor = xs_dict_get(a_obj, "id");
+
+            if (xs_type(actor) == XSTYPE_STRING)
+                fwers = xs_list_append(fwers, actor);
+        }
+    }
+
+    return fwers;
+}
+
+
 /** pending followers **/
 
 int pending_add(snac *user, const char *actor, const xs_dict *msg)
@@ -1368,6 +1904,7 @@ int timeline_del(snac *snac, const char *id)
     /* delete from the user's caches */
     object_user_cache_del(snac, id, "public");
     object_user_cache_del(snac, id, "private");
+    object_user_cache_del(snac, id, "home");
 
     unpin(snac, id);
     unbookmark(snac, id);
@@ -1377,41 +1914,279 @@ int timeline_del(snac *snac, const char *id)
 }
 
 
-void timeline_update_indexes(snac *snac, const char *id)
-/* updates the indexes */
+static const char *_timeline_home_from(const xs_dict *msg)
+/* returns who a timeline entry is from, for home timeline purposes */
 {
-    object_user_cache_add(snac, id, "private");
+    const char *type = xs_dict_get(msg, "type");
+    const char *from = NULL;
 
-    if (xs_startswith(id, snac->actor)) {
-        xs *msg = NULL;
+    /* group posts are attributed to the group */
+    if (xs_type(type) == XSTYPE_STRING && strcmp(type, "Page") == 0)
+        from = xs_dict_get(msg, "audience");
 
-        if (valid_status(object_get(id, &msg))) {
-            /* if its ours and is public, also store in public */
-            if (is_msg_public(msg)) {
-                object_user_cache_add(snac, id, "public");
+    if (xs_type(from) != XSTYPE_STRING)
+        from = get_atto(msg);
 
-                /* also add it to the instance public timeline */
-                xs *ipt = xs_fmt("%s/public.idx", srv_basedir);
-                index_add(ipt, id);
-            }
-        }
-    }
+    return xs_type(from) == XSTYPE_STRING ? from : NULL;
 }
 
 
-int timeline_add(snac *snac, const char *id, const xs_dict *o_msg)
-/* adds a message to the timeline */
+int timeline_home_check(snac *user, const xs_dict *msg)
+/* checks if a timeline entry belongs to the home timeline */
 {
-    int ret = object_add(id, o_msg);
-    timeline_update_indexes(snac, id);
+    const char *id   = xs_dict_get(msg, "id");
+    const char *type = xs_dict_get(msg, "type");
+    const char *from = _timeline_home_from(msg);
 
-    tag_index(id, o_msg);
+    if (xs_type(id) != XSTYPE_STRING || xs_type(type) != XSTYPE_STRING || from == NULL)
+        return 0;
 
-    list_distribute(snac, NULL, o_msg);
+    /* only Notes and the like */
+    if (!xs_match(type, POSTLIKE_OBJECT_TYPE))
+        return 0;
 
-    snac_debug(snac, 1, xs_fmt("timeline_add %s", id));
+    /* from a person we don't follow? only if it was boosted */
+    if (strcmp(from, user->actor) && !following_check(user, from) &&
+        object_announces_len(id) == 0)
+        return 0;
 
-    return ret;
+    /* discard notes from muted morons */
+    if (is_muted(user, from))
+        return 0;
+
+    /* discard hidden notes */
+    if (is_hidden(user, id))
+        return 0;
+
+    /* if it has a name and it's not a Page or a Video,
+       it's a poll vote, so discard it */
+    if (!xs_is_null(xs_dict_get(msg, "name")) && !xs_match(type, "Page|Video"))
+        return 0;
+
+    return 1;
+}
+
+
+static xs_list *_index_snapshot(const char *fn, long *off)
+/* reads an index, returning also the offset up to where it was read */
+{
+    xs_list *list = xs_list_new();
+    FILE *f;
+
+    *off = 0;
+
+    if ((f = fopen(fn, "r")) != NULL) {
+        flock(fileno(f), LOCK_SH);
+
+        char line[256];
+
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (line[0] != '-') {
+                line[MD5_HEX_SIZE - 1] = '\0';
+                list = xs_list_append(list, line);
+            }
+        }
+
+        *off = ftell(f);
+
+        fclose(f);
+    }
+
+    return list;
+}
+
+
+static int _index_replace(const char *fn, const xs_list *list, long off)
+/* replaces the first off bytes of an index with list,
+   keeping whatever was appended after the snapshot */
+{
+    FILE *i, *o;
+    int ret = -1;
+    xs *nfn = xs_fmt("%s.new", fn);
+
+    pthread_mutex_lock(&data_mutex);
+
+    if ((o = fopen(nfn, "w")) != NULL) {
+        const char *md5;
+
+        xs_list_foreach(list, md5)
+            fprintf(o, "%s\n", md5);
+
+        if ((i = fopen(fn, "r")) != NULL) {
+            char line[256];
+
+            fseek(i, off, SEEK_SET);
+
+            while (fgets(line, sizeof(line), i) != NULL)
+                fputs(line, o);
+
+            fclose(i);
+        }
+
+        fclose(o);
+
+        ret = rename(nfn, fn);
+    }
+
+    pthread_mutex_unlock(&data_mutex);
+
+    return ret;
+}
+
+
+void timeline_home_drop(snac *user, const char *actor)
+/* drops from the home timeline the entries from actor that no longer belong there */
+{
+    xs *idx  = user_index_fn(user, "home");
+    pthread_mutex_t *lock = _home_lock(user);
+    long off;
+
+    pthread_mutex_lock(lock);
+
+    xs *h_list = _index_snapshot(idx, &off);
+    xs *list = xs_list_new();
+    const char *md5;
+    int cnt = 0;
+
+    xs_list_foreach(h_list, md5) {
+        xs *msg = NULL;
+
+        if (valid_status(object_get_by_md5(md5, &msg))) {
+            const char *from = _timeline_home_from(msg);
+
+            if (from && strcmp(from, actor) == 0 && !timeline_home_check(user, msg)) {
+                xs *cfn = object_user_cache_fn_by_md5(user, md5, "home");
+                unlink(cfn);
+                cnt++;
+
+                continue;
+            }
+        }
+
+        list = xs_list_append(list, md5);
+    }
+
+    if (cnt)
+        _index_replace(idx, list, off);
+
+    pthread_mutex_unlock(lock);
+
+    snac_debug(user, 1, xs_fmt("timeline_home_drop %s %d", actor, cnt));
+}
+
+
+void timeline_home_restore(snac *user, const char *actor)
+/* adds to the home timeline the entries from actor (or from anyone,
+   if it's NULL) that belong there but are not, in timeline order */
+{
+    xs *p_idx = user_index_fn(user, "private");
+    xs *h_idx = user_index_fn(user, "home");
+    xs *dir   = xs_fmt("%s/home/", user->basedir);
+    pthread_mutex_t *lock = _home_lock(user);
+    long off;
+
+    pthread_mutex_lock(lock);
+
+    xs *p_list = index_list(p_idx, XS_ALL);
+    xs *h_list = _index_snapshot(h_idx, &off);
+    xs *list = xs_list_new();
+    xs_set p_set, h_set;
+    const char *md5;
+    int cnt = 0;
+
+    mkdirx(dir);
+
+    xs_set_init(&p_set);
+    xs_set_init(&h_set);
+
+    xs_list_foreach(p_list, md5)
+        xs_set_add(&p_set, md5);
+
+    /* entries that are not in the private timeline go first */
+    xs_list_foreach(h_list, md5) {
+        if (xs_set_add(&p_set, md5))
+            list = xs_list_append(list, md5);
+
+        xs_set_add(&h_set, md5);
+    }
+
+    xs_list_foreach(p_list, md5) {
+        if (xs_set_add(&h_set, md5)) {
+            /* not in home: check if it should */
+            xs *msg = NULL;
+
+            if (!valid_status(object_get_by_md5(md5, &msg)))
+                continue;
+
+            const char *from = _timeline_home_from(msg);
+
+            if (actor && (from == NULL || strcmp(from, actor) != 0))
+                continue;
+
+            if (!timeline_home_check(user, msg))
+                continue;
+
+            xs *ofn = _object_fn_by_md5(md5, "timeline_home_restore");
+            xs *cfn = object_user_cache_fn_by_md5(user, md5, "home");
+            link(ofn, cfn);
+            cnt++;
+        }
+
+        list = xs_list_append(list, md5);
+    }
+
+    xs_set_free(&p_set);
+    xs_set_free(&h_set);
+
+    /* a full rebuild always writes the index */
+    if (cnt || actor == NULL)
+        _index_replace(h_idx, list, off);
+
+    pthread_mutex_unlock(lock);
+
+    snac_debug(user, 1, xs_fmt("timeline_home_restore %s %d",
+        actor ? actor : "(all)", cnt));
+}
+
+
+void timeline_update_indexes(snac *snac, const char *id)
+/* updates the indexes */
+{
+    xs *msg = NULL;
+
+    object_user_cache_add(snac, id, "private");
+
+    if (!valid_status(object_get(id, &msg)))
+        return;
+
+    /* filter it into the home timeline now, instead of on every read */
+    if (timeline_home_check(snac, msg))
+        object_user_cache_add(snac, id, "home");
+
+    /* if its ours and is public, also store in public */
+    if (xs_startswith(id, snac->actor) && is_msg_public(msg)) {
+        object_user_cache_add(snac, id, "public");
+
+        /* also add it to the instance public timeline */
+        xs *ipt = xs_fmt("%s/public.idx", srv_basedir);
+        index_add(ipt, id);
+    }
+}
+
+
+int timeline_add(snac *snac, const char *id, const xs_dict *o_msg)
+/* adds a message to the timeline */
+{
+    int ret = object_add(id, o_msg);
+    timeline_update_indexes(snac, id);
+
+    tag_index(id, o_msg);
+
+    list_distribute(snac, NULL, o_msg);
+
+    snac_debug(snac, 1, xs_fmt("timeline_add %s", id));
+
+    return ret;
 }
 
 
@@ -1426,6 +2201,14 @@ int timeline_admire(snac *snac, const char *id, const char *admirer, int like)
 
     int ret = object_admire(id, admirer, like);
 
+    /* a boost can bring an entry into the home timeline */
+    if (!like && object_user_cache_in(snac, id, "private")) {
+        xs *msg = NULL;
+
+        if (valid_status(object_get(id, &msg)) && timeline_home_check(snac, msg))
+            object_user_cache_add(snac, id, "home");
+    }
+
     snac_debug(snac, 1, xs_fmt("timeline_admire (%s) %s %s",
             like ? "Like" : "Announce", id, admirer));
 
@@ -1447,21 +2230,27 @@ xs_list *timeline_top_level(snac *snac, const xs_list *list)
 
         strncpy(line, v, sizeof(line));
 
-        for (;;) {
-            char line2[MD5_HEX_SIZE];
+        /* walk up the ancestors (parent first) while they are here;
+           they come from the conversation index in a single read */
+        xs *anc = object_ancestors(line);
+        xs_vec av;
+        int n;
 
-            /* if it doesn't have a parent, use this */
-            if (!object_parent(line, line2))
-                break;
+        xs_vec_from_list(&av, anc);
+
+        for (n = xs_vec_len(&av) - 1; n >= 0; n--) {
+            const char *p = xs_vec_get(&av, n);
 
-            /* well, there is a parent... but is it here? */
-            if (!timeline_here(snac, line2))
+            /* is the parent here? */
+            if (!timeline_here(snac, p))
                 break;
 
             /* it's here! try again with its own parent */
-            strncpy(line, line2, sizeof(line));
+            strncpy(line, p, sizeof(line));
         }
 
+        xs_vec_free(&av);
+
         xs_set_add(&seen, line);
     }
 
@@ -1491,7 +2280,7 @@ xs_list *timeline_list(snac *snac, const char *idx_name, int skip, int show)
     int c_max;
 
     /* maximum number of items in the timeline */
-    c_max = xs_number_get(xs_dict_get(srv_config, "max_timeline_entries"));
+    c_max = srv_conf->max_timeline_entries;
 
     /* never more timeline entries than the configured maximum */
     if (show > c_max)
@@ -1538,8 +2327,11 @@ int following_add(snac *snac, const char *actor, const xs_dict *msg)
     xs *fn = _following_fn(snac, actor);
     FILE *f;
     xs *p_object = NULL;
+    int new_follow = 1;
 
     if (valid_status(following_get(snac, actor, &p_object))) {
+        new_follow = 0;
+
         /* object already exists; if it's of type Accept,
            the actor is already being followed and confirmed,
            so do nothing */
@@ -1561,6 +2353,10 @@ int following_add(snac *snac, const char *actor, const xs_dict *msg)
         /* increase its reference count */
         fn = xs_replace_i(fn, ".json", "_a.json");
         link(actor_fn, fn);
+
+        /* bring their already stored posts into the home timeline */
+        if (new_follow)
+            enqueue_home_restore(snac, actor);
     }
     else
         ret = HTTP_STATUS_INTERNAL_SERVER_ERROR;
@@ -1584,6 +2380,9 @@ int following_del(snac *snac, const char *actor)
     fn = xs_replace_i(fn, ".json", "_a.json");
     unlink(fn);
 
+    /* their posts are no longer in the home timeline */
+    enqueue_home_drop(snac, actor);
+
     return HTTP_STATUS_OK;
 }
 
@@ -1679,6 +2478,8 @@ void mute(snac *snac, const char *actor)
         fclose(f);
 
         snac_debug(snac, 2, xs_fmt("muted %s %s", actor, fn));
+
+        enqueue_home_drop(snac, actor);
     }
 }
 
@@ -1688,7 +2489,8 @@ void unmute(snac *snac, const char *actor)
 {
     xs *fn = _muted_fn(snac, actor);
 
-    unlink(fn);
+    if (unlink(fn) != -1)
+        enqueue_home_restore(snac, actor);
 
     snac_debug(snac, 2, xs_fmt("unmuted %s %s", actor, fn));
 }
@@ -1868,6 +2670,8 @@ void hide(snac *snac, const char *id)
 
         snac_debug(snac, 2, xs_fmt("hidden %s %s", id, fn));
 
+        object_user_cache_del(snac, id, "home");
+
         /* hide all the children */
         xs *chld = object_children(id);
         char *p;
@@ -1918,7 +2722,7 @@ int actor_get(const char *actor, xs_dict **data)
 
         if (!xs_is_null(uid) && user_open(&user, uid)) {
             if (data)
-                *data = msg_actor(&user);
+                *data = msg_actor_cached(&user);
 
             user_free(&user);
             return HTTP_STATUS_OK;
@@ -1960,6 +2764,40 @@ int actor_get(const char *actor, xs_dict **data)
 }
 
 
+int actor_get_by_md5(const char *md5, xs_dict **data)
+/* returns an already downloaded actor by its md5 */
+{
+    xs_dict *d = NULL;
+    int status = object_get_by_md5(md5, &d);
+
+    if (!valid_status(status)) {
+        snac user;
+
+        d = xs_free(d);
+
+        /* it may be a local user */
+        if (user_open_by_md5(&user, md5)) {
+            *data = msg_actor_cached(&user);
+            user_free(&user);
+
+            return HTTP_STATUS_OK;
+        }
+
+        return status;
+    }
+
+    /* if the object is corrupted, discard it */
+    if (xs_is_null(xs_dict_get(d, "id")) || xs_is_null(xs_dict_get(d, "type"))) {
+        d = xs_free(d);
+        return HTTP_STATUS_NOT_FOUND;
+    }
+
+    *data = d;
+
+    return status;
+}
+
+
 int actor_get_refresh(snac *user, const char *actor, xs_dict **data)
 /* gets an actor and requests a refresh if it's stale */
 {
@@ -2494,172 +3332,2052 @@ void lastlog_write(snac *snac, const char *source)
         fprintf(f, "%lf %s\n", ftime(), source);
         fclose(f);
     }
+
+    stats_lastlog_set(snac->uid, (double)time(NULL));
 }
 
 
-/** inbox collection **/
+/** instance statistics **/
 
-void inbox_add(const char *inbox)
-/* collects a shared inbox */
-{
-    /* don't collect ourselves */
-    if (xs_startswith(inbox, srv_baseurl))
-        return;
+/* The counters served by nodeinfo and the Mastodon instance API. Once
+   loaded (from the stats.json checkpoint or by scanning the users),
+   they are kept in memory and updated as things happen; they are
+   recounted on purge and whenever the user directory changes. */
 
-    xs *md5 = xs_md5_hex(inbox, strlen(inbox));
-    xs *fn  = xs_fmt("%s/inbox/%s", srv_basedir, md5);
-    FILE *f;
+static xs_dict *stats_lastlog = NULL;     /* uid: time of last usage */
+static int stats_posts = 0;
+static double stats_users_mtime = 0.0;
+static int stats_dirty = 0;
+static time_t stats_saved = 0;
 
-    if ((f = fopen(fn, "w")) != NULL) {
-        fprintf(f, "%s\n", inbox);
-        fclose(f);
-    }
-}
+/* pre-serialized responses */
+static xs_str *stats_resp[STATS_RESP_MAX] = {0};
+static xs_str *stats_resp_etag[STATS_RESP_MAX] = {0};
+static xs_str *stats_resp_key[STATS_RESP_MAX] = {0};
+static time_t stats_resp_time[STATS_RESP_MAX] = {0};
 
 
-void inbox_add_by_actor(const xs_dict *actor)
-/* collects an actor's shared inbox, if it has one */
+static void _stats_recount(void)
+/* recomputes the statistics from disk (stats_mutex must be locked) */
 {
+    int h = xs_arena_hold(1);
+    xs *udir  = xs_fmt("%s/user", srv_basedir);
+    xs *users = user_list();
     const char *v;
+    int c = 0;
 
-    if (!xs_is_null(v = xs_dict_get(actor, "endpoints")) &&
-        !xs_is_null(v = xs_dict_get(v, "sharedInbox"))) {
-        /* only collect this inbox if its instance is not blocked */
-        if (!is_instance_blocked(v))
-            inbox_add(v);
+    xs_free(stats_lastlog);
+    stats_lastlog     = xs_dict_new();
+    stats_posts       = 0;
+    stats_users_mtime = mtime(udir);
+
+    while (xs_list_next(users, &v, &c)) {
+        xs *llfn = xs_fmt("%s/user/%s/lastlog.txt", srv_basedir, v);
+        xs *ll   = xs_number_new(mtime(llfn));
+
+        stats_lastlog = xs_dict_set(stats_lastlog, v, ll);
+
+        xs *pidxfn = xs_fmt("%s/user/%s/public.idx", srv_basedir, v);
+        stats_posts += index_len(pidxfn);
     }
+
+    stats_dirty = 1;
+
+    xs_arena_hold(h);
 }
 
 
-xs_list *inbox_list(void)
-/* returns the collected inboxes as a list */
+static void _stats_load(void)
+/* loads the statistics if needed (stats_mutex must be locked) */
 {
-    xs_list *ibl = xs_list_new();
-    xs *spec     = xs_fmt("%s/inbox/" "*", srv_basedir);
-    xs *files    = xs_glob(spec, 0, 0);
-    xs_list *p   = files;
-    const xs_val *v;
+    xs *udir = xs_fmt("%s/user", srv_basedir);
 
-    while (xs_list_iter(&p, &v)) {
-        FILE *f;
+    if (stats_lastlog != NULL) {
+        /* users added or deleted (maybe from the command line) */
+        if (mtime(udir) != stats_users_mtime)
+            _stats_recount();
 
-        if ((f = fopen(v, "r")) != NULL) {
-            xs *line = xs_readline(f);
+        return;
+    }
 
-            if (line) {
-                line = xs_strip_i(line);
-                ibl  = xs_list_append(ibl, line);
-            }
+    xs *fn = xs_fmt("%s/stats.json", srv_basedir);
+    FILE *f;
 
-            fclose(f);
+    if (mtime(fn) >= mtime(udir) && (f = fopen(fn, "r")) != NULL) {
+        int h = xs_arena_hold(1);
+        xs *j = xs_readall(f);
+        xs *d = xs_json_loads(j);
+        const xs_dict *ll = xs_dict_get(d, "lastlog");
+
+        fclose(f);
+
+        if (xs_type(ll) == XSTYPE_DICT) {
+            stats_lastlog     = xs_dup(ll);
+            stats_posts       = xs_number_get(xs_dict_get(d, "posts"));
+            stats_users_mtime = mtime(udir);
+            stats_saved       = time(NULL);
         }
+
+        xs_arena_hold(h);
     }
 
-    return ibl;
+    if (stats_lastlog == NULL)
+        _stats_recount();
 }
 
 
-/** instance-wide operations **/
+void stats_lastlog_set(const char *uid, double t)
+/* updates the last usage time of a user */
+{
+    pthread_mutex_lock(&stats_mutex);
 
-xs_str *_instance_block_fn(const char *instance)
+    /* not loaded? nothing to update */
+    if (stats_lastlog != NULL) {
+        int h = xs_arena_hold(1);
+        xs *ll = xs_number_new(t);
+
+        stats_lastlog = xs_dict_set(stats_lastlog, uid, ll);
+        stats_dirty   = 1;
+
+        xs_arena_hold(h);
+    }
+
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+
+void stats_post_add(void)
+/* counts a new local post */
 {
-    xs *s   = xs_replace(instance, "http:/" "/", "");
-    xs *s1  = xs_replace(s, "https:/" "/", "");
-    xs *l   = xs_split(s1, "/");
-    const char *p = xs_list_get(l, 0);
-    xs *md5 = xs_md5_hex(p, strlen(p));
+    pthread_mutex_lock(&stats_mutex);
 
-    return xs_fmt("%s/block/%s", srv_basedir, md5);
+    if (stats_lastlog != NULL) {
+        stats_posts++;
+        stats_dirty = 1;
+    }
+
+    pthread_mutex_unlock(&stats_mutex);
 }
 
 
-int is_instance_blocked(const char *instance)
+void stats_post_del(void)
+/* uncounts a deleted local post */
 {
-    xs *fn = _instance_block_fn(instance);
+    pthread_mutex_lock(&stats_mutex);
 
-    return !!(mtime(fn) != 0.0);
+    if (stats_lastlog != NULL && stats_posts > 0) {
+        stats_posts--;
+        stats_dirty = 1;
+    }
+
+    pthread_mutex_unlock(&stats_mutex);
 }
 
 
-int instance_block(const char *instance)
-/* blocks a full instance */
+void stats_recount(void)
+/* recomputes the statistics from disk */
 {
-    int ret;
+    pthread_mutex_lock(&stats_mutex);
+
+    if (stats_lastlog != NULL)
+        _stats_recount();
+
+    pthread_mutex_unlock(&stats_mutex);
+}
 
-    /* create the subdir */
-    xs *dir = xs_fmt("%s/block/", srv_basedir);
-    mkdirx(dir);
 
-    if (!is_instance_blocked(instance)) {
-        xs *fn = _instance_block_fn(instance);
+void stats_checkpoint(int force)
+/* writes the statistics to disk, if changed and it's time to */
+{
+    time_t t = time(NULL);
+
+    pthread_mutex_lock(&stats_mutex);
+
+    if (stats_dirty && (force || t - stats_saved > 5 * 60)) {
+        xs *fn = xs_fmt("%s/stats.json", srv_basedir);
+        xs *d  = xs_dict_new();
+        xs *n  = xs_number_new(stats_posts);
         FILE *f;
 
+        d = xs_dict_append(d, "posts",   n);
+        d = xs_dict_append(d, "lastlog", stats_lastlog);
+
         if ((f = fopen(fn, "w")) != NULL) {
-            fprintf(f, "%s\n", instance);
+            xs_json_dump(d, 4, f);
             fclose(f);
 
-            ret = 0;
+            stats_dirty = 0;
+            stats_saved = t;
         }
         else
-            ret = -1;
+            srv_log(xs_fmt("stats_checkpoint error writing %s (errno: %d)", fn, errno));
     }
-    else
-        ret = -2;
 
-    return ret;
+    pthread_mutex_unlock(&stats_mutex);
 }
 
 
-int instance_unblock(const char *instance)
-/* unblocks a full instance */
+void stats_get(int *users, int *umonth, int *uhyear, int *posts)
+/* returns the instance statistics */
 {
-    int ret;
+    double now = (double)time(NULL);
+    const char *k;
+    const xs_number *v;
+    int c = 0;
 
-    if (is_instance_blocked(instance)) {
-        xs *fn = _instance_block_fn(instance);
-        ret = unlink(fn);
-    }
-    else
-        ret = -2;
+    *users = *umonth = *uhyear = 0;
 
-    return ret;
-}
+    pthread_mutex_lock(&stats_mutex);
+
+    _stats_load();
+
+    while (xs_dict_next(stats_lastlog, &k, &v, &c)) {
+        double llsecs = now - xs_number_get(v);
+
+        if (llsecs < 60 * 60 * 24 * 30 * 6) {
+            (*uhyear)++;
+
+            if (llsecs < 60 * 60 * 24 * 30)
+                (*umonth)++;
+        }
+
+        (*users)++;
+    }
+
+    *posts = stats_posts;
+
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+
+int stats_response(int which, xs_str *(*build)(void),
+                   const char *inm, xs_str **body, xs_str **etag)
+/* returns a pre-serialized response that depends on the statistics */
+{
+    int users, umonth, uhyear, posts;
+    time_t t = time(NULL);
+    xs *b = NULL;
+    xs *e = NULL;
+
+    stats_get(&users, &umonth, &uhyear, &posts);
+
+    xs *key = xs_fmt("%d %d %d %d", users, umonth, uhyear, posts);
+
+    pthread_mutex_lock(&stats_mutex);
+
+    /* reuse the stored one if the counters didn't change (the rest
+       of the content may, so it's also rebuilt from time to time) */
+    if (stats_resp[which] != NULL && strcmp(stats_resp_key[which], key) == 0 &&
+        t - stats_resp_time[which] < 10 * 60) {
+        b = xs_dup(stats_resp[which]);
+        e = xs_dup(stats_resp_etag[which]);
+    }
+
+    pthread_mutex_unlock(&stats_mutex);
+
+    if (b == NULL) {
+        b = build();
+
+        xs *md5 = xs_md5_hex(b, strlen(b));
+        e = xs_fmt("W/\"snac-%.16s\"", md5);
+
+        pthread_mutex_lock(&stats_mutex);
+
+        int h = xs_arena_hold(1);
+
+        xs_free(stats_resp[which]);
+        xs_free(stats_resp_etag[which]);
+        xs_free(stats_resp_key[which]);
+
+        stats_resp[which]      = xs_dup(b);
+        stats_resp_etag[which] = xs_dup(e);
+        stats_resp_key[which]  = xs_dup(key);
+        stats_resp_time[which] = t;
+
+        xs_arena_hold(h);
+
+        pthread_mutex_unlock(&stats_mutex);
+    }
+
+    *etag = xs_dup(e);
+
+    if (!xs_is_null(inm) && strcmp(inm, e) == 0)
+        return HTTP_STATUS_NOT_MODIFIED;
+
+    *body = xs_dup(b);
+
+    return HTTP_STATUS_OK;
+}
+
+
+/** inbox collection **/
+
+/* The collected shared inboxes are kept in memory once loaded, with
+   the time they were last seen, along with some metadata about their
+   hosts (software, last delivery status and since when deliveries are
+   failing). Everything is stored in inbox.json, written from the
+   background thread when changed (or right away if there is no server
+   running, as from the command line); the file is reloaded if it's
+   changed from elsewhere. Only the changes in a host's delivery status
+   class or failing state are worth a write; the rest (like the last
+   seen time) are saved along with them. */
+
+static xs_dict *inbox_reg = NULL;   /* inbox: last seen time */
+static xs_dict *inbox_hosts = NULL; /* host: metadata */
+static int inbox_dirty = 0;
+static int inbox_imported = 0;
+static time_t inbox_saved = 0;
+static time_t inbox_checked = 0;
+static double inbox_mtime = 0.0;
+
+
+static xs_str *_inbox_host(const char *url)
+/* returns the host part of a url */
+{
+    xs *s  = xs_replace(url, "http:/" "/", "");
+    xs *s1 = xs_replace(s, "https:/" "/", "");
+    xs *l  = xs_split(s1, "/");
+
+    return xs_dup(xs_list_get(l, 0));
+}
+
+
+static void _inbox_load(void)
+/* (re)loads the inbox registry if not yet done or if the file
+   changed (inbox_mutex must be locked) */
+{
+    time_t t = time(NULL);
+
+    if (inbox_reg != NULL) {
+        /* don't check more than once per second */
+        if (t == inbox_checked)
+            return;
+
+        inbox_checked = t;
+
+        xs *fn = xs_fmt("%s/inbox.json", srv_basedir);
+
+        if (mtime(fn) == inbox_mtime)
+            return;
+
+        xs_free(inbox_reg);
+        xs_free(inbox_hosts);
+        inbox_reg = inbox_hosts = NULL;
+    }
+
+    int h = xs_arena_hold(1);
+    xs *fn = xs_fmt("%s/inbox.json", srv_basedir);
+    FILE *f;
+
+    inbox_checked = t;
+    inbox_mtime   = mtime(fn);
+    inbox_dirty   = 0;
+
+    if ((f = fopen(fn, "r")) != NULL) {
+        xs *j = xs_readall(f);
+        xs *d = xs_json_loads(j);
+
+        fclose(f);
+
+        if (xs_type(xs_dict_get(d, "inboxes")) == XSTYPE_DICT) {
+            inbox_reg   = xs_dup(xs_dict_get(d, "inboxes"));
+            inbox_hosts = xs_dup(xs_dict_get_def(d, "hosts", xs_stock(XSTYPE_DICT)));
+        }
+    }
+
+    if (inbox_reg == NULL) {
+        /* import the inboxes collected in the old directory */
+        xs *spec  = xs_fmt("%s/inbox/" "*", srv_basedir);
+        xs *files = xs_glob(spec, 0, 0);
+        const char *v;
+        int c = 0;
+
+        inbox_reg   = xs_dict_new();
+        inbox_hosts = xs_dict_new();
+
+        while (xs_list_next(files, &v, &c)) {
+            if ((f = fopen(v, "r")) != NULL) {
+                xs *line = xs_readline(f);
+
+                fclose(f);
+
+                if (line) {
+                    xs *t = xs_number_new(mtime(v));
+
+                    line = xs_strip_i(line);
+                    inbox_reg = xs_dict_set(inbox_reg, line, t);
+                }
+            }
+        }
+
+        inbox_imported = inbox_dirty = 1;
+    }
+
+    xs_arena_hold(h);
+}
+
+
+static const xs_dict *_inbox_host_get(const char *url)
+/* returns a host metadata (inbox_mutex must be locked) */
+{
+    xs *host = _inbox_host(url);
+    return xs_dict_get(inbox_hosts, host);
+}
+
+
+static void _inbox_save(void)
+/* writes the inbox registry to disk (inbox_mutex must be locked) */
+{
+    xs *fn  = xs_fmt("%s/inbox.json", srv_basedir);
+    xs *tfn = xs_fmt("%s.new", fn);
+    xs *d   = xs_dict_new();
+    FILE *f;
+
+    d = xs_dict_append(d, "inboxes", inbox_reg);
+    d = xs_dict_append(d, "hosts",   inbox_hosts);
+
+    if ((f = fopen(tfn, "w")) == NULL) {
+        srv_log(xs_fmt("inbox_checkpoint error writing %s (errno: %d)", tfn, errno));
+        return;
+    }
+
+    xs_json_dump(d, 0, f);
+    fclose(f);
+
+    if (rename(tfn, fn) != -1) {
+        inbox_mtime = mtime(fn);
+        inbox_dirty = 0;
+        inbox_saved = time(NULL);
+
+        if (inbox_imported) {
+            /* the old directory is no longer needed */
+            xs *spec  = xs_fmt("%s/inbox/" "*", srv_basedir);
+            xs *files = xs_glob(spec, 0, 0);
+            const char *v;
+            int c = 0;
+
+            while (xs_list_next(files, &v, &c))
+                unlink(v);
+
+            xs *dir = xs_fmt("%s/inbox", srv_basedir);
+            rmdir(dir);
+
+            inbox_imported = 0;
+        }
+    }
+}
+
+
+static void _inbox_changed(void)
+/* flags the inbox registry as changed; without a server (and its
+   background thread) it's saved right away (inbox_mutex must be locked) */
+{
+    inbox_dirty = 1;
+
+    if (p_state == NULL)
+        _inbox_save();
+}
+
+
+static void _inbox_host_set(const char *url, const char *key, const xs_val *value)
+/* sets a host metadata field, without flagging a change (inbox_mutex must be locked) */
+{
+    int h = xs_arena_hold(1);
+    xs *host = _inbox_host(url);
+    const xs_dict *o = xs_dict_get(inbox_hosts, host);
+    xs *d = xs_type(o) == XSTYPE_DICT ? xs_dup(o) : xs_dict_new();
+    xs *t = xs_number_new((double)time(NULL));
+
+    d = xs_dict_set(d, "seen", t);
+    d = xs_dict_set(d, key, value);
+
+    inbox_hosts = xs_dict_set(inbox_hosts, host, d);
+
+    xs_arena_hold(h);
+}
+
+
+void inbox_add(const char *inbox)
+/* collects a shared inbox */
+{
+    /* don't collect ourselves */
+    if (xs_startswith(inbox, srv_baseurl))
+        return;
+
+    double t = (double)time(NULL);
+
+    pthread_mutex_lock(&inbox_mutex);
+
+    _inbox_load();
+
+    const xs_number *o = xs_dict_get(inbox_reg, inbox);
+
+    /* new, or not refreshed in the last hour */
+    if (o == NULL || t - xs_number_get(o) > 3600.0) {
+        int h = xs_arena_hold(1);
+        xs *n = xs_number_new(t);
+
+        inbox_reg = xs_dict_set(inbox_reg, inbox, n);
+
+        xs_arena_hold(h);
+
+        _inbox_changed();
+    }
+
+    pthread_mutex_unlock(&inbox_mutex);
+}
+
+
+void inbox_add_by_actor(const xs_dict *actor)
+/* collects an actor's shared inbox, if it has one */
+{
+    const char *v;
+
+    if (!xs_is_null(v = xs_dict_get(actor, "endpoints")) &&
+        !xs_is_null(v = xs_dict_get(v, "sharedInbox"))) {
+        /* only collect this inbox if its instance is not blocked */
+        if (!is_instance_blocked(v))
+            inbox_add(v);
+    }
+}
+
+
+xs_list *inbox_list(void)
+/* returns the collected inboxes as a list */
+{
+    xs_list *ibl = xs_list_new();
+    double t = (double)time(NULL);
+    const char *k;
+    const xs_val *v;
+    int c = 0;
+
+    pthread_mutex_lock(&inbox_mutex);
+
+    _inbox_load();
+
+    while (xs_dict_next(inbox_reg, &k, &v, &c)) {
+        const xs_dict *hm = _inbox_host_get(k);
+        const xs_number *fs = xs_dict_get(hm, "failing_since");
+
+        /* skip hosts that are failing for more than a week */
+        if (xs_type(fs) == XSTYPE_NUMBER && t - xs_number_get(fs) > 7 * 24 * 3600.0)
+            continue;
+
+        ibl = xs_list_append(ibl, k);
+    }
+
+    pthread_mutex_unlock(&inbox_mutex);
+
+    return ibl;
+}
+
+
+void inbox_host_status(const char *url, int status)
+/* stores the result of a delivery to a host */
+{
+    pthread_mutex_lock(&inbox_mutex);
+
+    _inbox_load();
+
+    const xs_dict *hm = _inbox_host_get(url);
+    const xs_number *o = xs_dict_get(hm, "status");
+    int failing = xs_type(xs_dict_get(hm, "failing_since")) == XSTYPE_NUMBER;
+    int changed = xs_type(o) != XSTYPE_NUMBER || (int)xs_number_get(o) / 100 != status / 100;
+    xs *st = xs_number_new(status);
+
+    _inbox_host_set(url, "status", st);
+
+    if (valid_status(status)) {
+        if (failing) {
+            _inbox_host_set(url, "failing_since", xs_stock(XSTYPE_NULL));
+            changed = 1;
+        }
+    }
+    else
+    if (!failing) {
+        xs *t = xs_number_new((double)time(NULL));
+        _inbox_host_set(url, "failing_since", t);
+        changed = 1;
+    }
+
+    if (changed)
+        _inbox_changed();
+
+    pthread_mutex_unlock(&inbox_mutex);
+}
+
+
+void inbox_host_software(const char *url, const char *user_agent)
+/* stores the software a host runs, as taken from its user agent */
+{
+    if (xs_is_null(user_agent) || *user_agent == '\0')
+        return;
+
+    /* the first token, like Mastodon/4.2.0 */
+    xs *sw = xs_fmt("%.*s", (int)strcspn(user_agent, " ;("), user_agent);
+
+    pthread_mutex_lock(&inbox_mutex);
+
+    _inbox_load();
+
+    const xs_dict *hm = _inbox_host_get(url);
+    const char *o = xs_dict_get(hm, "software");
+
+    if (o == NULL || strcmp(o, sw) != 0) {
+        _inbox_host_set(url, "software", sw);
+        _inbox_changed();
+    }
+
+    pthread_mutex_unlock(&inbox_mutex);
+}
+
+
+int inbox_purge(int days)
+/* forgets the inboxes and hosts not seen in some days */
+{
+    double t = (double)time(NULL) - days * 24 * 3600.0;
+    const char *k;
+    const xs_val *v;
+    int c, cnt = 0;
+
+    pthread_mutex_lock(&inbox_mutex);
+
+    _inbox_load();
+
+    int h = xs_arena_hold(1);
+    xs *ibx = xs_dict_new();
+    xs *hts = xs_dict_new();
+
+    int dropped = 0;
+
+    c = 0;
+    while (xs_dict_next(inbox_reg, &k, &v, &c)) {
+        if (xs_number_get(v) >= t)
+            ibx = xs_dict_set(ibx, k, v);
+        else
+            cnt++;
+    }
+
+    /* the saved seen time of a host may be old, as refreshing it
+       is not worth a write; the hosts of kept inboxes are kept */
+    c = 0;
+    while (xs_dict_next(inbox_hosts, &k, &v, &c)) {
+        if (xs_number_get(xs_dict_get(v, "seen")) >= t)
+            hts = xs_dict_set(hts, k, v);
+        else
+            dropped++;
+    }
+
+    c = 0;
+    while (xs_dict_next(ibx, &k, &v, &c)) {
+        xs *host = _inbox_host(k);
+        const xs_dict *hm = xs_dict_get(inbox_hosts, host);
+
+        if (hm != NULL && xs_dict_get(hts, host) == NULL) {
+            hts = xs_dict_set(hts, host, hm);
+            dropped--;
+        }
+    }
+
+    xs_free(inbox_reg);
+    xs_free(inbox_hosts);
+
+    inbox_reg   = ibx;
+    inbox_hosts = hts;
+    ibx = hts   = NULL;
+
+    xs_arena_hold(h);
+
+    if (cnt || dropped)
+        _inbox_changed();
+
+    pthread_mutex_unlock(&inbox_mutex);
+
+    return cnt;
+}
+
+
+void inbox_checkpoint(int force)
+/* writes the inbox registry to disk, if changed and it's time to */
+{
+    time_t t = time(NULL);
+
+    pthread_mutex_lock(&inbox_mutex);
+
+    if (inbox_dirty && (force || t - inbox_saved > 5 * 60)) {
+        /* changes made from elsewhere win */
+        inbox_checked = 0;
+        _inbox_load();
+
+        if (inbox_dirty)
+            _inbox_save();
+    }
+
+    pthread_mutex_unlock(&inbox_mutex);
+}
+
+
+/** remote fetch failures **/
+
+/* Remote objects that couldn't be fetched (because they are gone, not
+   found or their server is unreachable) are remembered for a while, so
+   that they are not requested again and again. The entries live in a
+   hash table and are saved to fetch_failures.txt from time to time;
+   the file is reloaded if it's changed from elsewhere (like by the
+   fetch_failures_clear command). Timeouts and connection errors are
+   remembered by URL; only after several connection failures in a row
+   to the same host (counted in memory, under the host name prefixed
+   by ~), the whole host is remembered as unreachable, for a shorter
+   time. The answers that depend on who signs the request (401, 403
+   and 404) are remembered for each signer, prefixed by the md5 of
+   its actor. */
+
+#define FETCH_FAIL_BUCKETS 4096
+#define FETCH_FAIL_MAX     65536
+#define FETCH_FAIL_STRIKES 5       /* connection failures to give up on a host */
+
+typedef struct _fetch_fail {
+    struct _fetch_fail *next;
+    time_t expire;
+    int status;
+    char url[];
+} fetch_fail;
+
+static fetch_fail **fetch_fail_tbl = NULL;
+static int fetch_fail_n = 0;
+static int fetch_fail_dirty = 0;
+static time_t fetch_fail_saved = 0;
+static time_t fetch_fail_checked = 0;
+static double fetch_fail_mtime = 0.0;
+
+
+static fetch_fail **_fetch_fail_bucket(const char *url)
+/* returns the bucket for an url */
+{
+    return &fetch_fail_tbl[xs_hash_func(url, strlen(url)) % FETCH_FAIL_BUCKETS];
+}
+
+
+static xs_str *_fetch_fail_host(const char *url)
+/* returns the host of url (the key of a host-wide failure) */
+{
+    const char *p = strstr(url, "://");
+
+    p = p ? p + 3 : url;
+
+    return xs_str_new_sz(p, strcspn(p, "/?#"));
+}
+
+
+static int _fetch_fail_is_connect(int status)
+/* returns true if the status is a failure to resolve or connect to the host */
+{
+    /* negated CURLE_COULDNT_RESOLVE_HOST and CURLE_COULDNT_CONNECT */
+    return status == -6 || status == -7;
+}
+
+
+static xs_str *_fetch_fail_key(const char *signer, const char *url, int status)
+/* returns the key to remember a failure to fetch url */
+{
+    if (signer && *signer && (status == HTTP_STATUS_UNAUTHORIZED ||
+        status == HTTP_STATUS_FORBIDDEN || status == HTTP_STATUS_NOT_FOUND)) {
+        xs *md5 = xs_md5_hex(signer, strlen(signer));
+
+        return xs_fmt("%s:%s", md5, url);
+    }
+
+    return xs_dup(url);
+}
+
+
+static const char *_fetch_fail_url(const char *key)
+/* returns the url (or host) part of a key */
+{
+    int n = strspn(key, "0123456789abcdef");
+
+    return n == 32 && key[n] == ':' ? key + n + 1 : key;
+}
+
+
+static void _fetch_fail_reset(void)
+/* frees all entries (fetch_fail_mutex must be locked) */
+{
+    int n;
+
+    for (n = 0; n < FETCH_FAIL_BUCKETS; n++) {
+        while (fetch_fail_tbl[n] != NULL) {
+            fetch_fail *e = fetch_fail_tbl[n];
+
+            fetch_fail_tbl[n] = e->next;
+            xs_free(e);
+        }
+    }
+
+    fetch_fail_n = 0;
+}
+
+
+static void _fetch_fail_set(const char *url, int status, time_t expire)
+/* sets an entry (fetch_fail_mutex must be locked) */
+{
+    fetch_fail **b = _fetch_fail_bucket(url);
+    fetch_fail *e;
+
+    for (e = *b; e != NULL; e = e->next) {
+        if (strcmp(e->url, url) == 0)
+            break;
+    }
+
+    if (e == NULL) {
+        if (fetch_fail_n >= FETCH_FAIL_MAX)
+            return;
+
+        int h = xs_arena_hold(1);
+        e = xs_realloc(NULL, sizeof(fetch_fail) + strlen(url) + 1);
+        xs_arena_hold(h);
+
+        strcpy(e->url, url);
+        e->next = *b;
+        *b = e;
+        fetch_fail_n++;
+    }
+
+    e->status = status;
+    e->expire = expire;
+}
+
+
+static void _fetch_fail_load(void)
+/* (re)loads the entries if the file changed (fetch_fail_mutex must be locked) */
+{
+    time_t t = time(NULL);
+
+    if (fetch_fail_tbl == NULL) {
+        int h = xs_arena_hold(1);
+        fetch_fail_tbl = xs_realloc(NULL, FETCH_FAIL_BUCKETS * sizeof(fetch_fail *));
+        xs_arena_hold(h);
+
+        memset(fetch_fail_tbl, '\0', FETCH_FAIL_BUCKETS * sizeof(fetch_fail *));
+    }
+
+    /* don't check more than once per second */
+    if (t == fetch_fail_checked)
+        return;
+
+    fetch_fail_checked = t;
+
+    xs *fn = xs_fmt("%s/fetch_failures.txt", srv_basedir);
+    double m = mtime(fn);
+
+    if (m == fetch_fail_mtime)
+        return;
+
+    _fetch_fail_reset();
+
+    FILE *f;
+
+    if ((f = fopen(fn, "r")) != NULL) {
+        char url[4096];
+        long expire;
+        int status;
+
+        while (fscanf(f, "%ld %d %4095s", &expire, &status, url) == 3) {
+            if (expire > t)
+                _fetch_fail_set(url, status, expire);
+        }
+
+        fclose(f);
+    }
+
+    fetch_fail_mtime = m;
+    fetch_fail_dirty = 0;
+}
+
+
+static int _fetch_fail_ttl(int status)
+/* returns the number of seconds to remember a failure
+   (a status of -1000 means a host-wide one) */
+{
+    xs *k = NULL;
+    int ttl = 0;
+
+    if (status == -1000) {
+        k   = xs_dup("unreachable_host");
+        ttl = 5 * 60;
+    }
+    else
+    if (status <= 0 || status == 599) {
+        /* connection error or timeout */
+        k   = xs_dup("unreachable");
+        ttl = 30 * 60;
+    }
+    else
+    if (status >= 500 && status <= 599) {
+        k   = xs_dup("5xx");
+        ttl = 10 * 60;
+    }
+    else {
+        k = xs_fmt("%d", status);
+
+        if (status == HTTP_STATUS_GONE)
+            ttl = 7 * 24 * 3600;
+        else
+        if (status == HTTP_STATUS_NOT_FOUND)
+            ttl = 6 * 3600;
+    }
+
+    const xs_number *v = xs_dict_get(srv_conf->fetch_fail_ttl, k);
+
+    if (xs_type(v) == XSTYPE_NUMBER)
+        ttl = (int)xs_number_get(v);
+
+    return ttl;
+}
+
+
+static fetch_fail *_fetch_fail_entry(const char *key)
+/* returns an entry, live or not (fetch_fail_mutex must be locked) */
+{
+    fetch_fail *e;
+
+    for (e = *_fetch_fail_bucket(key); e != NULL; e = e->next) {
+        if (strcmp(e->url, key) == 0)
+            break;
+    }
+
+    return e;
+}
+
+
+static int _fetch_fail_find(const char *key, time_t t)
+/* returns the status of a live entry (fetch_fail_mutex must be locked) */
+{
+    fetch_fail *e = _fetch_fail_entry(key);
+
+    return e != NULL && e->expire > t ? e->status : 0;
+}
+
+
+int fetch_fail_get(const char *signer, const char *url)
+/* returns the status of a recent failure to fetch url (signed by signer), or 0 */
+{
+    xs *host = _fetch_fail_host(url);
+    xs *skey = _fetch_fail_key(signer, url, HTTP_STATUS_NOT_FOUND);
+    time_t t = time(NULL);
+    int status;
+
+    pthread_mutex_lock(&fetch_fail_mutex);
+
+    _fetch_fail_load();
+
+    if ((status = _fetch_fail_find(host, t)) == 0 &&
+        (status = _fetch_fail_find(url, t)) == 0 && strcmp(skey, url) != 0)
+        status = _fetch_fail_find(skey, t);
+
+    pthread_mutex_unlock(&fetch_fail_mutex);
+
+    return status;
+}
+
+
+void fetch_fail_add(const char *signer, const char *url, int status)
+/* remembers a failure to fetch url (signed by signer) */
+{
+    int ttl = _fetch_fail_ttl(status);
+    xs *key = _fetch_fail_key(signer, url, status);
+
+    if (ttl <= 0 || *key == '\0' || strlen(key) >= 4096)
+        return;
+
+    pthread_mutex_lock(&fetch_fail_mutex);
+
+    _fetch_fail_load();
+    /* a 0 status means 'no failure' for fetch_fail_get() */
+    _fetch_fail_set(key, status == 0 ? -1 : status, time(NULL) + ttl);
+    fetch_fail_dirty = 1;
+
+    if (_fetch_fail_is_connect(status)) {
+        /* one more strike for the host */
+        xs *host = _fetch_fail_host(url);
+        xs *skey = xs_fmt("~%s", host);
+        fetch_fail *e = _fetch_fail_entry(skey);
+        int strikes = (e ? e->status : 0) + 1;
+        int h_ttl = _fetch_fail_ttl(-1000);
+
+        if (strikes >= FETCH_FAIL_STRIKES && h_ttl > 0) {
+            _fetch_fail_set(host, status, time(NULL) + h_ttl);
+            strikes = 0;
+        }
+
+        /* never expires, so it's not saved */
+        _fetch_fail_set(skey, strikes, 0);
+    }
+
+    pthread_mutex_unlock(&fetch_fail_mutex);
+}
+
+
+void fetch_fail_ok(const char *url)
+/* notes that the host of url answered, so its connection failures are not in a row */
+{
+    xs *host = _fetch_fail_host(url);
+    xs *skey = xs_fmt("~%s", host);
+    fetch_fail *e;
+
+    pthread_mutex_lock(&fetch_fail_mutex);
+
+    _fetch_fail_load();
+
+    if ((e = _fetch_fail_entry(skey)) != NULL)
+        e->status = 0;
+
+    pthread_mutex_unlock(&fetch_fail_mutex);
+}
+
+
+static void _fetch_fail_save(void)
+/* writes the entries to disk (fetch_fail_mutex must be locked) */
+{
+    xs *fn  = xs_fmt("%s/fetch_failures.txt", srv_basedir);
+    xs *tfn = xs_fmt("%s.new", fn);
+    time_t t = time(NULL);
+    FILE *f;
+    int n;
+
+    if ((f = fopen(tfn, "w")) == NULL) {
+        srv_log(xs_fmt("fetch_fail_checkpoint error writing %s (errno: %d)", tfn, errno));
+        return;
+    }
+
+    for (n = 0; n < FETCH_FAIL_BUCKETS; n++) {
+        fetch_fail *e;
+
+        for (e = fetch_fail_tbl[n]; e != NULL; e = e->next) {
+            if (e->expire > t)
+                fprintf(f, "%ld %d %s\n", (long)e->expire, e->status, e->url);
+        }
+    }
+
+    fclose(f);
+
+    if (rename(tfn, fn) != -1) {
+        fetch_fail_mtime = mtime(fn);
+        fetch_fail_saved = t;
+        fetch_fail_dirty = 0;
+    }
+}
+
+
+void fetch_fail_checkpoint(int force)
+/* writes the fetch failures to disk, if changed and it's time to */
+{
+    time_t t = time(NULL);
+
+    pthread_mutex_lock(&fetch_fail_mutex);
+
+    if (fetch_fail_dirty && (force || t - fetch_fail_saved > 5 * 60)) {
+        /* changes made from elsewhere win */
+        fetch_fail_checked = 0;
+        _fetch_fail_load();
+
+        if (fetch_fail_dirty)
+            _fetch_fail_save();
+    }
+
+    pthread_mutex_unlock(&fetch_fail_mutex);
+}
+
+
+xs_list *fetch_fail_list(void)
+/* returns the current fetch failures, as 'status expire url' strings */
+{
+    xs_list *l = xs_list_new();
+    time_t t = time(NULL);
+    int n;
+
+    pthread_mutex_lock(&fetch_fail_mutex);
+
+    _fetch_fail_load();
+
+    for (n = 0; n < FETCH_FAIL_BUCKETS; n++) {
+        fetch_fail *e;
+
+        for (e = fetch_fail_tbl[n]; e != NULL; e = e->next) {
+            if (e->expire > t) {
+                xs *tm = xs_str_utctime(e->expire, ISO_DATE_SPEC);
+                xs *s  = xs_fmt("%d %s %s", e->status, tm, e->url);
+
+                l = xs_list_append(l, s);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&fetch_fail_mutex);
+
+    return l;
+}
+
+
+int fetch_fail_clear(const char *url)
+/* forgets the failures for url or host (or all of them, if NULL); returns the number of entries deleted */
+{
+    int cnt = 0;
+
+    pthread_mutex_lock(&fetch_fail_mutex);
+
+    _fetch_fail_load();
+
+    if (url == NULL) {
+        cnt = fetch_fail_n;
+        _fetch_fail_reset();
+    }
+    else {
+        int n;
+
+        /* the entry for the url (or host) itself and the signed ones */
+        for (n = 0; n < FETCH_FAIL_BUCKETS; n++) {
+            fetch_fail **p = &fetch_fail_tbl[n];
+
+            while (*p != NULL) {
+                if (strcmp(_fetch_fail_url((*p)->url), url) == 0) {
+                    fetch_fail *e = *p;
+
+                    *p = e->next;
+                    xs_free(e);
+                    fetch_fail_n--;
+                    cnt++;
+                }
+                else
+                    p = &(*p)->next;
+            }
+        }
+    }
+
+    if (cnt)
+        _fetch_fail_save();
+
+    pthread_mutex_unlock(&fetch_fail_mutex);
+
+    return cnt;
+}
+
+
+/** instance-wide operations **/
+
+/* Blocked instances are stored as files in block/, but looked up in an
+   in-memory trie of domain labels (from right to left) that is loaded
+   once and reloaded when the directory is changed from elsewhere.
+   An entry like *.example.com blocks all the subdomains of example.com. */
+
+#define BLOCK_HOST       1
+#define BLOCK_SUBDOMAINS 2
+
+typedef struct {
+    int parent;             /* parent node (0 is the root) */
+    int flags;              /* BLOCK_HOST and/or BLOCK_SUBDOMAINS */
+    unsigned int hash;      /* hash of the parent and the label */
+    char *label;            /* domain label, in lowercase */
+} block_node;
+
+static block_node *block_nodes = NULL;
+static int block_n_nodes = 0;
+static int block_a_nodes = 0;
+static int *block_tbl = NULL;       /* hash table of node numbers */
+static int block_tbl_size = 0;
+static double block_mtime = -1.0;   /* mtime of block/ when loaded */
+static time_t block_checked = 0;
+
+
+static void _block_host(const char *url, const char **host, int *len)
+/* locates the host part of an url (or bare host name) */
+{
+    const char *p = strstr(url, ":/" "/");
+
+    p = p ? p + 3 : url;
+
+    *host = p;
+    *len  = strcspn(p, "/:?#");
+}
+
+
+static unsigned int _block_hash(int parent, const char *label, int len)
+/* hashes a label under a parent node */
+{
+    unsigned int h = 2166136261U ^ ((unsigned int)parent * 16777619U);
+    int n;
+
+    for (n = 0; n < len; n++)
+        h = (h ^ (unsigned char)tolower((unsigned char)label[n])) * 16777619U;
+
+    return h;
+}
+
+
+static int _block_find(int parent, const char *label, int len, unsigned int hash)
+/* returns the node for a label under a parent, or 0 */
+{
+    if (block_tbl_size == 0)
+        return 0;
+
+    unsigned int i = hash & (block_tbl_size - 1);
+    int n;
+
+    while ((n = block_tbl[i]) != 0) {
+        const block_node *b = &block_nodes[n];
+
+        if (b->hash == hash && b->parent == parent &&
+            strncasecmp(b->label, label, len) == 0 && b->label[len] == '\0')
+            return n;
+
+        i = (i + 1) & (block_tbl_size - 1);
+    }
+
+    return 0;
+}
+
+
+static void _block_tbl_put(int n)
+/* stores a node in the hash table */
+{
+    unsigned int i = block_nodes[n].hash & (block_tbl_size - 1);
+
+    while (block_tbl[i] != 0)
+        i = (i + 1) & (block_tbl_size - 1);
+
+    block_tbl[i] = n;
+}
+
+
+static int _block_node(int parent, const char *label, int len)
+/* returns the node for a label under a parent, creating it if needed */
+{
+    unsigned int hash = _block_hash(parent, label, len);
+    int n = _block_find(parent, label, len, hash);
+
+    if (n != 0)
+        return n;
+
+    if (block_n_nodes == block_a_nodes) {
+        block_a_nodes = block_a_nodes ? block_a_nodes * 2 : 256;
+        block_nodes   = xs_realloc(block_nodes, block_a_nodes * sizeof(block_node));
+    }
+
+    /* keep the hash table at most half full */
+    if ((block_n_nodes + 1) * 2 > block_tbl_size) {
+        block_tbl_size = block_tbl_size ? block_tbl_size * 2 : 1024;
+        block_tbl      = xs_realloc(block_tbl, block_tbl_size * sizeof(int));
+        memset(block_tbl, '\0', block_tbl_size * sizeof(int));
+
+        for (n = 1; n < block_n_nodes; n++)
+            _block_tbl_put(n);
+    }
+
+    n = block_n_nodes++;
+
+    block_node *b = &block_nodes[n];
+    int i;
+
+    b->parent = parent;
+    b->flags  = 0;
+    b->hash   = hash;
+    b->label  = xs_realloc(NULL, len + 1);
+
+    for (i = 0; i < len; i++)
+        b->label[i] = tolower((unsigned char)label[i]);
+
+    b->label[len] = '\0';
+
+    _block_tbl_put(n);
+
+    return n;
+}
+
+
+static int _block_walk(const char *entry, int create, int *flags)
+/* walks the trie for an entry, returning the deepest node and the flag it needs */
+{
+    const char *h;
+    int len;
+    int node = 0;
+
+    _block_host(entry, &h, &len);
+
+    *flags = BLOCK_HOST;
+
+    if (len > 2 && h[0] == '*' && h[1] == '.') {
+        h += 2;
+        len -= 2;
+        *flags = BLOCK_SUBDOMAINS;
+    }
+
+    while (len > 0) {
+        int start = len;
+
+        while (start > 0 && h[start - 1] != '.')
+            start--;
+
+        if (create)
+            node = _block_node(node, h + start, len - start);
+        else
+        if ((node = _block_find(node, h + start, len - start,
+                _block_hash(node, h + start, len - start))) == 0)
+            break;
+
+        len = start - 1;
+    }
+
+    return node;
+}
+
+
+static void _block_load(void)
+/* (re)loads the trie if the block directory changed (block_mutex must be locked) */
+{
+    time_t t = time(NULL);
+
+    /* don't check more than once per second */
+    if (t == block_checked)
+        return;
+
+    block_checked = t;
+
+    xs *dir  = xs_fmt("%s/block", srv_basedir);
+    double m = mtime(dir);
+
+    if (m == block_mtime && block_n_nodes)
+        return;
+
+    int h = xs_arena_hold(1);
+    int n;
+
+    for (n = 1; n < block_n_nodes; n++)
+        xs_free(block_nodes[n].label);
+
+    block_n_nodes = 0;
+
+    if (block_tbl)
+        memset(block_tbl, '\0', block_tbl_size * sizeof(int));
+
+    /* the root */
+    _block_node(0, "", 0);
+
+    xs *spec  = xs_fmt("%s/" "*", dir);
+    xs *files = xs_glob(spec, 0, 0);
+    const char *v;
+    int c = 0;
+
+    while (xs_list_next(files, &v, &c)) {
+        FILE *f;
+
+        if ((f = fopen(v, "r")) != NULL) {
+            xs *line = xs_readline(f);
+
+            fclose(f);
+
+            if (line) {
+                int flags;
+
+                line = xs_strip_i(line);
+                block_nodes[_block_walk(line, 1, &flags)].flags |= flags;
+            }
+        }
+    }
+
+    /* if it was changed this very second, check again later */
+    block_mtime = m < (double)t ? m : -1.0;
+
+    srv_debug(1, xs_fmt("block trie loaded (%d files, %d nodes)",
+        xs_list_len(files), block_n_nodes));
+
+    xs_arena_hold(h);
+}
+
+
+static int _block_lookup(const char *url)
+/* checks if the host of an url is blocked (block_mutex must be locked) */
+{
+    const char *h;
+    int len;
+    int node = 0;
+
+    _block_host(url, &h, &len);
+
+    while (len > 0) {
+        int start = len;
+
+        while (start > 0 && h[start - 1] != '.')
+            start--;
+
+        node = _block_find(node, h + start, len - start,
+                    _block_hash(node, h + start, len - start));
+
+        if (node == 0)
+            break;
+
+        /* the full host? */
+        if (start == 0)
+            return !!(block_nodes[node].flags & BLOCK_HOST);
+
+        /* a subdomain of a wildcard? */
+        if (block_nodes[node].flags & BLOCK_SUBDOMAINS)
+            return 1;
+
+        len = start - 1;
+    }
+
+    return 0;
+}
+
+
+xs_str *_instance_block_fn(const char *instance)
+/* returns the block file of an instance (named after its normalized host) */
+{
+    const char *h;
+    int len;
+
+    _block_host(instance, &h, &len);
+
+    xs *host = xs_fmt("%.*s", len, h);
+    host = xs_tolower_i(host);
+    xs *md5 = xs_md5_hex(host, strlen(host));
+
+    return xs_fmt("%s/block/%s", srv_basedir, md5);
+}
+
+
+int is_instance_blocked(const char *instance)
+{
+    int ret;
+
+    pthread_mutex_lock(&block_mutex);
+
+    _block_load();
+    ret = _block_lookup(instance);
+
+    pthread_mutex_unlock(&block_mutex);
+
+    return ret;
+}
+
+
+static void _block_update(const char *instance, int set)
+/* keeps the trie in sync with a change made here (block_mutex must be locked) */
+{
+    int h = xs_arena_hold(1);
+    int flags;
+    int node = _block_walk(instance, set, &flags);
+
+    if (node) {
+        if (set)
+            block_nodes[node].flags |= flags;
+        else
+            block_nodes[node].flags &= ~flags;
+    }
+
+    /* don't reload just because of this */
+    xs *dir  = xs_fmt("%s/block", srv_basedir);
+    double m = mtime(dir);
+
+    if (block_mtime != -1.0 && m < (double)time(NULL))
+        block_mtime = m;
+
+    xs_arena_hold(h);
+}
+
+
+int instance_block(const char *instance)
+/* blocks a full instance */
+{
+    int ret;
+
+    /* create the subdir */
+    xs *dir = xs_fmt("%s/block/", srv_basedir);
+    mkdirx(dir);
+
+    pthread_mutex_lock(&block_mutex);
+
+    _block_load();
+
+    xs *fn = _instance_block_fn(instance);
+
+    if (mtime(fn) == 0.0) {
+        FILE *f;
+
+        if ((f = fopen(fn, "w")) != NULL) {
+            fprintf(f, "%s\n", instance);
+            fclose(f);
+
+            _block_update(instance, 1);
+
+            ret = 0;
+        }
+        else
+            ret = -1;
+    }
+    else
+        ret = -2;
+
+    pthread_mutex_unlock(&block_mutex);
+
+    return ret;
+}
+
+
+int instance_unblock(const char *instance)
+/* unblocks a full instance */
+{
+    int ret;
+
+    pthread_mutex_lock(&block_mutex);
+
+    _block_load();
+
+    xs *fn = _instance_block_fn(instance);
+
+    if (mtime(fn) != 0.0) {
+        ret = unlink(fn);
+
+        _block_update(instance, 0);
+    }
+    else
+        ret = -2;
+
+    pthread_mutex_unlock(&block_mutex);
+
+    return ret;
+}
+
+
+int instance_block_import(const char *fn)
+/* blocks all the instances from a file (one per line, or a CSV file
+   with the domain in the first column); returns the number of new blocks */
+{
+    FILE *f;
+    int cnt = 0;
+
+    if ((f = fopen(fn, "r")) == NULL)
+        return -1;
+
+    for (;;) {
+        xs *l = xs_readline(f);
+
+        if (l == NULL)
+            break;
+
+        l = xs_strip_i(l);
+
+        if (*l == '\0' || *l == '#')
+            continue;
+
+        xs *l2 = xs_split_n(l, ",", 1);
+        xs *instance = xs_strip_i(xs_dup(xs_list_get(l2, 0)));
+
+        if (*instance && instance_block(instance) == 0)
+            cnt++;
+    }
+
+    fclose(f);
+
+    return cnt;
+}
 
 
 /** operations by content **/
 
+/** content filter **/
+
+/* The rules in a filter file (like filter_reject.txt) are compiled once
+   and recompiled when the file changes. Lines without regex metacharacters
+   are keywords, all of them searched in a single pass with an Aho-Corasick
+   automaton; the rest are compiled into regex_t objects. */
+
+typedef struct {
+    xs_str *rule;           /* the line from the file */
+    int is_rx;              /* it's a regex (not a keyword) */
+    regex_t re;             /* the compiled regex */
+    unsigned long hits;     /* number of matches */
+} filter_rule;
+
+typedef struct {
+    int refs;               /* threads using it (+1 if current) */
+    double mtime;           /* mtime of the file when compiled */
+    xs_str *file;           /* file name, relative to basedir */
+    int n_rules;
+    filter_rule *rules;
+    int n_nodes;            /* automaton states (0 is the root) */
+    int a_nodes;
+    int *fail;              /* failure link of each state */
+    int *out;               /* lowest matching rule + 1, or 0 */
+    int edge_size;          /* hash table of (state, byte) -> state */
+    int n_edges;
+    unsigned int *edge_key;
+    int *edge_val;
+} content_filter;
+
+static content_filter *cfilter = NULL;
+static int cfilter_dirty = 0;           /* hit counters changed */
+static time_t cfilter_checked = 0;
+static time_t cfilter_saved = 0;
+
+#define CFILTER_EDGE(state, byte) (((unsigned int)(state) << 8) | (unsigned char)(byte))
+
+
+static int _cfilter_edge(const content_filter *cf, int state, int byte)
+/* returns the transition from state by byte, or -1 */
+{
+    unsigned int key = CFILTER_EDGE(state, byte);
+    unsigned int i   = (key * 2654435761U) & (cf->edge_size - 1);
+
+    while (cf->edge_key[i] != 0xffffffff) {
+        if (cf->edge_key[i] == key)
+            return cf->edge_val[i];
+
+        i = (i + 1) & (cf->edge_size - 1);
+    }
+
+    return -1;
+}
+
+
+static void _cfilter_edge_put(content_filter *cf, unsigned int key, int val)
+/* stores a transition in the hash table */
+{
+    unsigned int i = (key * 2654435761U) & (cf->edge_size - 1);
+
+    while (cf->edge_key[i] != 0xffffffff)
+        i = (i + 1) & (cf->edge_size - 1);
+
+    cf->edge_key[i] = key;
+    cf->edge_val[i] = val;
+}
+
+
+static void _cfilter_keyword(content_filter *cf, const char *kw, int rule)
+/* adds a keyword to the automaton */
+{
+    int state = 0;
+
+    for (; *kw; kw++) {
+        int next = _cfilter_edge(cf, state, *kw);
+
+        if (next == -1) {
+            if (cf->n_nodes == cf->a_nodes) {
+                cf->a_nodes *= 2;
+                cf->fail = xs_realloc(cf->fail, cf->a_nodes * sizeof(int));
+                cf->out  = xs_realloc(cf->out,  cf->a_nodes * sizeof(int));
+            }
+
+            /* keep the table at most half full */
+            if ((cf->n_edges + 1) * 2 > cf->edge_size) {
+                unsigned int *o_key = cf->edge_key;
+                int *o_val = cf->edge_val;
+                int o_size = cf->edge_size;
+                int n;
+
+                cf->edge_size *= 2;
+                cf->edge_key = xs_realloc(NULL, cf->edge_size * sizeof(unsigned int));
+                cf->edge_val = xs_realloc(NULL, cf->edge_size * sizeof(int));
+                memset(cf->edge_key, 0xff, cf->edge_size * sizeof(unsigned int));
+
+                for (n = 0; n < o_size; n++) {
+                    if (o_key[n] != 0xffffffff)
+                        _cfilter_edge_put(cf, o_key[n], o_val[n]);
+                }
+
+                xs_free(o_key);
+                xs_free(o_val);
+            }
+
+            next = cf->n_nodes++;
+            cf->fail[next] = 0;
+            cf->out[next]  = 0;
+
+            _cfilter_edge_put(cf, CFILTER_EDGE(state, *kw), next);
+            cf->n_edges++;
+        }
+
+        state = next;
+    }
+
+    if (state != 0 && (cf->out[state] == 0 || cf->out[state] > rule + 1))
+        cf->out[state] = rule + 1;
+}
+
+
+static void _cfilter_link(content_filter *cf)
+/* computes the failure links, breadth-first */
+{
+    int *queue = xs_realloc(NULL, cf->n_nodes * sizeof(int));
+    int head = 0, tail = 0;
+    int n, b;
+
+    /* the children of the root fail to the root */
+    for (b = 0; b < 256; b++) {
+        if ((n = _cfilter_edge(cf, 0, b)) != -1) {
+            cf->fail[n] = 0;
+            queue[tail++] = n;
+        }
+    }
+
+    while (head < tail) {
+        int s = queue[head++];
+
+        for (b = 0; b < 256; b++) {
+            int c = _cfilter_edge(cf, s, b);
+
+            if (c == -1)
+                continue;
+
+            int f = cf->fail[s];
+            int t;
+
+            while ((t = _cfilter_edge(cf, f, b)) == -1 && f != 0)
+                f = cf->fail[f];
+
+            cf->fail[c] = t != -1 ? t : 0;
+
+            /* inherit the matches of the suffix */
+            int fo = cf->out[cf->fail[c]];
+
+            if (fo && (cf->out[c] == 0 || fo < cf->out[c]))
+                cf->out[c] = fo;
+
+            queue[tail++] = c;
+        }
+    }
+
+    xs_free(queue);
+}
+
+
+static void _cfilter_free(content_filter *cf)
+/* frees a compiled filter */
+{
+    int n;
+
+    for (n = 0; n < cf->n_rules; n++) {
+        if (cf->rules[n].is_rx)
+            regfree(&cf->rules[n].re);
+
+        xs_free(cf->rules[n].rule);
+    }
+
+    xs_free(cf->rules);
+    xs_free(cf->fail);
+    xs_free(cf->out);
+    xs_free(cf->edge_key);
+    xs_free(cf->edge_val);
+    xs_free(cf->file);
+    xs_free(cf);
+}
+
+
+static xs_str *_cfilter_hits_fn(const char *file)
+/* returns the file name of the hit counters */
+{
+    return xs_fmt("%s/%s.hits", srv_basedir, file);
+}
+
+
+static content_filter *_cfilter_compile(const char *file, double mt, const content_filter *old)
+/* compiles the rules in a filter file */
+{
+    content_filter *cf = xs_realloc(NULL, sizeof(content_filter));
+    xs *fn = xs_fmt("%s/%s", srv_basedir, file);
+    xs *hits = xs_dict_new();
+    FILE *f;
+    int n;
+
+    memset(cf, '\0', sizeof(content_filter));
+
+    cf->file  = xs_str_new(file);
+    cf->mtime = mt;
+
+    cf->a_nodes = 64;
+    cf->fail    = xs_realloc(NULL, cf->a_nodes * sizeof(int));
+    cf->out     = xs_realloc(NULL, cf->a_nodes * sizeof(int));
+    cf->n_nodes = 1;
+    cf->fail[0] = 0;
+    cf->out[0]  = 0;
+
+    cf->edge_size = 128;
+    cf->edge_key  = xs_realloc(NULL, cf->edge_size * sizeof(unsigned int));
+    cf->edge_val  = xs_realloc(NULL, cf->edge_size * sizeof(int));
+    memset(cf->edge_key, 0xff, cf->edge_size * sizeof(unsigned int));
+
+    /* keep the hit counters of the rules that survive */
+    if (old != NULL) {
+        for (n = 0; n < old->n_rules; n++) {
+            xs *h = xs_number_new(old->rules[n].hits);
+            hits = xs_dict_set(hits, old->rules[n].rule, h);
+        }
+    }
+    else {
+        xs *hfn = _cfilter_hits_fn(file);
+
+        if ((f = fopen(hfn, "r")) != NULL) {
+            for (;;) {
+                xs *l = xs_readline(f);
+
+                if (l == NULL || *l == '\0')
+                    break;
+
+                l = xs_strip_i(l);
+                xs *l2 = xs_split_n(l, "\t", 1);
+
+                if (xs_list_len(l2) == 2) {
+                    xs *h = xs_number_new(atol(xs_list_get(l2, 0)));
+                    hits = xs_dict_set(hits, xs_list_get(l2, 1), h);
+                }
+            }
+
+            fclose(f);
+        }
+    }
+
+    if ((f = fopen(fn, "r")) != NULL) {
+        int a_rules = 0;
+
+        for (;;) {
+            xs *l = xs_readline(f);
+
+            if (l == NULL || *l == '\0')
+                break;
+
+            l = xs_strip_i(l);
+
+            if (*l == '\0')
+                continue;
+
+            if (cf->n_rules == a_rules) {
+                a_rules = a_rules ? a_rules * 2 : 32;
+                cf->rules = xs_realloc(cf->rules, a_rules * sizeof(filter_rule));
+            }
+
+            filter_rule *r = &cf->rules[cf->n_rules];
+
+            r->is_rx = strpbrk(l, "\\^$.[]|()*+?{}") != NULL;
+            r->hits  = xs_number_get(xs_dict_get(hits, l));
+
+            if (r->is_rx) {
+                if (regcomp(&r->re, l, REG_EXTENDED | REG_NOSUB) != 0) {
+                    srv_log(xs_fmt("content filter %s: bad regex '%s'", file, l));
+                    continue;
+                }
+            }
+            else {
+                /* content is matched in lowercase */
+                xs *kw = xs_tolower_i(xs_dup(l));
+                _cfilter_keyword(cf, kw, cf->n_rules);
+            }
+
+            r->rule = xs_dup(l);
+            cf->n_rules++;
+        }
+
+        fclose(f);
+
+        _cfilter_link(cf);
+    }
+
+    srv_debug(1, xs_fmt("content filter %s: %d rules, %d states",
+        file, cf->n_rules, cf->n_nodes));
+
+    return cf;
+}
+
+
+static content_filter *_cfilter_get(const char *file)
+/* returns the compiled filter, recompiling it if the file changed */
+{
+    content_filter *cf;
+
+    pthread_mutex_lock(&cfilter_mutex);
+
+    time_t t = time(NULL);
+
+    /* check the file at most once per second */
+    if (cfilter == NULL || strcmp(cfilter->file, file) != 0 || t != cfilter_checked) {
+        xs *fn = xs_fmt("%s/%s", srv_basedir, file);
+        double mt = mtime(fn);
+
+        cfilter_checked = t;
+
+        if (cfilter == NULL || strcmp(cfilter->file, file) != 0 || mt != cfilter->mtime) {
+            int h = xs_arena_hold(1);
+            content_filter *n = _cfilter_compile(file, mt, cfilter);
+
+            if (cfilter && --cfilter->refs == 0)
+                _cfilter_free(cfilter);
+
+            cfilter = n;
+            cfilter->refs = 1;
+
+            xs_arena_hold(h);
+        }
+    }
+
+    cf = cfilter;
+    cf->refs++;
+
+    pthread_mutex_unlock(&cfilter_mutex);
+
+    return cf;
+}
+
+
+static void _cfilter_release(content_filter *cf)
+/* stops using a compiled filter */
+{
+    pthread_mutex_lock(&cfilter_mutex);
+
+    if (--cf->refs == 0) {
+        int h = xs_arena_hold(1);
+        _cfilter_free(cf);
+        xs_arena_hold(h);
+    }
+
+    pthread_mutex_unlock(&cfilter_mutex);
+}
+
+
+static xs_str *_cfilter_text(const char *html)
+/* strips the HTML tags, squeezes the spaces and converts to lowercase */
+{
+    xs_str *s = xs_str_new(NULL);
+    int sp = 0;
+
+    while (*html) {
+        if (*html == '<') {
+            const char *e = strchr(html, '>');
+
+            if (e != NULL && e > html + 1) {
+                html = e + 1;
+                sp = 1;
+                continue;
+            }
+        }
+
+        if (*html == ' ')
+            sp = 1;
+        else {
+            if (sp) {
+                s = xs_append_m(s, " ", 1);
+                sp = 0;
+            }
+
+            s = xs_append_m(s, html, 1);
+        }
+
+        html++;
+    }
+
+    if (sp)
+        s = xs_append_m(s, " ", 1);
+
+    return xs_tolower_i(s);
+}
+
+
+xs_str *content_filter_match(const char *file, const xs_dict *msg)
+/* returns the first rule in file that matches the content of msg, or NULL */
+{
+    const char *v = xs_dict_get(msg, "content");
+    xs_str *ret = NULL;
+
+    if (xs_type(v) != XSTYPE_STRING || *v == '\0')
+        return NULL;
+
+    content_filter *cf = _cfilter_get(file);
+
+    if (cf->n_rules) {
+        xs *c = _cfilter_text(v);
+        const char *p;
+        int state = 0;
+        int m = 0;
+        int n;
+
+        /* keywords: one pass over the content */
+        for (p = c; *p && m != 1; p++) {
+            int next;
+
+            while ((next = _cfilter_edge(cf, state, *p)) == -1 && state != 0)
+                state = cf->fail[state];
+
+            state = next != -1 ? next : 0;
+
+            if (cf->out[state] && (m == 0 || cf->out[state] < m))
+                m = cf->out[state];
+        }
+
+        /* regexes, only those before the first keyword match */
+        for (n = 0; n < (m ? m - 1 : cf->n_rules); n++) {
+            if (cf->rules[n].is_rx && regexec(&cf->rules[n].re, c, 0, NULL, 0) == 0) {
+                m = n + 1;
+                break;
+            }
+        }
+
+        if (m) {
+            filter_rule *r = &cf->rules[m - 1];
+
+            pthread_mutex_lock(&cfilter_mutex);
+            r->hits++;
+            cfilter_dirty = 1;
+            pthread_mutex_unlock(&cfilter_mutex);
+
+            srv_debug(1, xs_fmt("content_match: match for '%s' (%lu hits)", r->rule, r->hits));
+
+            ret = xs_dup(r->rule);
+        }
+    }
+
+    _cfilter_release(cf);
+
+    return ret;
+}
+
+
 int content_match(const char *file, const xs_dict *msg)
-/* checks if a message's content matches any of the regexes in file */
-/* file format: one regex per line */
+/* checks if a message's content matches any of the rules in file */
+/* file format: one regex or keyword per line */
 {
-    xs *fn = xs_fmt("%s/%s", srv_basedir, file);
-    FILE *f;
-    int r = 0;
-    const char *v = xs_dict_get(msg, "content");
+    xs *rule = content_filter_match(file, msg);
 
-    if (xs_type(v) == XSTYPE_STRING && *v) {
-        if ((f = fopen(fn, "r")) != NULL) {
-            srv_debug(1, xs_fmt("content_match: loading regexes from %s", fn));
+    return rule != NULL;
+}
 
-            /* massage content (strip HTML tags, etc.) */
-            xs *c = xs_regex_replace(v, "<[^>]+>", " ");
-            c = xs_regex_replace_i(c, " {2,}", " ");
-            c = xs_tolower_i(c);
 
-            while (!r && !feof(f)) {
-                xs *rx = xs_strip_i(xs_readline(f));
+void content_filter_checkpoint(int force)
+/* saves the hit counters of the content filter, if changed */
+{
+    time_t t = time(NULL);
 
-                if (*rx && xs_regex_match(c, rx)) {
-                    srv_debug(1, xs_fmt("content_match: match for '%s'", rx));
-                    r = 1;
-                }
+    pthread_mutex_lock(&cfilter_mutex);
+
+    if (cfilter != NULL && cfilter_dirty && (force || t - cfilter_saved > 5 * 60)) {
+        xs *fn  = _cfilter_hits_fn(cfilter->file);
+        xs *nfn = xs_fmt("%s.new", fn);
+        FILE *f;
+
+        if ((f = fopen(nfn, "w")) != NULL) {
+            int n;
+
+            for (n = 0; n < cfilter->n_rules; n++) {
+                if (cfilter->rules[n].hits)
+                    fprintf(f, "%lu\t%s\n", cfilter->rules[n].hits, cfilter->rules[n].rule);
             }
 
             fclose(f);
+            rename(nfn, fn);
+
+            cfilter_dirty = 0;
+            cfilter_saved = t;
         }
     }
 
-    return r;
+    pthread_mutex_unlock(&cfilter_mutex);
 }
 
 
@@ -2780,10 +5498,16 @@ xs_list *content_search(snac *user, const char *regex,
     xs_list *r = xs_set_result(&seen);
 
     if (skip) {
-        /* BAD */
-        while (skip--) {
-            r = xs_list_del(r, 0);
-        }
+        /* drop the first ones all at once */
+        xs_vec rv;
+
+        xs_vec_from_list(&rv, r);
+        xs_vec_shift_n(&rv, skip);
+
+        xs_free(r);
+        r = xs_vec_to_list(&rv);
+
+        xs_vec_free(&rv);
     }
 
     xs_free(tls[0]);
@@ -2796,6 +5520,173 @@ xs_list *content_search(snac *user, const char *regex,
 
 /** notifications **/
 
+/* Notifications are stored as an append-only log of fixed-size records
+   (notify.log) with the time id, type, utype and the md5 of the actor
+   and the object, so they can be listed and paged by seeking; the full
+   notification is in notify/<id>.json. The number of cleared records
+   at the start of the log and the number of unread notifications are
+   stored in notify.cur. */
+
+#define NOTIFY_REC_SIZE 116
+#define NOTIFY_TID_SIZE 17
+
+static xs_str *_notify_fn(snac *snac, const char *name)
+{
+    return xs_fmt("%s/%s", snac->basedir, name);
+}
+
+
+static void _notify_cur_get(snac *snac, int *first, int *unread)
+/* reads the notification cursor */
+{
+    xs *fn = _notify_fn(snac, "notify.cur");
+    FILE *f;
+
+    *first = *unread = 0;
+
+    if ((f = fopen(fn, "r")) != NULL) {
+        if (fscanf(f, "%d %d", first, unread) != 2)
+            *first = *unread = 0;
+
+        fclose(f);
+    }
+}
+
+
+static void _notify_cur_set(snac *snac, int first, int unread)
+/* writes the notification cursor */
+{
+    xs *fn = _notify_fn(snac, "notify.cur");
+    FILE *f;
+
+    if ((f = fopen(fn, "w")) != NULL) {
+        fprintf(f, "%d %d\n", first, unread);
+        fclose(f);
+    }
+}
+
+
+static void _notify_rec_put(FILE *f, const char *tid, const char *type,
+                            const char *utype, const char *actor, const char *objid)
+/* writes a notification record */
+{
+    xs *a_md5 = xs_md5_hex(actor, strlen(actor));
+    xs *o_md5 = xs_md5_hex(objid, strlen(objid));
+
+    fprintf(f, "%-17.17s %-15.15s %-15.15s %s %s\n",
+        tid, type, xs_is_null(utype) ? "" : utype, a_md5, o_md5);
+}
+
+
+static int _notify_rec_get(FILE *f, int n, char rec[NOTIFY_REC_SIZE + 1])
+/* reads the record #n of the notification log */
+{
+    if (fseek(f, (long)n * NOTIFY_REC_SIZE, SEEK_SET) == -1 ||
+        fread(rec, NOTIFY_REC_SIZE, 1, f) != 1)
+        return 0;
+
+    rec[NOTIFY_REC_SIZE] = '\0';
+    return 1;
+}
+
+
+static xs_str *_notify_rec_field(const char *rec, int offset, int size)
+/* returns a field from a notification record */
+{
+    xs_str *s = xs_fmt("%.*s", size, rec + offset);
+    return xs_strip_i(s);
+}
+
+
+static int _notify_log_len(const char *fn)
+/* returns the number of records in a notification log */
+{
+    struct stat st;
+
+    if (stat(fn, &st) == -1)
+        return 0;
+
+    return st.st_size / NOTIFY_REC_SIZE;
+}
+
+
+static int _notify_rec_find(FILE *f, int lo, int hi, const char *tid, int incl)
+/* returns the position of the first record newer than
+   (or, if incl is set, as new as) tid */
+{
+    char rec[NOTIFY_REC_SIZE + 1];
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (!_notify_rec_get(f, mid, rec))
+            break;
+
+        int cmp = strncmp(rec, tid, NOTIFY_TID_SIZE);
+
+        if (cmp < 0 || (cmp == 0 && !incl))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+
+static void _notify_log_build(snac *snac)
+/* creates the log from the stored notifications, if needed (data_mutex must be locked) */
+{
+    xs *log = _notify_fn(snac, "notify.log");
+
+    if (mtime(log) > 0.0)
+        return;
+
+    xs *spec = xs_fmt("%s/notify/" "*.json", snac->basedir);
+    xs *lst  = xs_glob(spec, 0, 0);
+    xs *t    = notify_check_time(snac, 0);
+    const char *v;
+    int unread = 0;
+    int c = 0;
+    FILE *f;
+
+    if ((f = fopen(log, "w")) == NULL)
+        return;
+
+    while (xs_list_next(lst, &v, &c)) {
+        FILE *nf;
+        xs *noti = NULL;
+
+        if ((nf = fopen(v, "r")) != NULL) {
+            noti = xs_json_load(nf);
+            fclose(nf);
+        }
+
+        const char *id    = xs_dict_get(noti, "id");
+        const char *type  = xs_dict_get(noti, "type");
+        const char *actor = xs_dict_get(noti, "actor");
+        const char *objid = xs_dict_get(noti, "objid");
+
+        if (xs_is_null(id) || xs_is_null(type) || xs_is_null(actor))
+            continue;
+
+        _notify_rec_put(f, id, type, xs_dict_get(noti, "utype"),
+            actor, xs_is_null(objid) ? id : objid);
+
+        if (strcmp(id, t) > 0)
+            unread++;
+    }
+
+    fclose(f);
+
+    _notify_cur_set(snac, 0, unread);
+
+    /* the old index is no longer used */
+    xs *idx = _notify_fn(snac, "notify.idx");
+    unlink(idx);
+}
+
+
 xs_str *notify_check_time(snac *snac, int reset)
 /* gets or resets the latest notification check time */
 {
@@ -2809,6 +5700,16 @@ xs_str *notify_check_time(snac *snac, int reset)
             fprintf(f, "%s\n", t);
             fclose(f);
         }
+
+        /* everything is read now */
+        int first, unread;
+
+        pthread_mutex_lock(&data_mutex);
+
+        _notify_cur_get(snac, &first, &unread);
+        _notify_cur_set(snac, first, 0);
+
+        pthread_mutex_unlock(&data_mutex);
     }
     else {
         if ((f = fopen(fn, "r")) != NULL) {
@@ -2850,24 +5751,30 @@ void notify_add(snac *snac, const char *type, const char *utype,
     if (!xs_is_null(objid))
         noti = xs_dict_append(noti, "objid", objid);
 
+    pthread_mutex_lock(&data_mutex);
+
+    /* convert the old storage, if needed */
+    _notify_log_build(snac);
+
     if ((f = fopen(fn, "w")) != NULL) {
         xs_json_dump(noti, 4, f);
         fclose(f);
     }
 
-    /* add it to the index if it already exists */
-    xs *idx = xs_fmt("%s/notify.idx", snac->basedir);
+    /* append it to the log */
+    xs *log = _notify_fn(snac, "notify.log");
 
-    if (mtime(idx) != 0.0) {
-        pthread_mutex_lock(&data_mutex);
+    if ((f = fopen(log, "a")) != NULL) {
+        int first, unread;
 
-        if ((f = fopen(idx, "a")) != NULL) {
-            fprintf(f, "%-32s\n", ntid);
-            fclose(f);
-        }
+        _notify_rec_put(f, ntid, type, utype, actor, xs_is_null(objid) ? ntid : objid);
+        fclose(f);
 
-        pthread_mutex_unlock(&data_mutex);
+        _notify_cur_get(snac, &first, &unread);
+        _notify_cur_set(snac, first, unread + 1);
     }
+
+    pthread_mutex_unlock(&data_mutex);
 }
 
 
@@ -2893,83 +5800,156 @@ xs_dict *notify_get(snac *snac, const char *id)
 }
 
 
-xs_list *notify_list(snac *snac, int skip, int show)
-/* returns a list of notification ids */
+static xs_list *_notify_list(snac *snac, const char *max_tid,
+                             const char *min_tid, int skip, int show, int full)
+/* returns notifications from the log, newest first */
 {
-    xs *idx = xs_fmt("%s/notify.idx", snac->basedir);
+    xs_list *list = xs_list_new();
+    xs *log = _notify_fn(snac, "notify.log");
+    int first, unread;
+    FILE *f;
 
-    if (mtime(idx) == 0.0) {
-        /* create the index from scratch */
-        FILE *f;
+    pthread_mutex_lock(&data_mutex);
 
-        pthread_mutex_lock(&data_mutex);
+    _notify_log_build(snac);
+    _notify_cur_get(snac, &first, &unread);
 
-        if ((f = fopen(idx, "w")) != NULL) {
-            xs *spec = xs_fmt("%s/notify/" "*.json", snac->basedir);
-            xs *lst  = xs_glob(spec, 1, 0);
-            xs_list *p = lst;
-            const char *v;
+    pthread_mutex_unlock(&data_mutex);
 
-            while (xs_list_iter(&p, &v)) {
-                char *p = strrchr(v, '.');
-                if (p) {
-                    *p = '\0';
-                    fprintf(f, "%-32s\n", v);
-                }
+    if ((f = fopen(log, "r")) != NULL) {
+        char rec[NOTIFY_REC_SIZE + 1];
+        int lo = first;
+        int hi = _notify_log_len(log);
+        int n;
+
+        /* narrow the range by time id */
+        if (max_tid != NULL)
+            hi = _notify_rec_find(f, lo, hi, max_tid, 1);
+
+        if (min_tid != NULL)
+            lo = _notify_rec_find(f, lo, hi, min_tid, 0);
+
+        for (n = hi - 1 - skip; n >= lo && show > 0; n--) {
+            if (!_notify_rec_get(f, n, rec))
+                break;
+
+            xs *id = _notify_rec_field(rec, 0, NOTIFY_TID_SIZE);
+
+            if (full) {
+                xs *type  = _notify_rec_field(rec, 18, 15);
+                xs *utype = _notify_rec_field(rec, 34, 15);
+                xs *actor = _notify_rec_field(rec, 50, 32);
+                xs *objid = _notify_rec_field(rec, 83, 32);
+                xs *date  = xs_str_utctime((time_t)atol(id), ISO_DATE_SPEC);
+                xs *d     = xs_dict_new();
+
+                d = xs_dict_append(d, "id",        id);
+                d = xs_dict_append(d, "type",      type);
+                d = xs_dict_append(d, "utype",     utype);
+                d = xs_dict_append(d, "actor_md5", actor);
+                d = xs_dict_append(d, "objid_md5", objid);
+                d = xs_dict_append(d, "date",      date);
+
+                list = xs_list_append(list, d);
             }
+            else
+                list = xs_list_append(list, id);
 
-            fclose(f);
+            show--;
         }
 
-        pthread_mutex_unlock(&data_mutex);
+        fclose(f);
     }
 
-    return index_list_desc(idx, skip, show);
+    return list;
+}
+
+
+xs_list *notify_list(snac *snac, int skip, int show)
+/* returns a list of notification ids */
+{
+    return _notify_list(snac, NULL, NULL, skip, show, 0);
+}
+
+
+xs_list *notify_page(snac *snac, const char *max_tid, const char *min_tid, int show)
+/* returns the notification records older than max_tid and newer than min_tid */
+{
+    return _notify_list(snac, max_tid, min_tid, 0, show, 1);
 }
 
 
 int notify_new_num(snac *snac)
 /* counts the number of new notifications */
 {
-    xs *t = notify_check_time(snac, 0);
-    xs *lst = notify_list(snac, 0, XS_ALL);
-    int cnt = 0;
-
-    xs_list *p = lst;
-    const xs_str *v;
+    int first, unread;
 
-    while (xs_list_iter(&p, &v)) {
-        xs *id = xs_strip_i(xs_dup(v));
+    pthread_mutex_lock(&data_mutex);
 
-        /* old? count no more */
-        if (strcmp(id, t) < 0)
-            break;
+    _notify_log_build(snac);
+    _notify_cur_get(snac, &first, &unread);
 
-        cnt++;
-    }
+    pthread_mutex_unlock(&data_mutex);
 
-    return cnt;
+    return unread;
 }
 
 
 void notify_clear(snac *snac)
 /* clears all notifications */
 {
-    xs *spec   = xs_fmt("%s/notify/" "*", snac->basedir);
-    xs *lst    = xs_glob(spec, 0, 0);
-    xs_list *p = lst;
-    const xs_str *v;
+    xs *log = _notify_fn(snac, "notify.log");
+
+    pthread_mutex_lock(&data_mutex);
 
-    while (xs_list_iter(&p, &v))
-        unlink(v);
+    /* just move the cursor; the purge will do the rest */
+    _notify_log_build(snac);
+    _notify_cur_set(snac, _notify_log_len(log), 0);
 
-    xs *idx = xs_fmt("%s/notify.idx", snac->basedir);
+    pthread_mutex_unlock(&data_mutex);
+}
 
-    if (mtime(idx) != 0.0) {
-        pthread_mutex_lock(&data_mutex);
-        truncate(idx, 0);
-        pthread_mutex_unlock(&data_mutex);
+
+void notify_purge(snac *snac)
+/* deletes the cleared notifications and compacts the log */
+{
+    xs *log = _notify_fn(snac, "notify.log");
+    xs *tmp = _notify_fn(snac, "notify.log.new");
+    int first, unread;
+    FILE *f, *o;
+
+    pthread_mutex_lock(&data_mutex);
+
+    _notify_cur_get(snac, &first, &unread);
+
+    if (first > 0 && (f = fopen(log, "r")) != NULL) {
+        if ((o = fopen(tmp, "w")) != NULL) {
+            char rec[NOTIFY_REC_SIZE + 1];
+            int n;
+
+            for (n = 0; _notify_rec_get(f, n, rec); n++) {
+                if (n < first) {
+                    xs *id = _notify_rec_field(rec, 0, NOTIFY_TID_SIZE);
+                    xs *fn = xs_fmt("%s/notify/%s.json", snac->basedir, id);
+
+                    unlink(fn);
+                }
+                else
+                    fwrite(rec, NOTIFY_REC_SIZE, 1, o);
+            }
+
+            fclose(o);
+
+            if (rename(tmp, log) != -1)
+                _notify_cur_set(snac, 0, unread);
+
+            snac_debug(snac, 1, xs_fmt("notify_purge %d", first));
+        }
+
+        fclose(f);
     }
+
+    pthread_mutex_unlock(&data_mutex);
 }
 
 
@@ -2995,7 +5975,7 @@ static xs_dict *_enqueue_put(const char *fn, xs_dict *msg)
 static xs_dict *_new_qmsg(const char *type, const xs_val *msg, int retries)
 /* creates a queue message */
 {
-    int qrt  = xs_number_get(xs_dict_get(srv_config, "queue_retry_minutes"));
+    int qrt  = srv_conf->queue_retry_minutes;
     xs *ntid = tid(retries * 60 * qrt);
     xs *rn   = xs_number_new(retries);
 
@@ -3010,7 +5990,8 @@ static xs_dict *_new_qmsg(const char *type, const xs_val *msg, int retries)
 }
 
 
-void enqueue_input(snac *snac, const xs_dict *msg, const xs_dict *req, int retries)
+void enqueue_input(snac *snac, const xs_dict *msg, const xs_dict *req,
+                   const char *seen, int retries)
 /* enqueues an input message */
 {
     xs *qmsg   = _new_qmsg("input", msg, retries);
@@ -3019,13 +6000,17 @@ void enqueue_input(snac *snac, const xs_dict *msg, const xs_dict *req, int retri
 
     qmsg = xs_dict_append(qmsg, "req", req);
 
+    if (seen != NULL)
+        qmsg = xs_dict_append(qmsg, "seen", seen);
+
     qmsg = _enqueue_put(fn, qmsg);
 
     snac_debug(snac, 1, xs_fmt("enqueue_input %s", xs_dict_get(msg, "id")));
 }
 
 
-void enqueue_shared_input(const xs_dict *msg, const xs_dict *req, int retries)
+void enqueue_shared_input(const xs_dict *msg, const xs_dict *req,
+                          const char *seen, int retries)
 /* enqueues an input message from the shared input */
 {
     xs *qmsg   = _new_qmsg("input", msg, retries);
@@ -3034,6 +6019,9 @@ void enqueue_shared_input(const xs_dict *msg, const xs_dict *req, int retries)
 
     qmsg = xs_dict_append(qmsg, "req", req);
 
+    if (seen != NULL)
+        qmsg = xs_dict_append(qmsg, "seen", seen);
+
     qmsg = _enqueue_put(fn, qmsg);
 
     srv_debug(1, xs_fmt("enqueue_shared_input %s", xs_dict_get(msg, "id")));
@@ -3181,6 +6169,58 @@ void enqueue_object_request(snac *user, const char *id, int forward_secs)
 }
 
 
+void enqueue_ancestor_request(snac *user, const char *id, int level)
+/* enqueues the request of an ancestor of a timeline entry */
+{
+    xs *qmsg = _new_qmsg("ancestor_request", id, 0);
+    xs *ntid = tid(0);
+    xs *fn   = xs_fmt("%s/queue/%s.json", srv_basedir, ntid);
+    xs *lv   = xs_number_new(level);
+
+    /* it goes to the global queue, so that it's run by the job threads */
+    qmsg = xs_dict_set(qmsg, "ntid", ntid);
+    qmsg = xs_dict_append(qmsg, "uid", user->uid);
+    qmsg = xs_dict_append(qmsg, "level", lv);
+
+    qmsg = _enqueue_put(fn, qmsg);
+
+    snac_debug(user, 1, xs_fmt("enqueue_ancestor_request %s %d", id, level));
+}
+
+
+void enqueue_home_restore(snac *user, const char *actor)
+/* enqueues the restoration of an actor's entries into the home timeline */
+{
+    xs *qmsg = _new_qmsg("home_restore", actor, 0);
+    xs *ntid = tid(0);
+    xs *fn   = xs_fmt("%s/queue/%s.json", srv_basedir, ntid);
+
+    /* it goes to the global queue, so that it's run by the job threads */
+    qmsg = xs_dict_set(qmsg, "ntid", ntid);
+    qmsg = xs_dict_append(qmsg, "uid", user->uid);
+
+    qmsg = _enqueue_put(fn, qmsg);
+
+    snac_debug(user, 1, xs_fmt("enqueue_home_restore %s", actor));
+}
+
+
+void enqueue_home_drop(snac *user, const char *actor)
+/* enqueues the removal of an actor's entries from the home timeline */
+{
+    xs *qmsg = _new_qmsg("home_drop", actor, 0);
+    xs *ntid = tid(0);
+    xs *fn   = xs_fmt("%s/queue/%s.json", srv_basedir, ntid);
+
+    qmsg = xs_dict_set(qmsg, "ntid", ntid);
+    qmsg = xs_dict_append(qmsg, "uid", user->uid);
+
+    qmsg = _enqueue_put(fn, qmsg);
+
+    snac_debug(user, 1, xs_fmt("enqueue_home_drop %s", actor));
+}
+
+
 void enqueue_verify_links(snac *user)
 /* enqueues a link verification */
 {
@@ -3445,8 +6485,7 @@ void purge_server(void)
     }
 
     /* purge collected inboxes */
-    xs *ib_dir = xs_fmt("%s/inbox", srv_basedir);
-    _purge_dir(ib_dir, 7);
+    int ib_gc = inbox_purge(7);
 
     /* purge the instance timeline */
     xs *itl_fn = xs_fmt("%s/public.idx", srv_basedir);
@@ -3481,7 +6520,7 @@ void purge_server(void)
     }
 
     srv_debug(1, xs_fmt("purge: global "
-            "(obj: %d, idx: %d, itl: %d, tag: %d)", cnt, icnt, itl_gc, tag_gc));
+            "(obj: %d, idx: %d, itl: %d, tag: %d, inbox: %d)", cnt, icnt, itl_gc, tag_gc, ib_gc));
 }
 
 
@@ -3492,8 +6531,8 @@ void purge_user(snac *snac)
     const char *v;
     int n;
 
-    priv_days = xs_number_get(xs_dict_get(srv_config, "timeline_purge_days"));
-    pub_days  = xs_number_get(xs_dict_get(srv_config, "local_purge_days"));
+    priv_days = srv_conf->timeline_purge_days;
+    pub_days  = srv_conf->local_purge_days;
 
     if ((v = xs_dict_get(snac->config_o, "purge_days")) != NULL ||
         (v = xs_dict_get(snac->config, "purge_days")) != NULL)
@@ -3510,15 +6549,25 @@ void purge_user(snac *snac)
 
     _purge_user_subdir(snac, "hidden",  priv_days);
     _purge_user_subdir(snac, "private", priv_days);
+    _purge_user_subdir(snac, "home",    priv_days);
 
     _purge_user_subdir(snac, "public",  pub_days);
 
     const char *idxs[] = { "followers.idx", "private.idx", "public.idx",
-                           "pinned.idx", "bookmark.idx", "draft.idx", NULL };
+                           "pinned.idx", "bookmark.idx", "draft.idx", "home.idx", NULL };
 
     for (n = 0; idxs[n]; n++) {
         xs *idx = xs_fmt("%s/%s", snac->basedir, idxs[n]);
+        pthread_mutex_t *lock = strcmp(idxs[n], "home.idx") == 0 ? _home_lock(snac) : NULL;
+
+        if (lock)
+            pthread_mutex_lock(lock);
+
         int gc = index_gc(idx);
+
+        if (lock)
+            pthread_mutex_unlock(lock);
+
         srv_debug(1, xs_fmt("purge: %s %d", idx, gc));
     }
 
@@ -3535,6 +6584,9 @@ void purge_user(snac *snac)
         }
     }
 
+    /* drop the cleared notifications */
+    notify_purge(snac);
+
     /* unrelated to purging, but it's a janitorial process, so what the hell */
     verify_links(snac);
 }
@@ -3561,6 +6613,8 @@ void purge_all(void)
 #ifndef NO_MASTODON_API
     mastoapi_purge();
 #endif
+
+    stats_recount();
 }
 
 
@@ -3723,8 +6777,12 @@ t_announcement *announcement(const double after)
         .timestamp = 0.0,
     };
     static xs_str *fn = NULL;
-    if (fn == NULL)
+    if (fn == NULL) {
+        /* this one lives forever */
+        int hold = xs_arena_hold(1);
         fn = xs_fmt("%s/announcement.txt", srv_basedir);
+        xs_arena_hold(hold);
+    }
 
     const double ts = mtime(fn);
 
@@ -686,7 +686,7 @@ static xs_html *html_user_body(snac *user, int read_only)
 {
     const char *proxy = NULL;
 
-    if (user && !read_only && xs_is_true(xs_dict_get(srv_config, "proxy_media")))
+    if (user && !read_only && srv_conf->proxy_media)
         proxy = user->actor;
 
     xs_html *body = xs_html_tag("body", NULL);
@@ -1008,7 +1008,7 @@ xs_html *html_top_controls(snac *snac)
 
     const char *email = "[disabled by admin]";
 
-    if (xs_type(xs_dict_get(srv_config, "disable_email_notifications")) != XSTYPE_TRUE) {
+    if (!srv_conf->disable_email_notifications) {
         email = xs_dict_get(snac->config_o, "email");
         if (xs_is_null(email)) {
             email = xs_dict_get(snac->config, "email");
@@ -1442,7 +1442,7 @@ xs_html *html_entry_controls(snac *snac, const char *actor,
                 L("Block any activity from this user forever")));
     }
 
-    if (!xs_is_true(xs_dict_get(srv_config, "hide_delete_post_button")))
+    if (!srv_conf->hide_delete_post_button)
         xs_html_add(form,
             html_button("delete", L("Delete"), L("Delete this post")));
 
@@ -1517,7 +1517,7 @@ xs_html *html_entry(snac *user, xs_dict *msg, int read_only,
     int collapse_threads = 0;
     const char *proxy = NULL;
 
-    if (user && !read_only && xs_is_true(xs_dict_get(srv_config, "proxy_media")))
+    if (user && !read_only && srv_conf->proxy_media)
         proxy = user->actor;
 
     /* do not show non-public messages in the public timeline */
@@ -2225,7 +2225,7 @@ xs_str *html_timeline(snac *user, const xs_list *list, int read_only,
     xs_list *p = (xs_list *)list;
     const char *v;
     double t = ftime();
-    int hide_children = xs_is_true(xs_dict_get(srv_config, "strict_public_timelines")) && read_only;
+    int hide_children = srv_conf->strict_public_timelines && read_only;
 
     xs *desc = NULL;
     xs *alternate = NULL;
@@ -2396,7 +2396,7 @@ xs_str *html_timeline(snac *user, const xs_list *list, int read_only,
 
     if (list && user && read_only) {
         /** history **/
-        if (xs_type(xs_dict_get(srv_config, "disable_history")) != XSTYPE_TRUE) {
+        if (!srv_conf->disable_history) {
             xs_html *ul = xs_html_tag("ul", NULL);
 
             xs_html *history = xs_html_tag("div",
@@ -2608,7 +2608,7 @@ xs_str *html_people(snac *user)
 {
     const char *proxy = NULL;
 
-    if (xs_is_true(xs_dict_get(srv_config, "proxy_media")))
+    if (srv_conf->proxy_media)
         proxy = user->actor;
 
     xs *wing = following_list(user);
@@ -2641,7 +2641,7 @@ xs_str *html_notifications(snac *user, int skip, int show)
 {
     const char *proxy = NULL;
 
-    if (xs_is_true(xs_dict_get(srv_config, "proxy_media")))
+    if (srv_conf->proxy_media)
         proxy = user->actor;
 
     xs *n_list = notify_list(user, skip, show);
@@ -2841,6 +2841,55 @@ xs_str *html_notifications(snac *user, int skip, int show)
 }
 
 
+int html_get_cached(const xs_dict *req, const char *q_path,
+                    char **body, int *b_size, xs_str **etag)
+/* serves a page only if it's already cached, even if stale (used when overloaded) */
+{
+    const xs_dict *q_vars = xs_dict_get(req, "q_vars");
+    const char *accept = xs_dict_get(req, "accept");
+    const char *k;
+    const xs_val *v;
+    int c = 0;
+    int status = 0;
+    snac snac;
+
+    if (srv_conf->disable_cache)
+        return 0;
+
+    /* the cached page is only right for the plain request
+       (not for skip, show, error... nor for the RSS) */
+    if (xs_type(q_vars) == XSTYPE_DICT && xs_dict_next(q_vars, &k, &v, &c))
+        return 0;
+
+    if (accept != NULL && (xs_str_in(accept, "text/xml") != -1 ||
+        xs_str_in(accept, "application/rss+xml") != -1))
+        return 0;
+
+    xs *l = xs_split(q_path, "/");
+
+    /* only the public timeline is cached */
+    if (xs_list_len(l) != 2)
+        return 0;
+
+    if (!user_open(&snac, xs_list_get(l, 1)))
+        return 0;
+
+    xs *h = xs_str_localtime(0, "%Y-%m.html");
+
+    if (xs_type(xs_dict_get(snac.config, "private")) != XSTYPE_TRUE &&
+        history_mtime(&snac, h) > 0.0) {
+        snac_debug(&snac, 1, xs_fmt("overloaded: serving cached local timeline"));
+
+        status = history_get(&snac, h, body, b_size,
+                    xs_dict_get(req, "if-none-match"), etag);
+    }
+
+    user_free(&snac);
+
+    return status;
+}
+
+
 int html_get_handler(const xs_dict *req, const char *q_path,
                      char **body, int *b_size, char **ctype,
                      xs_str **etag, xs_str **last_modified)
@@ -2879,7 +2928,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
         return HTTP_STATUS_NOT_FOUND;
     }
 
-    if (xs_is_true(xs_dict_get(srv_config, "proxy_media")))
+    if (srv_conf->proxy_media)
         proxy = 1;
 
     /* return the RSS if requested by Accept header */
@@ -2890,11 +2939,11 @@ int html_get_handler(const xs_dict *req, const char *q_path,
     }
 
     /* check if server config variable 'disable_cache' is set */
-    if ((v = xs_dict_get(srv_config, "disable_cache")) && xs_type(v) == XSTYPE_TRUE)
+    if (srv_conf->disable_cache)
         cache = 0;
 
     int skip = 0;
-    int def_show = xs_number_get(xs_dict_get(srv_config, "max_timeline_entries"));
+    int def_show = srv_conf->max_timeline_entries;
     int show = def_show;
 
     const xs_dict *q_vars = xs_dict_get(req, "q_vars");
@@ -2942,7 +2991,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
             xs *list = NULL;
             xs *next = NULL;
 
-            if (xs_is_true(xs_dict_get(srv_config, "strict_public_timelines"))) {
+            if (srv_conf->strict_public_timelines) {
                 list = timeline_simple_list(&snac, "public", skip, show);
                 next = timeline_simple_list(&snac, "public", skip + show, 1);
             }
@@ -3261,7 +3310,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
         if (xs_type(xs_dict_get(snac.config, "private")) == XSTYPE_TRUE)
             return HTTP_STATUS_FORBIDDEN;
 
-        if (xs_type(xs_dict_get(srv_config, "disable_history")) == XSTYPE_TRUE)
+        if (srv_conf->disable_history)
             return HTTP_STATUS_FORBIDDEN;
 
         xs *l = xs_split(p_path, "/");
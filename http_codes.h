@@ -35,6 +35,7 @@ HTTP_STATUS(409, CONFLICT, Conflict)
 HTTP_STATUS(410, GONE, Gone)
 HTTP_STATUS(421, MISDIRECTED_REQUEST, Misdirected Request)
 HTTP_STATUS(422, UNPROCESSABLE_CONTENT, Unprocessable Content)
+HTTP_STATUS(429, TOO_MANY_REQUESTS, Too Many Requests)
 HTTP_STATUS(499, CLIENT_CLOSED_REQUEST, Client Closed Request)
 HTTP_STATUS(500, INTERNAL_SERVER_ERROR, Internal Server Error)
 HTTP_STATUS(501, NOT_IMPLEMENTED, Not Implemented)
@@ -12,12 +12,12 @@
 #include "xs_openssl.h"
 #include "xs_fcgi.h"
 #include "xs_html.h"
+#include "xs_regex.h"
 
 #include "snac.h"
 
 #include <setjmp.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <fcntl.h>
 #include <stdint.h>
 
@@ -35,19 +35,56 @@ srv_state *p_state = NULL;
 
 /** job control **/
 
-/* mutex to access the lists of jobs */
-static pthread_mutex_t job_mutex;
-
-/* semaphore to trigger job processing */
-static sem_t *job_sem;
+/* Each job thread (worker) has its own queues of jobs, one per class
+   (see JOB_* in snac.h), under its own mutex. New jobs go to an idle
+   (parked) worker if there is one, or else to the next worker in turn.
+   Workers take jobs from their own queues from the front and, when
+   they run out of them, steal from the back of other workers' queues
+   before parking. Among classes, each worker picks the next job by
+   weighted fair sharing: each class advances its 'pass' by the inverse
+   of its weight each time one of its jobs is started, and the
+   non-empty class with the lowest pass goes next. Besides, no class
+   can take the threads reserved for the others, so a big fan-out of
+   deliveries can't starve the web UI. */
 
 typedef struct job_fifo_item {
     struct job_fifo_item *next;
+    struct job_fifo_item *prev;
     xs_val *job;
 } job_fifo_item;
 
-static job_fifo_item *job_fifo_first = NULL;
-static job_fifo_item *job_fifo_last  = NULL;
+typedef struct {
+    pthread_mutex_t mutex;  /* protects the queues */
+    pthread_cond_t cond;    /* to wake it up (used with job_mutex) */
+    int parked;             /* waiting in the parked list */
+    int kicked;             /* woken up to look for work */
+    int size;               /* queued jobs */
+    struct {
+        job_fifo_item *first;
+        job_fifo_item *last;
+        double pass;        /* virtual time of the class */
+    } q[JOB_CLASSES];
+} job_worker;
+
+static job_worker *job_workers = NULL;
+static int job_n_workers = 0;
+
+/* mutex for the parked list (only needed to park and unpark workers;
+   the queued and running counters are kept per worker and summed) */
+static pthread_mutex_t job_mutex;
+
+static int *job_parked = NULL;      /* stack of parked workers */
+static int job_n_parked = 0;
+static int job_next = 0;            /* next worker in turn */
+
+/* relative weights and minimum reserved share of job threads (%) */
+static const int job_class_weight[JOB_CLASSES]  = { 8, 4, 4, 1 };
+static const int job_class_reserve[JOB_CLASSES] = { 25, 10, 10, 0 };
+
+static int job_class_max[JOB_CLASSES];      /* threads each class can use */
+
+/* maximum size of the per-job memory arena (0: don't use it) */
+static size_t job_arena_size = 0;
 
 
 /** other global data **/
@@ -70,33 +107,9 @@ const char *nodeinfo_2_0_template = ""
 xs_str *nodeinfo_2_0(void)
 /* builds a nodeinfo json object */
 {
-    int n_utotal = 0;
-    int n_umonth = 0;
-    int n_uhyear = 0;
-    int n_posts  = 0;
-    xs *users = user_list();
-    xs_list *p = users;
-    const char *v;
-    double now = (double)time(NULL);
+    int n_utotal, n_umonth, n_uhyear, n_posts;
 
-    while (xs_list_iter(&p, &v)) {
-        /* build the full path name to the last usage log */
-        xs *llfn = xs_fmt("%s/user/%s/lastlog.txt", srv_basedir, v);
-        double llsecs = now - mtime(llfn);
-
-        if (llsecs < 60 * 60 * 24 * 30 * 6) {
-            n_uhyear++;
-
-            if (llsecs < 60 * 60 * 24 * 30)
-                n_umonth++;
-        }
-
-        n_utotal++;
-
-        /* build the file to each user public.idx */
-        xs *pidxfn = xs_fmt("%s/user/%s/public.idx", srv_basedir, v);
-        n_posts += index_len(pidxfn);
-    }
+    stats_get(&n_utotal, &n_umonth, &n_uhyear, &n_posts);
 
     return xs_fmt(nodeinfo_2_0_template, n_utotal, n_umonth, n_uhyear, n_posts);
 }
@@ -165,7 +178,7 @@ static xs_str *greeting_html(void)
 
 
 int server_get_handler(xs_dict *req, const char *q_path,
-                       char **body, int *b_size, char **ctype)
+                       char **body, int *b_size, char **ctype, xs_str **etag)
 /* basic server services */
 {
     int status = 0;
@@ -178,7 +191,7 @@ int server_get_handler(xs_dict *req, const char *q_path,
         if (xs_type(q_vars) == XSTYPE_DICT && (t = xs_dict_get(q_vars, "t"))) {
             /** search by tag **/
             int skip = 0;
-            int show = xs_number_get(xs_dict_get(srv_config, "max_timeline_entries"));
+            int show = srv_conf->max_timeline_entries;
             const char *v;
 
             if ((v = xs_dict_get(q_vars, "skip")) != NULL)
@@ -208,7 +221,7 @@ int server_get_handler(xs_dict *req, const char *q_path,
             }
         }
         else
-        if (xs_type(xs_dict_get(srv_config, "show_instance_timeline")) == XSTYPE_TRUE) {
+        if (srv_conf->show_instance_timeline) {
             /** instance timeline **/
             xs *tl = timeline_instance_list(0, 30);
             *body = html_timeline(NULL, tl, 0, 0, 0, 0,
@@ -246,9 +259,9 @@ int server_get_handler(xs_dict *req, const char *q_path,
     }
     else
     if (strcmp(q_path, "/nodeinfo_2_0") == 0) {
-        status = HTTP_STATUS_OK;
+        status = stats_response(STATS_RESP_NODEINFO, nodeinfo_2_0,
+                    xs_dict_get(req, "if-none-match"), body, etag);
         *ctype = "application/json; charset=utf-8";
-        *body  = nodeinfo_2_0();
     }
     else
     if (strcmp(q_path, "/robots.txt") == 0) {
@@ -265,6 +278,442 @@ int server_get_handler(xs_dict *req, const char *q_path,
 }
 
 
+/** request router **/
+
+/* Requests are dispatched by looking up their method and path in a
+   trie of path segments built at startup, instead of trying all the
+   handlers one after the other. Literal segments are preferred over
+   parameters (like :uid, that match any segment; the handlers take
+   them from the path themselves); a final * matches one or more
+   segments. */
+
+typedef struct {
+    xs_dict *req;
+    const char *q_path;
+    char *payload;
+    int p_size;
+    char **body;
+    int *b_size;
+    char **ctype;
+    xs_str **etag;
+    xs_str **last_modified;
+    xs_dict **headers;          /* additional response headers */
+    const char *peer;           /* remote address */
+} route_ctx;
+
+typedef int (*route_fn)(route_ctx *c);
+
+static pthread_mutex_t route_mutex;     /* for the stats */
+
+#define ROUTE_ANY    0          /* any Accept header */
+#define ROUTE_AP     1          /* asking for ActivityPub JSON */
+#define ROUTE_NOT_AP 2          /* asking for anything else */
+
+typedef struct {
+    const char *method;         /* GET also matches HEAD */
+    const char *pattern;
+    int accept;
+    route_fn fn[2];             /* tried in order until one answers */
+} route_def;
+
+/* admission control: when too many jobs of a class are waiting, new
+   requests that would add more work are turned away early (remote
+   servers retry later) instead of making everybody time out */
+
+static int rt_busy(route_ctx *c, int status, long *counter)
+/* rejects a request because the server is overloaded */
+{
+    xs *ra = xs_fmt("%d", srv_conf->shed_retry_after);
+
+    *c->headers = xs_dict_set(*c->headers, "retry-after", ra);
+    *c->body    = xs_str_new("server busy, retry later");
+    *c->ctype   = "text/plain";
+
+    pthread_mutex_lock(&route_mutex);
+    (*counter)++;
+    pthread_mutex_unlock(&route_mutex);
+
+    return status;
+}
+
+static int rt_overloaded(int max, int c)
+/* returns true if there are too many queued jobs of class c */
+{
+    return max > 0 && job_queued(c) >= max;
+}
+
+static int rt_server_get(route_ctx *c)
+{
+    return server_get_handler(c->req, c->q_path, c->body, c->b_size, c->ctype, c->etag);
+}
+
+static int rt_webfinger_get(route_ctx *c)
+{
+    return webfinger_get_handler(c->req, c->q_path, c->body, c->b_size, c->ctype);
+}
+
+static int rt_activitypub_get(route_ctx *c)
+{
+    return activitypub_get_handler(c->req, c->q_path, c->body, c->b_size, c->ctype, c->etag);
+}
+
+static int rt_activitypub_post(route_ctx *c)
+{
+    const char *i_ctype = xs_dict_get(c->req, "content-type");
+
+    if (i_ctype && (xs_str_in(i_ctype, "application/activity+json") != -1 ||
+                    xs_str_in(i_ctype, "application/ld+json") != -1)) {
+        int retry_after = 0;
+
+        if (rt_overloaded(srv_conf->shed_inbox_queue, JOB_INPUT))
+            return rt_busy(c, HTTP_STATUS_SERVICE_UNAVAILABLE, &p_state->shed_inbox);
+
+        /* too many from the same host? */
+        if (!inbox_rate_check(c->req, c->peer, &retry_after)) {
+            xs *ra = xs_fmt("%d", retry_after);
+
+            *c->headers = xs_dict_set(*c->headers, "retry-after", ra);
+            *c->body    = xs_str_new("too many messages, retry later");
+            *c->ctype   = "text/plain";
+
+            return HTTP_STATUS_TOO_MANY_REQUESTS;
+        }
+    }
+
+    return activitypub_post_handler(c->req, c->q_path, c->payload, c->p_size,
+                                    c->body, c->b_size, c->ctype);
+}
+
+static int rt_html_get(route_ctx *c)
+{
+    /* anonymous visitors only get what's already built */
+    if (xs_dict_get(c->req, "authorization") == NULL &&
+        rt_overloaded(srv_conf->shed_html_queue, JOB_HTTP)) {
+        int status = html_get_cached(c->req, c->q_path, c->body, c->b_size, c->etag);
+
+        if (status == 0)
+            return rt_busy(c, HTTP_STATUS_SERVICE_UNAVAILABLE, &p_state->shed_html);
+
+        pthread_mutex_lock(&route_mutex);
+        p_state->shed_html_cached++;
+        pthread_mutex_unlock(&route_mutex);
+
+        return status;
+    }
+
+    return html_get_handler(c->req, c->q_path, c->body, c->b_size, c->ctype,
+                            c->etag, c->last_modified);
+}
+
+static int rt_html_post(route_ctx *c)
+{
+    return html_post_handler(c->req, c->q_path, c->payload, c->p_size,
+                             c->body, c->b_size, c->ctype);
+}
+
+#ifndef NO_MASTODON_API
+
+static int rt_oauth_get(route_ctx *c)
+{
+    return oauth_get_handler(c->req, c->q_path, c->body, c->b_size, c->ctype);
+}
+
+static int rt_oauth_post(route_ctx *c)
+{
+    return oauth_post_handler(c->req, c->q_path, c->payload, c->p_size,
+                              c->body, c->b_size, c->ctype);
+}
+
+static int rt_mastoapi_get(route_ctx *c)
+{
+    if (rt_overloaded(srv_conf->shed_api_queue, JOB_HTTP))
+        return rt_busy(c, HTTP_STATUS_TOO_MANY_REQUESTS, &p_state->shed_api);
+
+    return mastoapi_get_handler(c->req, c->q_path, c->body, c->b_size, c->ctype, c->etag);
+}
+
+static int rt_mastoapi_post(route_ctx *c)
+{
+    if (rt_overloaded(srv_conf->shed_api_queue, JOB_HTTP))
+        return rt_busy(c, HTTP_STATUS_TOO_MANY_REQUESTS, &p_state->shed_api);
+
+    return mastoapi_post_handler(c->req, c->q_path, c->payload, c->p_size,
+                                 c->body, c->b_size, c->ctype);
+}
+
+static int rt_mastoapi_put(route_ctx *c)
+{
+    if (rt_overloaded(srv_conf->shed_api_queue, JOB_HTTP))
+        return rt_busy(c, HTTP_STATUS_TOO_MANY_REQUESTS, &p_state->shed_api);
+
+    return mastoapi_put_handler(c->req, c->q_path, c->payload, c->p_size,
+                                c->body, c->b_size, c->ctype);
+}
+
+static int rt_mastoapi_patch(route_ctx *c)
+{
+    if (rt_overloaded(srv_conf->shed_api_queue, JOB_HTTP))
+        return rt_busy(c, HTTP_STATUS_TOO_MANY_REQUESTS, &p_state->shed_api);
+
+    return mastoapi_patch_handler(c->req, c->q_path, c->payload, c->p_size,
+                                  c->body, c->b_size, c->ctype);
+}
+
+static int rt_mastoapi_delete(route_ctx *c)
+{
+    if (rt_overloaded(srv_conf->shed_api_queue, JOB_HTTP))
+        return rt_busy(c, HTTP_STATUS_TOO_MANY_REQUESTS, &p_state->shed_api);
+
+    return mastoapi_delete_handler(c->req, c->q_path, c->payload, c->p_size,
+                                   c->body, c->b_size, c->ctype);
+}
+
+#endif /* NO_MASTODON_API */
+
+static const route_def routes[] = {
+    { "GET",    "",                         ROUTE_ANY,    { rt_server_get } },
+    { "GET",    "/susie.png",               ROUTE_ANY,    { rt_server_get } },
+    { "GET",    "/favicon.ico",             ROUTE_ANY,    { rt_server_get } },
+    { "GET",    "/robots.txt",              ROUTE_ANY,    { rt_server_get } },
+    { "GET",    "/nodeinfo_2_0",            ROUTE_ANY,    { rt_server_get } },
+    { "GET",    "/.well-known/nodeinfo",    ROUTE_ANY,    { rt_server_get } },
+    { "GET",    "/.well-known/host-meta",   ROUTE_ANY,    { rt_server_get } },
+    { "GET",    "/.well-known/webfinger",   ROUTE_ANY,    { rt_webfinger_get } },
+#ifndef NO_MASTODON_API
+    { "GET",    "/oauth/*",                 ROUTE_ANY,    { rt_oauth_get } },
+    { "GET",    "/api/v1/*",                ROUTE_ANY,    { rt_mastoapi_get } },
+    { "GET",    "/api/v2/*",                ROUTE_ANY,    { rt_mastoapi_get } },
+#endif
+    { "GET",    "/:uid",                    ROUTE_AP,     { rt_activitypub_get, rt_html_get } },
+    { "GET",    "/:uid/*",                  ROUTE_AP,     { rt_activitypub_get, rt_html_get } },
+    { "GET",    "/:uid",                    ROUTE_NOT_AP, { rt_html_get } },
+    { "GET",    "/:uid/*",                  ROUTE_NOT_AP, { rt_html_get } },
+#ifndef NO_MASTODON_API
+    { "POST",   "/oauth/*",                 ROUTE_ANY,    { rt_oauth_post } },
+    { "POST",   "/api/v1/*",                ROUTE_ANY,    { rt_mastoapi_post } },
+    { "POST",   "/api/v2/*",                ROUTE_ANY,    { rt_mastoapi_post } },
+    { "PUT",    "/api/v1/*",                ROUTE_ANY,    { rt_mastoapi_put } },
+    { "PUT",    "/api/v2/*",                ROUTE_ANY,    { rt_mastoapi_put } },
+    { "PATCH",  "/api/v1/*",                ROUTE_ANY,    { rt_mastoapi_patch } },
+    { "DELETE", "/api/v1/*",                ROUTE_ANY,    { rt_mastoapi_delete } },
+    { "DELETE", "/api/v2/*",                ROUTE_ANY,    { rt_mastoapi_delete } },
+#endif
+    { "POST",   "/:uid",                    ROUTE_ANY,    { rt_activitypub_post, rt_html_post } },
+    { "POST",   "/:uid/*",                  ROUTE_ANY,    { rt_activitypub_post, rt_html_post } },
+};
+
+#define N_ROUTES (int)(sizeof(routes) / sizeof(routes[0]))
+
+/* the trie keeps the routes as bits in an unsigned int, and
+   the stats in srv_state have room for MAX_ROUTES */
+_Static_assert(N_ROUTES <= MAX_ROUTES && MAX_ROUTES <= 32, "too many routes");
+
+#define ROUTE_MAX_SEGS 16
+
+typedef struct {
+    char *seg;                  /* literal segment, or NULL for a parameter */
+    int child;                  /* first child */
+    int next;                   /* next sibling */
+    int param_child;            /* child for any segment */
+    unsigned int end;           /* bitmap of routes ending here */
+    unsigned int star;          /* bitmap of routes ending here with * */
+} route_node;
+
+static route_node *route_nodes = NULL;
+static int route_n_nodes = 0;
+
+
+static int _route_segs(const char *path, const char *segs[], int lens[])
+/* splits a path into segments (without copying) */
+{
+    int n = 0;
+
+    while (*path == '/' && n < ROUTE_MAX_SEGS) {
+        const char *s = ++path;
+
+        while (*path && *path != '/')
+            path++;
+
+        segs[n] = s;
+        lens[n] = path - s;
+        n++;
+    }
+
+    return n;
+}
+
+
+static int _route_new_node(void)
+/* creates an empty trie node */
+{
+    route_nodes = xs_realloc(route_nodes, (route_n_nodes + 1) * sizeof(route_node));
+    memset(&route_nodes[route_n_nodes], '\0', sizeof(route_node));
+
+    route_nodes[route_n_nodes].child       = -1;
+    route_nodes[route_n_nodes].next        = -1;
+    route_nodes[route_n_nodes].param_child = -1;
+
+    return route_n_nodes++;
+}
+
+
+static void _route_add(int r)
+/* adds a route to the trie */
+{
+    const char *segs[ROUTE_MAX_SEGS];
+    int lens[ROUTE_MAX_SEGS];
+    int n = _route_segs(routes[r].pattern, segs, lens);
+    int node = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (lens[i] == 1 && *segs[i] == '*') {
+            route_nodes[node].star |= 1U << r;
+            return;
+        }
+
+        if (*segs[i] == ':') {
+            if (route_nodes[node].param_child == -1) {
+                int c = _route_new_node();
+                route_nodes[node].param_child = c;
+            }
+
+            node = route_nodes[node].param_child;
+        }
+        else {
+            int c;
+
+            for (c = route_nodes[node].child; c != -1; c = route_nodes[c].next) {
+                if ((int)strlen(route_nodes[c].seg) == lens[i] &&
+                    memcmp(route_nodes[c].seg, segs[i], lens[i]) == 0)
+                    break;
+            }
+
+            if (c == -1) {
+                c = _route_new_node();
+                route_nodes[c].seg  = xs_fmt("%.*s", lens[i], segs[i]);
+                route_nodes[c].next = route_nodes[node].child;
+                route_nodes[node].child = c;
+            }
+
+            node = c;
+        }
+    }
+
+    route_nodes[node].end |= 1U << r;
+}
+
+
+void httpd_routes_init(void)
+/* builds the route trie */
+{
+    int r;
+
+    pthread_mutex_init(&route_mutex, NULL);
+
+    _route_new_node();
+
+    for (r = 0; r < N_ROUTES; r++) {
+        _route_add(r);
+
+        if (p_state != NULL) {
+            snprintf(p_state->routes[r].name, sizeof(p_state->routes[r].name), "%s %s%s",
+                routes[r].method, *routes[r].pattern ? routes[r].pattern : "/",
+                routes[r].accept == ROUTE_AP ? " [ap]" :
+                routes[r].accept == ROUTE_NOT_AP ? " [html]" : "");
+
+            srv_debug(2, xs_fmt("route #%d: %s", r, p_state->routes[r].name));
+        }
+    }
+
+    if (p_state != NULL)
+        p_state->n_routes = N_ROUTES;
+}
+
+
+static int _route_pick(unsigned int set, const char *method, int ap)
+/* returns the first route in set valid for method and accept class, or -1 */
+{
+    int r;
+
+    if (strcmp(method, "HEAD") == 0)
+        method = "GET";
+
+    for (r = 0; set; r++, set >>= 1) {
+        if ((set & 1) && strcmp(routes[r].method, method) == 0 &&
+            (routes[r].accept == ROUTE_ANY || routes[r].accept == (ap ? ROUTE_AP : ROUTE_NOT_AP)))
+            return r;
+    }
+
+    return -1;
+}
+
+
+static int _route_match(int node, const char *segs[], int lens[], int i, int n,
+                        const char *method, int ap)
+/* finds the route for the segments from i on (depth-first, literals first) */
+{
+    const route_node *rn = &route_nodes[node];
+    int r, c;
+
+    if (i == n)
+        return _route_pick(rn->end, method, ap);
+
+    for (c = rn->child; c != -1; c = route_nodes[c].next) {
+        if ((int)strlen(route_nodes[c].seg) == lens[i] &&
+            memcmp(route_nodes[c].seg, segs[i], lens[i]) == 0) {
+            if ((r = _route_match(c, segs, lens, i + 1, n, method, ap)) != -1)
+                return r;
+
+            break;
+        }
+    }
+
+    if (rn->param_child != -1 && lens[i] > 0) {
+        if ((r = _route_match(rn->param_child, segs, lens, i + 1, n, method, ap)) != -1)
+            return r;
+    }
+
+    return _route_pick(rn->star, method, ap);
+}
+
+
+static int httpd_route(route_ctx *c, const char *method)
+/* dispatches a request; returns -1 if no route matches */
+{
+    const char *segs[ROUTE_MAX_SEGS];
+    int lens[ROUTE_MAX_SEGS];
+    int n, r, i;
+    int status = 0;
+
+    if (route_nodes == NULL || (*c->q_path && *c->q_path != '/'))
+        return -1;
+
+    const char *accept = xs_dict_get(c->req, "accept");
+    int ap = accept != NULL && (xs_str_in(accept, "application/activity+json") != -1 ||
+                                xs_str_in(accept, "application/ld+json") != -1);
+
+    n = _route_segs(c->q_path, segs, lens);
+
+    if ((r = _route_match(0, segs, lens, 0, n, method, ap)) == -1)
+        return -1;
+
+    double t = ftime();
+
+    for (i = 0; i < 2 && status == 0 && routes[r].fn[i] != NULL; i++)
+        status = routes[r].fn[i](c);
+
+    t = ftime() - t;
+
+    pthread_mutex_lock(&route_mutex);
+    p_state->routes[r].hits++;
+    p_state->routes[r].secs += t;
+    pthread_mutex_unlock(&route_mutex);
+
+    return status;
+}
+
+
 void httpd_connection(FILE *f)
 /* the connection processor */
 {
@@ -282,6 +731,7 @@ void httpd_connection(FILE *f)
     int p_size   = 0;
     const char *p;
     int fcgi_id;
+    int routed   = 0;
 
     if (p_state->use_fcgi)
         req = xs_fcgi_request(f, &payload, &p_size, &fcgi_id);
@@ -310,23 +760,51 @@ void httpd_connection(FILE *f)
     if (xs_startswith(q_path, p))
         q_path = xs_crop_i(q_path, strlen(p), 0);
 
+    /* find the route */
+    {
+        char peer[64] = "";
+
+        if (p_state->use_fcgi) {
+            const char *v = xs_dict_get(xs_dict_get(req, "cgi_vars"), "REMOTE_ADDR");
+
+            if (v != NULL)
+                snprintf(peer, sizeof(peer), "%s", v);
+        }
+        else
+            _xs_socket_peername(fileno(f), peer, sizeof(peer));
+
+        route_ctx c = { req, q_path, payload, p_size, &body, &b_size,
+                        &ctype, &etag, &last_modified, &headers, peer };
+
+        status = httpd_route(&c, method);
+
+        if (status == -1)
+            status = 0;
+        else
+            routed = 1;
+    }
+
+    if (routed) {
+        /* already served by the router */
+    }
+    else
     if (strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0) {
         /* cascade through */
         if (status == 0)
-            status = server_get_handler(req, q_path, &body, &b_size, &ctype);
+            status = server_get_handler(req, q_path, &body, &b_size, &ctype, &etag);
 
         if (status == 0)
             status = webfinger_get_handler(req, q_path, &body, &b_size, &ctype);
 
         if (status == 0)
-            status = activitypub_get_handler(req, q_path, &body, &b_size, &ctype);
+            status = activitypub_get_handler(req, q_path, &body, &b_size, &ctype, &etag);
 
 #ifndef NO_MASTODON_API
         if (status == 0)
             status = oauth_get_handler(req, q_path, &body, &b_size, &ctype);
 
         if (status == 0)
-            status = mastoapi_get_handler(req, q_path, &body, &b_size, &ctype);
+            status = mastoapi_get_handler(req, q_path, &body, &b_size, &ctype, &etag);
 #endif /* NO_MASTODON_API */
 
         if (status == 0)
@@ -469,74 +947,423 @@ void httpd_connection(FILE *f)
 }
 
 
+static int job_class_of(const xs_val *job)
+/* returns the class of a job */
+{
+    if (xs_type(job) == XSTYPE_DICT) {
+        const char *type = xs_dict_get(job, "type");
+
+        if (xs_type(type) == XSTYPE_STRING) {
+            if (strcmp(type, "input") == 0)
+                return JOB_INPUT;
+
+            if (strcmp(type, "output") == 0)
+                return JOB_OUTPUT;
+        }
+
+        return JOB_MAINT;
+    }
+
+    /* connections */
+    return JOB_HTTP;
+}
+
+
+static void job_init(int n_workers)
+/* initializes the workers and computes the number of threads each class can use */
+{
+    int c, d, w;
+
+    pthread_mutex_init(&job_mutex, NULL);
+
+    /* worker #0 is unused (thread #0 is the background thread) */
+    job_n_workers = n_workers + 1;
+    job_workers   = xs_realloc(NULL, job_n_workers * sizeof(job_worker));
+    job_parked    = xs_realloc(NULL, job_n_workers * sizeof(int));
+
+    memset(job_workers, '\0', job_n_workers * sizeof(job_worker));
+
+    for (w = 0; w < job_n_workers; w++) {
+        pthread_mutex_init(&job_workers[w].mutex, NULL);
+        pthread_cond_init(&job_workers[w].cond, NULL);
+    }
+
+    job_next = 1;
+
+    for (c = 0; c < JOB_CLASSES; c++) {
+        job_class_max[c] = n_workers;
+
+        for (d = 0; d < JOB_CLASSES; d++) {
+            if (d != c) {
+                int r = n_workers * job_class_reserve[d] / 100;
+
+                /* the web always gets at least one */
+                if (r == 0 && d == JOB_HTTP && n_workers > 1)
+                    r = 1;
+
+                job_class_max[c] -= r;
+            }
+        }
+
+        if (job_class_max[c] < 1)
+            job_class_max[c] = 1;
+    }
+}
+
+
+static void job_free(void)
+/* frees the workers */
+{
+    int w;
+
+    for (w = 0; w < job_n_workers; w++) {
+        pthread_mutex_destroy(&job_workers[w].mutex);
+        pthread_cond_destroy(&job_workers[w].cond);
+    }
+
+    xs_free(job_workers);
+    xs_free(job_parked);
+
+    pthread_mutex_destroy(&job_mutex);
+}
+
+
+int job_queued(int c)
+/* returns the number of queued jobs of class c (or of all, if -1) */
+{
+    int w, n = 0;
+
+    for (w = 1; w < job_n_workers; w++) {
+        if (c == -1) {
+            int d;
+
+            for (d = 0; d < JOB_CLASSES; d++)
+                n += p_state->th_queued[w][d];
+        }
+        else
+            n += p_state->th_queued[w][c];
+    }
+
+    return n;
+}
+
+
+int job_running(int c)
+/* returns the number of workers running jobs of class c */
+{
+    int w, n = 0;
+
+    for (w = 1; w < job_n_workers; w++) {
+        if (p_state->th_class[w] == c + 1)
+            n++;
+    }
+
+    return n;
+}
+
+
+static void job_kick(int w)
+/* wakes up a parked worker (job_mutex must be locked) */
+{
+    int n;
+
+    for (n = 0; n < job_n_parked; n++) {
+        if (job_parked[n] == w) {
+            job_parked[n] = job_parked[--job_n_parked];
+            break;
+        }
+    }
+
+    job_workers[w].parked = 0;
+    job_workers[w].kicked = 1;
+    pthread_cond_signal(&job_workers[w].cond);
+}
+
+
 void job_post(const xs_val *job, int urgent)
 /* posts a job for the threads to process it */
 {
     if (job != NULL) {
-        /* lock the mutex */
-        pthread_mutex_lock(&job_mutex);
+        int c = job_class_of(job);
+        int w;
+
+        /* the job will outlive the poster's arena */
+        int hold = xs_arena_hold(1);
 
         job_fifo_item *i = xs_realloc(NULL, sizeof(job_fifo_item));
-        *i = (job_fifo_item){ NULL, xs_dup(job) };
+        *i = (job_fifo_item){ NULL, NULL, xs_dup(job) };
+
+        xs_arena_hold(hold);
+
+        /* pick a worker: a parked one, or the next in turn; this is
+           done without locking, as any worker is good enough (the
+           parked one will be kicked below, and the others will take
+           it or have it stolen soon) */
+        int n_parked = job_n_parked;
 
-        if (job_fifo_first == NULL)
-            job_fifo_first = job_fifo_last = i;
+        if (n_parked > 0 && n_parked < job_n_workers)
+            w = job_parked[n_parked - 1];
+        else {
+            w = job_next;
+
+            if (w + 1 >= job_n_workers)
+                job_next = 1;
+            else
+                job_next = w + 1;
+        }
+
+        if (w < 1 || w >= job_n_workers)
+            w = 1;
+
+        job_worker *wk = &job_workers[w];
+
+        pthread_mutex_lock(&wk->mutex);
+
+        if (wk->q[c].first == NULL) {
+            double min = -1.0;
+            int d;
+
+            wk->q[c].first = wk->q[c].last = i;
+
+            /* a class waking up doesn't get credit for its idle time */
+            for (d = 0; d < JOB_CLASSES; d++) {
+                if (d != c && wk->q[d].first != NULL && (min < 0 || wk->q[d].pass < min))
+                    min = wk->q[d].pass;
+            }
+
+            if (min > wk->q[c].pass)
+                wk->q[c].pass = min;
+        }
         else
         if (urgent) {
             /* prepend */
-            i->next = job_fifo_first;
-            job_fifo_first = i;
+            i->next = wk->q[c].first;
+            wk->q[c].first->prev = i;
+            wk->q[c].first = i;
         }
         else {
             /* append */
-            job_fifo_last->next = i;
-            job_fifo_last = i;
+            i->prev = wk->q[c].last;
+            wk->q[c].last->next = i;
+            wk->q[c].last = i;
         }
 
-        p_state->job_fifo_size++;
+        wk->size++;
+        p_state->th_queue[w] = wk->size;
+        p_state->th_queued[w][c]++;
 
-        if (p_state->job_fifo_size > p_state->peak_job_fifo_size)
-            p_state->peak_job_fifo_size = p_state->job_fifo_size;
+        /* a worker parks before checking its own queue (under this
+           mutex), so if it missed this job, it's seen parked here */
+        int parked = wk->parked;
 
-        /* unlock the mutex */
-        pthread_mutex_unlock(&job_mutex);
+        pthread_mutex_unlock(&wk->mutex);
+
+        /* ask it to attend it, if it's parked */
+        if (parked) {
+            pthread_mutex_lock(&job_mutex);
+
+            if (wk->parked)
+                job_kick(w);
+
+            pthread_mutex_unlock(&job_mutex);
+        }
+    }
+}
+
+
+static xs_val *job_take(int v, int w, int *cls)
+/* takes a job from worker v's queues, for worker w (v's mutex must be locked) */
+{
+    job_worker *vk = &job_workers[v];
+    job_worker *wk = &job_workers[w];
+    job_fifo_item *i = NULL;
+    int c = -1;
+    int d;
+
+    if (vk->size == 0)
+        return NULL;
+
+    /* pick the eligible class with the lowest pass (from w's point of view);
+       the running counts are read unlocked, so a class may go over its
+       share by a thread for a moment */
+    for (d = 0; d < JOB_CLASSES; d++) {
+        if (vk->q[d].first == NULL)
+            continue;
+
+        if (p_state->srv_running && job_running(d) >= job_class_max[d])
+            continue;
+
+        if (c == -1 || wk->q[d].pass < wk->q[c].pass)
+            c = d;
+    }
+
+    if (c == -1)
+        return NULL;
+
+    p_state->th_queued[v][c]--;
+    p_state->th_class[w] = c + 1;
+
+    if (v == w) {
+        /* own jobs are taken from the front */
+        i = vk->q[c].first;
+        vk->q[c].first = i->next;
+
+        if (vk->q[c].first != NULL)
+            vk->q[c].first->prev = NULL;
+        else
+            vk->q[c].last = NULL;
+    }
+    else {
+        /* stolen jobs, from the back */
+        i = vk->q[c].last;
+        vk->q[c].last = i->prev;
+
+        if (vk->q[c].last != NULL)
+            vk->q[c].last->next = NULL;
+        else
+            vk->q[c].first = NULL;
+    }
+
+    vk->size--;
+    p_state->th_queue[v] = vk->size;
+
+    wk->q[c].pass += 1.0 / job_class_weight[c];
 
-        /* ask for someone to attend it */
-        sem_post(job_sem);
+    xs_val *job = i->job;
+    xs_free(i);
+
+    *cls = c;
+
+    return job;
+}
+
+
+static xs_val *job_steal(int w, int *cls)
+/* tries to steal a job from other workers */
+{
+    int n;
+
+    for (n = 1; n < job_n_workers; n++) {
+        int v = (w + n) % job_n_workers;
+        xs_val *job = NULL;
+
+        if (v == 0 || job_workers[v].size == 0)
+            continue;
+
+        /* don't wait for busy workers */
+        if (pthread_mutex_trylock(&job_workers[v].mutex) != 0)
+            continue;
+
+        job = job_take(v, w, cls);
+
+        pthread_mutex_unlock(&job_workers[v].mutex);
+
+        if (job != NULL) {
+            p_state->th_steals[w]++;
+            return job;
+        }
     }
+
+    return NULL;
 }
 
 
-void job_wait(xs_val **job)
-/* waits for an available job */
+int job_wait(int w, xs_val **job)
+/* waits for an available job for worker w; returns its class, or -1 if the server is stopping */
 {
+    job_worker *wk = &job_workers[w];
+    int c = -1;
+
     *job = NULL;
 
-    if (sem_wait(job_sem) == 0) {
-        /* lock the mutex */
+    for (;;) {
+        /* own jobs first */
+        pthread_mutex_lock(&wk->mutex);
+        *job = job_take(w, w, &c);
+        pthread_mutex_unlock(&wk->mutex);
+
+        if (*job != NULL)
+            return c;
+
+        /* then other's */
+        if ((*job = job_steal(w, &c)) != NULL)
+            return c;
+
+        /* park */
         pthread_mutex_lock(&job_mutex);
 
-        /* dequeue */
-        job_fifo_item *i = job_fifo_first;
+        if (!p_state->srv_running) {
+            pthread_mutex_unlock(&job_mutex);
+            return -1;
+        }
+
+        wk->parked = 1;
+        wk->kicked = 0;
+        job_parked[job_n_parked++] = w;
 
-        if (i != NULL) {
-            job_fifo_first = i->next;
+        pthread_mutex_unlock(&job_mutex);
+
+        /* anything posted meanwhile? a job_post() that picked us
+           before we were parked may have queued it just now; if it
+           queues it after this check, it will see us parked and kick */
+        pthread_mutex_lock(&wk->mutex);
+        *job = job_take(w, w, &c);
+        pthread_mutex_unlock(&wk->mutex);
 
-            if (job_fifo_first == NULL)
-                job_fifo_last = NULL;
+        if (*job == NULL)
+            *job = job_steal(w, &c);
 
-            *job = i->job;
-            xs_free(i);
+        pthread_mutex_lock(&job_mutex);
 
-            p_state->job_fifo_size--;
+        if (*job != NULL) {
+            if (wk->parked)
+                job_kick(w);
+        }
+        else {
+            while (!wk->kicked)
+                pthread_cond_wait(&wk->cond, &job_mutex);
         }
 
-        /* unlock the mutex */
         pthread_mutex_unlock(&job_mutex);
+
+        if (*job != NULL)
+            return c;
     }
 }
 
 
+void job_done(int w, int c)
+/* marks a job of class c run by worker w as finished */
+{
+    (void)c;
+
+    p_state->th_class[w] = 0;
+
+    /* jobs may be waiting for a thread of their class (if no
+       worker is seen parked, they are busy and will look for them) */
+    if (job_n_parked && job_queued(-1) > 0) {
+        pthread_mutex_lock(&job_mutex);
+
+        if (job_n_parked)
+            job_kick(job_parked[job_n_parked - 1]);
+
+        pthread_mutex_unlock(&job_mutex);
+    }
+}
+
+
+static void job_stop(void)
+/* wakes up all workers, so that they exit after finishing their jobs */
+{
+    pthread_mutex_lock(&job_mutex);
+
+    while (job_n_parked)
+        job_kick(job_parked[job_n_parked - 1]);
+
+    pthread_mutex_unlock(&job_mutex);
+}
+
+
 static void *job_thread(void *arg)
 /* job thread */
 {
@@ -546,17 +1373,20 @@ static void *job_thread(void *arg)
 
     for (;;) {
         xs *job = NULL;
+        int c;
 
         p_state->th_state[pid] = THST_WAIT;
 
-        job_wait(&job);
+        c = job_wait(pid, &job);
+
+        if (c == -1) /* the server is stopping */
+            break;
 
-        if (job == NULL) /* corrupted message? */
+        if (job == NULL) { /* corrupted message? */
+            job_done(pid, c);
             continue;
+        }
 
-        if (xs_type(job) == XSTYPE_FALSE) /* special message: exit */
-            break;
-        else
         if (xs_type(job) == XSTYPE_DATA) {
             /* it's a socket */
             FILE *f = NULL;
@@ -565,15 +1395,28 @@ static void *job_thread(void *arg)
 
             xs_data_get(&f, job);
 
-            if (f != NULL)
+            if (f != NULL) {
+                if (job_arena_size)
+                    xs_arena_start(job_arena_size);
+
                 httpd_connection(f);
+
+                xs_arena_stop();
+            }
         }
         else {
             /* it's a q_item */
             p_state->th_state[pid] = THST_QUEUE;
 
+            if (job_arena_size)
+                xs_arena_start(job_arena_size);
+
             process_queue_item(job);
+
+            xs_arena_stop();
         }
+
+        job_done(pid, c);
     }
 
     p_state->th_state[pid] = THST_STOP;
@@ -587,6 +1430,17 @@ static void *job_thread(void *arg)
 static pthread_mutex_t sleep_mutex;
 static pthread_cond_t  sleep_cond;
 
+static volatile sig_atomic_t reload_pending = 0;
+
+void hup_handler(int s)
+/* asks the background thread to reload the server settings */
+{
+    (void)s;
+
+    reload_pending = 1;
+}
+
+
 static void *background_thread(void *arg)
 /* background thread (queue management and other things) */
 {
@@ -625,6 +1479,30 @@ static void *background_thread(void *arg)
         /* global queue */
         cnt += process_queue();
 
+        /* the peak of queued jobs is sampled from here */
+        {
+            int q = job_queued(-1);
+
+            if (q > p_state->peak_job_fifo_size)
+                p_state->peak_job_fifo_size = q;
+        }
+
+        /* reload the server settings if asked to (SIGHUP) */
+        if (reload_pending) {
+            reload_pending = 0;
+            srv_reload();
+        }
+
+        /* save the instance statistics, inboxes and filter hits from time to time */
+        stats_checkpoint(0);
+        inbox_checkpoint(0);
+        content_filter_checkpoint(0);
+        fetch_fail_checkpoint(0);
+
+#ifndef NO_MASTODON_API
+        token_flush(0);
+#endif
+
         /* time to purge? */
         if ((t = time(NULL)) > purge_time) {
             /* next purge time is tomorrow */
@@ -771,9 +1649,7 @@ void httpd(void)
     int rs;
     pthread_t threads[MAX_THREADS] = {0};
     int n;
-    xs *sem_name = NULL;
     xs *shm_name = NULL;
-    sem_t anon_job_sem;
     xs *pidfile = xs_fmt("%s/server.pid", srv_basedir);
 
     address = xs_dict_get(srv_config, "address");
@@ -799,6 +1675,8 @@ void httpd(void)
 
     p_state->srv_start_time = time(NULL);
 
+    httpd_routes_init();
+
     p_state->use_fcgi = xs_type(xs_dict_get(srv_config, "fastcgi")) == XSTYPE_TRUE;
 
     p_state->srv_running = 1;
@@ -806,6 +1684,7 @@ void httpd(void)
     signal(SIGPIPE, SIG_IGN);
     signal(SIGTERM, term_handler);
     signal(SIGINT,  term_handler);
+    signal(SIGHUP,  hup_handler);
 
     srv_log(xs_fmt("httpd%s start %s %s", p_state->use_fcgi ? " (FastCGI)" : "",
                     full_address, USER_AGENT));
@@ -827,22 +1706,6 @@ void httpd(void)
     srv_debug(1, xs_fmt("available (rlimit) fds: %d (cur) / %d (max)",
                         (int) r.rlim_cur, (int) r.rlim_max));
 
-    /* initialize the job control engine */
-    pthread_mutex_init(&job_mutex, NULL);
-    sem_name = xs_fmt("/job_%d", getpid());
-    job_sem = sem_open(sem_name, O_CREAT, 0644, 0);
-
-    if (job_sem == NULL) {
-        /* error opening a named semaphore; try with an anonymous one */
-        if (sem_init(&anon_job_sem, 0, 0) != -1)
-            job_sem = &anon_job_sem;
-    }
-
-    if (job_sem == NULL) {
-        srv_log(xs_fmt("fatal error: cannot create semaphore -- cannot continue"));
-        return;
-    }
-
     /* initialize sleep control */
     pthread_mutex_init(&sleep_mutex, NULL);
     pthread_cond_init(&sleep_cond, NULL);
@@ -862,8 +1725,21 @@ void httpd(void)
     if (p_state->n_threads > MAX_THREADS)
         p_state->n_threads = MAX_THREADS;
 
+    /* per-job memory arenas */
+    if (xs_is_true(xs_dict_get(srv_config, "job_arena"))) {
+        int mb = xs_number_get(xs_dict_get(srv_config, "job_arena_max_mb"));
+
+        job_arena_size = (size_t)(mb > 0 ? mb : 16) * 1024 * 1024;
+
+        srv_debug(0, xs_fmt("using per-job memory arenas (%d MB max)",
+            (int)(job_arena_size / (1024 * 1024))));
+    }
+
     srv_debug(0, xs_fmt("using %d threads", p_state->n_threads));
 
+    /* initialize the job control engine */
+    job_init(p_state->n_threads - 1);
+
     /* thread #0 is the background thread */
     pthread_create(&threads[0], NULL, background_thread, NULL);
 
@@ -888,21 +1764,36 @@ void httpd(void)
 
     p_state->srv_running = 0;
 
-    /* send as many exit jobs as working threads */
-    for (n = 1; n < p_state->n_threads; n++)
-        job_post(xs_stock(XSTYPE_FALSE), 0);
+    /* wake up the idle threads, so that they see it */
+    job_stop();
 
     /* wait for all the threads to exit */
     for (n = 0; n < p_state->n_threads; n++)
         pthread_join(threads[n], NULL);
 
-    sem_close(job_sem);
-    sem_unlink(sem_name);
+    stats_checkpoint(1);
+    inbox_checkpoint(1);
+    content_filter_checkpoint(1);
+    fetch_fail_checkpoint(1);
+
+#ifndef NO_MASTODON_API
+    token_flush(1);
+#endif
+
+    job_free();
 
     srv_state_op(&shm_name, 2);
 
     xs *uptime = xs_str_time_diff(time(NULL) - p_state->srv_start_time);
 
+    {
+        long hits, misses;
+        int size;
+
+        xs_regex_cache_stats(&hits, &misses, &size);
+        srv_debug(1, xs_fmt("regex cache: %ld hits, %ld misses, %d entries", hits, misses, size));
+    }
+
     srv_log(xs_fmt("httpd%s stop %s (run time: %s)",
                 p_state->use_fcgi ? " (FastCGI)" : "",
                 full_address, uptime));
@@ -10,6 +10,7 @@
 #include "snac.h"
 
 #include <sys/stat.h>
+#include <signal.h>
 
 int usage(void)
 {
@@ -20,6 +21,7 @@ int usage(void)
     printf("\n");
     printf("init [{basedir}]                     Initializes the data storage\n");
     printf("upgrade {basedir}                    Upgrade to a new version\n");
+    printf("reload {basedir}                     Reloads the server settings of a running server\n");
     printf("adduser {basedir} [{uid}]            Adds a new user\n");
     printf("deluser {basedir} {uid}              Deletes a user\n");
     printf("httpd {basedir}                      Starts the HTTPD daemon\n");
@@ -44,6 +46,9 @@ int usage(void)
     printf("unbookmark {basedir} {uid} {msg_url} Unbookmarks a message\n");
     printf("block {basedir} {instance_url}       Blocks a full instance\n");
     printf("unblock {basedir} {instance_url}     Unblocks a full instance\n");
+    printf("import_instance_blocks {basedir} {file} Blocks the instances in a file\n");
+    printf("fetch_failures {basedir}             Lists the remote fetches that failed recently\n");
+    printf("fetch_failures_clear {basedir} [{url}] Forgets a failed fetch (or all of them)\n");
     printf("limit {basedir} {uid} {actor}        Limits an actor (drops their announces)\n");
     printf("unlimit {basedir} {uid} {actor}      Unlimits an actor\n");
     printf("verify_links {basedir} {uid}         Verifies a user's links (in the metadata)\n");
@@ -54,6 +59,7 @@ int usage(void)
     printf("import_csv {basedir} {uid}           Imports data from CSV files in the current directory\n");
     printf("import_list {basedir} {uid} {file}   Imports a Mastodon CSV list file\n");
     printf("import_block_list {basedir} {uid} {file} Imports a Mastodon CSV block list file\n");
+    printf("bench [{spec}] [{traffic.jsonl}]   Runs a load benchmark on a temporary instance\n");
 
     return 1;
 }
@@ -115,6 +121,13 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    if (strcmp(cmd, "bench") == 0) { /** **/
+        /* benchmark on a temporary instance (no basedir needed) */
+        const char *spec = GET_ARGV();
+
+        return bench(spec, GET_ARGV());
+    }
+
     if ((basedir = GET_ARGV()) == NULL)
         return usage();
 
@@ -142,6 +155,26 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    if (strcmp(cmd, "reload") == 0) { /** **/
+        xs *pidfile = xs_fmt("%s/server.pid", srv_basedir);
+        FILE *f;
+        int pid = 0;
+
+        if ((f = fopen(pidfile, "r")) != NULL) {
+            if (fscanf(f, "%d", &pid) != 1)
+                pid = 0;
+
+            fclose(f);
+        }
+
+        if (pid <= 0 || kill(pid, SIGHUP) == -1) {
+            fprintf(stderr, "Cannot signal the server (%s)\n", pidfile);
+            return 1;
+        }
+
+        return 0;
+    }
+
     if (strcmp(cmd, "state") == 0) { /** **/
         xs *shm_name = NULL;
         srv_state *p_state = srv_state_op(&shm_name, 1);
@@ -155,12 +188,69 @@ int main(int argc, char *argv[])
         printf("server: %s (%s)\n", xs_dict_get(srv_config, "host"), USER_AGENT);
         xs *uptime = xs_str_time_diff(time(NULL) - ss.srv_start_time);
         printf("uptime: %s\n", uptime);
-        printf("job fifo size (cur): %d\n", ss.job_fifo_size);
+        const char *classes[] = { "http", "input", "output", "maint" };
+        int queued[JOB_CLASSES] = {0}, running[JOB_CLASSES] = {0};
+        int fifo_size = 0;
+
+        /* the counters are kept per thread */
+        for (n = 0; n < ss.n_threads && n < MAX_THREADS; n++) {
+            int c;
+
+            for (c = 0; c < JOB_CLASSES; c++) {
+                queued[c] += ss.th_queued[n][c];
+                fifo_size += ss.th_queued[n][c];
+            }
+
+            if (ss.th_class[n] > 0 && ss.th_class[n] <= JOB_CLASSES)
+                running[ss.th_class[n] - 1]++;
+        }
+
+        printf("job fifo size (cur): %d\n", fifo_size);
         printf("job fifo size (peak): %d\n", ss.peak_job_fifo_size);
+
+        for (n = 0; n < JOB_CLASSES; n++)
+            printf("job class %s: %d queued, %d running\n", classes[n],
+                queued[n], running[n]);
+
+        printf("duplicate input messages: %ld (%ld bytes)\n", ss.inbox_dups, ss.inbox_dup_bytes);
+        printf("shed requests: %ld input, %ld web (%ld served from cache), %ld api\n",
+            ss.shed_inbox, ss.shed_html, ss.shed_html_cached, ss.shed_api);
+        printf("rate limited input messages: %ld\n", ss.inbox_limited);
+        printf("shared remote fetches: %ld\n", ss.fetch_shared);
+        printf("queued ancestor requests: %d\n", ss.backfills);
         char *th_states[] = { "stopped", "waiting", "input", "output" };
 
-        for (n = 0; n < ss.n_threads; n++)
-            printf("thread #%d state: %s\n", n, th_states[ss.th_state[n]]);
+        for (n = 0; n < ss.n_threads; n++) {
+            if (n == 0)
+                printf("thread #%d state: %s\n", n, th_states[ss.th_state[n]]);
+            else
+                printf("thread #%d state: %s (%d queued, %ld stolen)\n", n,
+                    th_states[ss.th_state[n]], ss.th_queue[n], ss.th_steals[n]);
+        }
+
+        for (n = 0; n < ss.n_routes; n++) {
+            printf("route %-32s %8ld requests, %8.3f ms avg\n", ss.routes[n].name, ss.routes[n].hits,
+                ss.routes[n].hits ? ss.routes[n].secs * 1000.0 / ss.routes[n].hits : 0.0);
+        }
+
+        return 0;
+    }
+
+    if (strcmp(cmd, "fetch_failures") == 0) { /** **/
+        xs *l = fetch_fail_list();
+        const char *v;
+        int c = 0;
+
+        while (xs_list_next(l, &v, &c))
+            printf("%s\n", v);
+
+        return 0;
+    }
+
+    if (strcmp(cmd, "fetch_failures_clear") == 0) { /** **/
+        int ret = fetch_fail_clear(GET_ARGV());
+
+        printf("%d entr%s deleted\n", ret, ret == 1 ? "y" : "ies");
 
         return 0;
     }
@@ -190,6 +280,19 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    if (strcmp(cmd, "import_instance_blocks") == 0) { /** **/
+        int ret = instance_block_import(user);
+
+        if (ret < 0) {
+            fprintf(stderr, "Error importing instance blocks from %s\n", user);
+            return 1;
+        }
+
+        printf("%d instance(s) blocked\n", ret);
+
+        return 0;
+    }
+
     if (strcmp(cmd, "webfinger") == 0) { /** **/
         xs *actor = NULL;
         xs *uid = NULL;
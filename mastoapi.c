@@ -11,6 +11,7 @@
 #include "xs_time.h"
 #include "xs_glob.h"
 #include "xs_set.h"
+#include "xs_vec.h"
 #include "xs_random.h"
 #include "xs_url.h"
 #include "xs_mime.h"
@@ -19,6 +20,7 @@
 #include "snac.h"
 
 #include <sys/time.h>
+#include <pthread.h>
 
 static xs_str *random_str(void)
 /* just what is says in the tin */
@@ -93,6 +95,43 @@ int app_del(const char *id)
 }
 
 
+/* Tokens are kept in memory once read, as every authenticated request
+   needs one. Their last use (and that of their apps) is also recorded
+   in memory and flushed from time to time as file mtimes, which is what
+   mastoapi_purge() looks at, instead of touching both files each time. */
+
+#define TOKEN_CACHE_MAX 4096
+
+static pthread_mutex_t token_mutex = PTHREAD_MUTEX_INITIALIZER;
+static xs_dict *token_cache = NULL;     /* token id -> token */
+static int token_cache_n = 0;           /* tokens stored there (roughly) */
+static xs_dict *token_used  = NULL;     /* file name -> 1, to be touched */
+static time_t token_flushed = 0;
+
+
+static void _token_cache_set(const char *id, const xs_dict *token)
+/* stores a token in the cache, or removes it if token is NULL (token_mutex must be locked) */
+{
+    int h = xs_arena_hold(1);
+
+    /* too many? start again */
+    if (token_cache == NULL || token_cache_n >= TOKEN_CACHE_MAX) {
+        xs_free(token_cache);
+        token_cache = xs_dict_new();
+        token_cache_n = 0;
+    }
+
+    if (token != NULL) {
+        token_cache = xs_dict_set(token_cache, id, token);
+        token_cache_n++;
+    }
+    else
+        token_cache = xs_dict_del(token_cache, id);
+
+    xs_arena_hold(h);
+}
+
+
 int token_add(const char *id, const xs_dict *token)
 /* stores a token */
 {
@@ -110,6 +149,10 @@ int token_add(const char *id, const xs_dict *token)
     if ((f = fopen(fn, "w")) != NULL) {
         xs_json_dump(token, 4, f);
         fclose(f);
+
+        pthread_mutex_lock(&token_mutex);
+        _token_cache_set(id, token);
+        pthread_mutex_unlock(&token_mutex);
     }
     else
         status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
@@ -126,28 +169,87 @@ xs_dict *token_get(const char *id)
 
     xs *fn         = xs_fmt("%s/token/%s.json", srv_basedir, id);
     xs_dict *token = NULL;
-    FILE *f;
 
-    if ((f = fopen(fn, "r")) != NULL) {
-        token = xs_json_load(f);
-        fclose(f);
+    pthread_mutex_lock(&token_mutex);
 
-        /* 'touch' the file */
-        utimes(fn, NULL);
+    const xs_dict *c_token = xs_dict_get(token_cache, id);
+
+    if (c_token != NULL)
+        token = xs_dup(c_token);
+    else {
+        FILE *f;
+
+        if ((f = fopen(fn, "r")) != NULL) {
+            token = xs_json_load(f);
+            fclose(f);
+
+            if (token != NULL)
+                _token_cache_set(id, token);
+        }
+    }
+
+    if (token != NULL) {
+        int h = xs_arena_hold(1);
+
+        if (token_used == NULL)
+            token_used = xs_dict_new();
+
+        /* 'touch' the file and its app (later) */
+        token_used = xs_dict_set(token_used, fn, xs_stock(XSTYPE_TRUE));
 
-        /* also 'touch' the app */
         const char *app_id = xs_dict_get(token, "client_id");
 
         if (app_id) {
-            xs *afn = xs_fmt("%s/app/%s.json", srv_basedir, app_id);
-            utimes(afn, NULL);
+            xs *afn = _app_fn(app_id);
+            token_used = xs_dict_set(token_used, afn, xs_stock(XSTYPE_TRUE));
         }
+
+        xs_arena_hold(h);
     }
 
+    pthread_mutex_unlock(&token_mutex);
+
     return token;
 }
 
 
+void token_flush(int force)
+/* sets the mtime of the tokens and apps used since the last call */
+{
+    time_t t = time(NULL);
+
+    pthread_mutex_lock(&token_mutex);
+
+    xs *used = NULL;
+
+    if (token_used != NULL && (force || t - token_flushed > 5 * 60)) {
+        int h = xs_arena_hold(1);
+
+        used = token_used;
+        token_used = NULL;
+
+        xs_arena_hold(h);
+
+        token_flushed = t;
+    }
+
+    pthread_mutex_unlock(&token_mutex);
+
+    if (used != NULL) {
+        const char *k, *v;
+        int c = 0;
+        int n = 0;
+
+        while (xs_dict_next(used, &k, &v, &c)) {
+            utimes(k, NULL);
+            n++;
+        }
+
+        srv_debug(2, xs_fmt("token_flush: %d files touched", n));
+    }
+}
+
+
 int token_del(const char *id)
 /* deletes a token */
 {
@@ -156,6 +258,18 @@ int token_del(const char *id)
 
     xs *fn = xs_fmt("%s/token/%s.json", srv_basedir, id);
 
+    pthread_mutex_lock(&token_mutex);
+
+    _token_cache_set(id, NULL);
+
+    if (token_used != NULL) {
+        int h = xs_arena_hold(1);
+        token_used = xs_dict_del(token_used, fn);
+        xs_arena_hold(h);
+    }
+
+    pthread_mutex_unlock(&token_mutex);
+
     return unlink(fn);
 }
 
@@ -527,7 +641,7 @@ xs_dict *mastoapi_account(snac *logged, const xs_dict *actor)
     if (xs_type(id) != XSTYPE_STRING)
         return NULL;
 
-    if (logged && xs_is_true(xs_dict_get(srv_config, "proxy_media")))
+    if (logged && srv_conf->proxy_media)
         proxy = logged->actor;
 
     const char *prefu = xs_dict_get(actor, "preferredUsername");
@@ -801,7 +915,7 @@ xs_dict *mastoapi_status(snac *snac, const xs_dict *msg)
     if (actor == NULL)
         return NULL;
 
-    if (snac && xs_is_true(xs_dict_get(srv_config, "proxy_media")))
+    if (snac && srv_conf->proxy_media)
         proxy = snac->actor;
 
     const char *type = xs_dict_get(msg, "type");
@@ -1281,7 +1395,7 @@ void credentials_get(char **body, char **ctype, int *status, snac snac)
 }
 
 
-xs_list *mastoapi_timeline(snac *user, const xs_dict *args, const char *index_fn)
+xs_list *mastoapi_timeline(snac *user, const xs_dict *args, const char *index_fn, int filter)
 {
     xs_list *out = xs_list_new();
     FILE *f;
@@ -1344,7 +1458,6 @@ xs_list *mastoapi_timeline(snac *user, const xs_dict *args, const char *index_fn
             }
 
             /* discard non-Notes */
-            const char *id   = xs_dict_get(msg, "id");
             const char *type = xs_dict_get(msg, "type");
             if (!xs_match(type, POSTLIKE_OBJECT_TYPE))
                 continue;
@@ -1360,21 +1473,8 @@ xs_list *mastoapi_timeline(snac *user, const xs_dict *args, const char *index_fn
                 continue;
 
             if (user) {
-                /* is this message from a person we don't follow? */
-                if (strcmp(from, user->actor) && !following_check(user, from)) {
-                    /* discard if it was not boosted */
-                    xs *idx = object_announces(id);
-
-                    if (xs_list_len(idx) == 0)
-                        continue;
-                }
-
-                /* discard notes from muted morons */
-                if (is_muted(user, from))
-                    continue;
-
-                /* discard hidden notes */
-                if (is_hidden(user, id))
+                /* entries from the home index were filtered when added */
+                if (filter && !timeline_home_check(user, msg))
                     continue;
             }
             else {
@@ -1413,8 +1513,137 @@ xs_list *mastoapi_timeline(snac *user, const xs_dict *args, const char *index_fn
 }
 
 
+static xs_str *mastoapi_notify_tid(const char *id)
+/* converts a notification id back to a time id */
+{
+    if (xs_is_null(id) || strlen(id) != 16 || strspn(id, "0123456789") != 16)
+        return NULL;
+
+    return xs_fmt("%.10s.%s", id, id + 10);
+}
+
+
+static xs_str *mastoapi_instance(void)
+/* returns an instance object */
+{
+    xs *ins = xs_dict_new();
+    const char *host  = xs_dict_get(srv_config, "host");
+    const char *title = xs_dict_get(srv_config, "title");
+    const char *sdesc = xs_dict_get(srv_config, "short_description");
+
+    ins = xs_dict_append(ins, "uri",         host);
+    ins = xs_dict_append(ins, "domain",      host);
+    ins = xs_dict_append(ins, "title",       title && *title ? title : host);
+    ins = xs_dict_append(ins, "version",     "4.0.0 (not true; really " USER_AGENT ")");
+    ins = xs_dict_append(ins, "source_url",  WHAT_IS_SNAC_URL);
+    ins = xs_dict_append(ins, "description", host);
+
+    ins = xs_dict_append(ins, "short_description", sdesc && *sdesc ? sdesc : host);
+
+    xs *susie = xs_fmt("%s/susie.png", srv_baseurl);
+    ins = xs_dict_append(ins, "thumbnail", susie);
+
+    const char *v = xs_dict_get(srv_config, "admin_email");
+    if (xs_is_null(v) || *v == '\0')
+        v = "admin@localhost";
+
+    ins = xs_dict_append(ins, "email", v);
+
+    ins = xs_dict_append(ins, "rules", xs_stock(XSTYPE_LIST));
+
+    xs *l1 = xs_list_append(xs_list_new(), "en");
+    ins = xs_dict_append(ins, "languages", l1);
+
+    xs *wss = xs_fmt("wss:/" "/%s", xs_dict_get(srv_config, "host"));
+    xs *urls = xs_dict_new();
+    urls = xs_dict_append(urls, "streaming_api", wss);
+
+    ins = xs_dict_append(ins, "urls", urls);
+
+    int users, umonth, uhyear, posts;
+    stats_get(&users, &umonth, &uhyear, &posts);
+
+    xs *n_users = xs_number_new(users);
+    xs *n_posts = xs_number_new(posts);
+
+    xs *d2 = xs_dict_append(xs_dict_new(), "user_count", n_users);
+    d2 = xs_dict_append(d2, "status_count", n_posts);
+    d2 = xs_dict_append(d2, "domain_count", xs_stock(0));
+    ins = xs_dict_append(ins, "stats", d2);
+
+    ins = xs_dict_append(ins, "registrations",     xs_stock(XSTYPE_FALSE));
+    ins = xs_dict_append(ins, "approval_required", xs_stock(XSTYPE_FALSE));
+    ins = xs_dict_append(ins, "invites_enabled",   xs_stock(XSTYPE_FALSE));
+
+    xs *cfg = xs_dict_new();
+
+    {
+        xs *d11 = xs_json_loads("{\"characters_reserved_per_url\":32,"
+            "\"max_characters\":100000,\"max_media_attachments\":8}");
+        cfg = xs_dict_append(cfg, "statuses", d11);
+
+        xs *d12 = xs_json_loads("{\"max_featured_tags\":0}");
+        cfg = xs_dict_append(cfg, "accounts", d12);
+
+        xs *d13 = xs_json_loads("{\"image_matrix_limit\":33177600,"
+                    "\"image_size_limit\":16777216,"
+                    "\"video_frame_rate_limit\":120,"
+                    "\"video_matrix_limit\":8294400,"
+                    "\"video_size_limit\":103809024}"
+        );
+
+        {
+            /* get the supported mime types from the internal list */
+            const char **p = xs_mime_types;
+            xs_set mtypes;
+            xs_set_init(&mtypes);
+
+            while (*p) {
+                const char *type = p[1];
+
+                if (xs_startswith(type, "image/") ||
+                    xs_startswith(type, "video/") ||
+                    xs_startswith(type, "audio/"))
+                    xs_set_add(&mtypes, type);
+
+                p += 2;
+            }
+
+            xs *l = xs_set_result(&mtypes);
+            d13 = xs_dict_append(d13, "supported_mime_types", l);
+        }
+
+        cfg = xs_dict_append(cfg, "media_attachments", d13);
+
+        xs *d14 = xs_json_loads("{\"max_characters_per_option\":50,"
+            "\"max_expiration\":2629746,"
+            "\"max_options\":8,\"min_expiration\":300}");
+        cfg = xs_dict_append(cfg, "polls", d14);
+    }
+
+    ins = xs_dict_append(ins, "configuration", cfg);
+
+    const char *admin_account = xs_dict_get(srv_config, "admin_account");
+
+    if (!xs_is_null(admin_account) && *admin_account) {
+        snac admin;
+
+        if (user_open(&admin, admin_account)) {
+            xs *actor = msg_actor_cached(&admin);
+            xs *acct  = mastoapi_account(NULL, actor);
+
+            ins = xs_dict_append(ins, "contact_account", acct);
+
+            user_free(&admin);
+        }
+    }
+
+    return xs_json_dumps(ins, 4);
+}
+
+
 int mastoapi_get_handler(const xs_dict *req, const char *q_path,
-                         char **body, int *b_size, char **ctype)
+                         char **body, int *b_size, char **ctype, xs_str **etag)
 {
     (void)b_size;
 
@@ -1480,7 +1709,7 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
                 snac user;
 
                 if (user_open(&user, uid)) {
-                    xs *actor = msg_actor(&user);
+                    xs *actor = msg_actor_cached(&user);
                     xs *macct = mastoapi_account(NULL, actor);
 
                     *body  = xs_json_dumps(macct, 4);
@@ -1565,7 +1794,7 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
                         if (user_open(&user, v)) {
                             /* if it's not already seen, add it */
                             if (xs_set_add(&seen, user.actor) == 1) {
-                                xs *actor = msg_actor(&user);
+                                xs *actor = msg_actor_cached(&user);
                                 xs *acct  = mastoapi_account(&snac1, actor);
 
                                 out = xs_list_append(out, acct);
@@ -1583,7 +1812,7 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
             if (user_open(&snac2, uid) || user_open_by_md5(&snac2, uid)) {
                 if (opt == NULL) {
                     /* account information */
-                    actor = msg_actor(&snac2);
+                    actor = msg_actor_cached(&snac2);
                     out   = mastoapi_account(NULL, actor);
                 }
                 else
@@ -1671,8 +1900,17 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
     if (strcmp(cmd, "/v1/timelines/home") == 0) { /** **/
         /* the private timeline */
         if (logged_in) {
-            xs *ifn = user_index_fn(&snac1, "private");
-            xs *out = mastoapi_timeline(&snac1, args, ifn);
+            xs *ifn = user_index_fn(&snac1, "home");
+            int filter = 0;
+
+            /* not yet built? filter the private index instead */
+            if (mtime(ifn) == 0.0) {
+                xs_free(ifn);
+                ifn    = user_index_fn(&snac1, "private");
+                filter = 1;
+            }
+
+            xs *out = mastoapi_timeline(&snac1, args, ifn, filter);
 
             *body  = xs_json_dumps(out, 4);
             *ctype = "application/json";
@@ -1688,7 +1926,7 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
     if (strcmp(cmd, "/v1/timelines/public") == 0) { /** **/
         /* the instance public timeline (public timelines for all users) */
         xs *ifn = instance_index_fn();
-        xs *out = mastoapi_timeline(NULL, args, ifn);
+        xs *out = mastoapi_timeline(NULL, args, ifn, 0);
 
         *body  = xs_json_dumps(out, 4);
         *ctype = "application/json";
@@ -1701,7 +1939,7 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
         const char *tag = xs_list_get(l, -1);
 
         xs *ifn = tag_fn(tag);
-        xs *out = mastoapi_timeline(NULL, args, ifn);
+        xs *out = mastoapi_timeline(NULL, args, ifn, 0);
 
         *body  = xs_json_dumps(out, 4);
         *ctype = "application/json";
@@ -1715,7 +1953,7 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
             const char *list = xs_list_get(l, -1);
 
             xs *ifn = list_timeline_fn(&snac1, list);
-            xs *out = mastoapi_timeline(NULL, args, ifn);
+            xs *out = mastoapi_timeline(NULL, args, ifn, 0);
 
             *body  = xs_json_dumps(out, 4);
             *ctype = "application/json";
@@ -1734,41 +1972,35 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
     else
     if (strcmp(cmd, "/v1/notifications") == 0) { /** **/
         if (logged_in) {
-            xs *l      = notify_list(&snac1, 0, 64);
             xs *out    = xs_list_new();
             const xs_dict *v;
             const xs_list *excl = xs_dict_get(args, "exclude_types[]");
-            const char *max_id = xs_dict_get(args, "max_id");
+            xs *max_tid = mastoapi_notify_tid(xs_dict_get(args, "max_id"));
+            xs *min_tid = mastoapi_notify_tid(xs_dict_get(args, "since_id"));
 
-            xs_list_foreach(l, v) {
-                xs *noti = notify_get(&snac1, v);
+            if (min_tid == NULL)
+                min_tid = mastoapi_notify_tid(xs_dict_get(args, "min_id"));
 
-                if (noti == NULL)
-                    continue;
+            xs *l = notify_page(&snac1, max_tid, min_tid, 64);
 
-                const char *type  = xs_dict_get(noti, "type");
-                const char *utype = xs_dict_get(noti, "utype");
-                const char *objid = xs_dict_get(noti, "objid");
-                const char *id    = xs_dict_get(noti, "id");
+            xs_list_foreach(l, v) {
+                const char *type  = xs_dict_get(v, "type");
+                const char *utype = xs_dict_get(v, "utype");
+                const char *id    = xs_dict_get(v, "id");
                 xs *fid = xs_replace(id, ".", "");
                 xs *actor = NULL;
                 xs *entry = NULL;
 
-                if (!valid_status(actor_get(xs_dict_get(noti, "actor"), &actor)))
+                if (!valid_status(actor_get_by_md5(xs_dict_get(v, "actor_md5"), &actor)))
                     continue;
 
-                if (objid != NULL && !valid_status(object_get(objid, &entry)))
+                if (!valid_status(object_get_by_md5(xs_dict_get(v, "objid_md5"), &entry)))
                     continue;
 
-                if (is_hidden(&snac1, objid))
-                    continue;
-
-                if (max_id) {
-                    if (strcmp(fid, max_id) == 0)
-                        max_id = NULL;
+                const char *objid = xs_dict_get(entry, "id");
 
+                if (xs_is_null(objid) || is_hidden(&snac1, objid))
                     continue;
-                }
 
                 /* convert the type */
                 if (strcmp(type, "Like") == 0 || strcmp(type, "EmojiReact") == 0)
@@ -1798,7 +2030,7 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
 
                 mn = xs_dict_append(mn, "id", fid);
 
-                mn = xs_dict_append(mn, "created_at", xs_dict_get(noti, "date"));
+                mn = xs_dict_append(mn, "created_at", xs_dict_get(v, "date"));
 
                 xs *acct = mastoapi_account(&snac1, actor);
 
@@ -1851,7 +2083,7 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
     if (strcmp(cmd, "/v1/bookmarks") == 0) { /** **/
         if (logged_in) {
             xs *ifn = bookmark_index_fn(&snac1);
-            xs *out = mastoapi_timeline(&snac1, args, ifn);
+            xs *out = mastoapi_timeline(&snac1, args, ifn, 1);
 
             *body  = xs_json_dumps(out, 4);
             *ctype = "application/json";
@@ -2012,115 +2244,9 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
     else
     if (strcmp(cmd, "/v1/instance") == 0) { /** **/
         /* returns an instance object */
-        xs *ins = xs_dict_new();
-        const char *host  = xs_dict_get(srv_config, "host");
-        const char *title = xs_dict_get(srv_config, "title");
-        const char *sdesc = xs_dict_get(srv_config, "short_description");
-
-        ins = xs_dict_append(ins, "uri",         host);
-        ins = xs_dict_append(ins, "domain",      host);
-        ins = xs_dict_append(ins, "title",       title && *title ? title : host);
-        ins = xs_dict_append(ins, "version",     "4.0.0 (not true; really " USER_AGENT ")");
-        ins = xs_dict_append(ins, "source_url",  WHAT_IS_SNAC_URL);
-        ins = xs_dict_append(ins, "description", host);
-
-        ins = xs_dict_append(ins, "short_description", sdesc && *sdesc ? sdesc : host);
-
-        xs *susie = xs_fmt("%s/susie.png", srv_baseurl);
-        ins = xs_dict_append(ins, "thumbnail", susie);
-
-        const char *v = xs_dict_get(srv_config, "admin_email");
-        if (xs_is_null(v) || *v == '\0')
-            v = "admin@localhost";
-
-        ins = xs_dict_append(ins, "email", v);
-
-        ins = xs_dict_append(ins, "rules", xs_stock(XSTYPE_LIST));
-
-        xs *l1 = xs_list_append(xs_list_new(), "en");
-        ins = xs_dict_append(ins, "languages", l1);
-
-        xs *wss = xs_fmt("wss:/" "/%s", xs_dict_get(srv_config, "host"));
-        xs *urls = xs_dict_new();
-        urls = xs_dict_append(urls, "streaming_api", wss);
-
-        ins = xs_dict_append(ins, "urls", urls);
-
-        xs *d2 = xs_dict_append(xs_dict_new(), "user_count", xs_stock(0));
-        d2 = xs_dict_append(d2, "status_count", xs_stock(0));
-        d2 = xs_dict_append(d2, "domain_count", xs_stock(0));
-        ins = xs_dict_append(ins, "stats", d2);
-
-        ins = xs_dict_append(ins, "registrations",     xs_stock(XSTYPE_FALSE));
-        ins = xs_dict_append(ins, "approval_required", xs_stock(XSTYPE_FALSE));
-        ins = xs_dict_append(ins, "invites_enabled",   xs_stock(XSTYPE_FALSE));
-
-        xs *cfg = xs_dict_new();
-
-        {
-            xs *d11 = xs_json_loads("{\"characters_reserved_per_url\":32,"
-                "\"max_characters\":100000,\"max_media_attachments\":8}");
-            cfg = xs_dict_append(cfg, "statuses", d11);
-
-            xs *d12 = xs_json_loads("{\"max_featured_tags\":0}");
-            cfg = xs_dict_append(cfg, "accounts", d12);
-
-            xs *d13 = xs_json_loads("{\"image_matrix_limit\":33177600,"
-                        "\"image_size_limit\":16777216,"
-                        "\"video_frame_rate_limit\":120,"
-                        "\"video_matrix_limit\":8294400,"
-                        "\"video_size_limit\":103809024}"
-            );
-
-            {
-                /* get the supported mime types from the internal list */
-                const char **p = xs_mime_types;
-                xs_set mtypes;
-                xs_set_init(&mtypes);
-
-                while (*p) {
-                    const char *type = p[1];
-
-                    if (xs_startswith(type, "image/") ||
-                        xs_startswith(type, "video/") ||
-                        xs_startswith(type, "audio/"))
-                        xs_set_add(&mtypes, type);
-
-                    p += 2;
-                }
-
-                xs *l = xs_set_result(&mtypes);
-                d13 = xs_dict_append(d13, "supported_mime_types", l);
-            }
-
-            cfg = xs_dict_append(cfg, "media_attachments", d13);
-
-            xs *d14 = xs_json_loads("{\"max_characters_per_option\":50,"
-                "\"max_expiration\":2629746,"
-                "\"max_options\":8,\"min_expiration\":300}");
-            cfg = xs_dict_append(cfg, "polls", d14);
-        }
-
-        ins = xs_dict_append(ins, "configuration", cfg);
-
-        const char *admin_account = xs_dict_get(srv_config, "admin_account");
-
-        if (!xs_is_null(admin_account) && *admin_account) {
-            snac admin;
-
-            if (user_open(&admin, admin_account)) {
-                xs *actor = msg_actor(&admin);
-                xs *acct  = mastoapi_account(NULL, actor);
-
-                ins = xs_dict_append(ins, "contact_account", acct);
-
-                user_free(&admin);
-            }
-        }
-
-        *body  = xs_json_dumps(ins, 4);
+        status = stats_response(STATS_RESP_INSTANCE, mastoapi_instance,
+                    xs_dict_get(req, "if-none-match"), body, etag);
         *ctype = "application/json";
-        status = HTTP_STATUS_OK;
     }
     else
     if (xs_startswith(cmd, "/v1/statuses/")) { /** **/
@@ -2151,26 +2277,37 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
                         xs *des = xs_list_new();
                         xs_list *p;
                         const xs_str *v;
-                        char pid[MD5_HEX_SIZE];
 
                         /* build the [grand]parent list, moving up */
-                        strncpy(pid, id, sizeof(pid));
+                        xs *ancestors = object_ancestors(id);
+                        xs_vec av, sv;
+                        int n;
 
-                        while (object_parent(pid, pid)) {
+                        xs_vec_from_list(&av, ancestors);
+                        xs_vec_init(&sv);
+
+                        for (n = xs_vec_len(&av) - 1; n >= 0; n--) {
                             xs *m2 = NULL;
 
-                            if (valid_status(timeline_get_by_md5(&snac1, pid, &m2))) {
+                            if (valid_status(timeline_get_by_md5(&snac1, xs_vec_get(&av, n), &m2))) {
                                 xs *st = mastoapi_status(&snac1, m2);
 
                                 if (st)
-                                    anc = xs_list_insert(anc, 0, st);
+                                    xs_vec_append(&sv, st);
                             }
                             else
                                 break;
                         }
 
-                        /* build the children list */
-                        xs *children = object_children(xs_dict_get(msg, "id"));
+                        /* they were collected from the parent up */
+                        for (n = xs_vec_len(&sv) - 1; n >= 0; n--)
+                            anc = xs_list_append(anc, xs_vec_get(&sv, n));
+
+                        xs_vec_free(&sv);
+                        xs_vec_free(&av);
+
+                        /* build the descendant list */
+                        xs *children = object_descendants_tree(id);
                         p = children;
 
                         while (xs_list_iter(&p, &v)) {
@@ -3317,6 +3454,9 @@ int mastoapi_patch_handler(const xs_dict *req, const char *q_path,
 
 void mastoapi_purge(void)
 {
+    /* make the app mtimes current */
+    token_flush(1);
+
     xs *spec   = xs_fmt("%s/app/" "*.json", srv_basedir);
     xs *files  = xs_glob(spec, 1, 0);
     xs_list *p = files;
@@ -18,6 +18,7 @@
 #include "xs_mime.h"
 #include "xs_regex.h"
 #include "xs_set.h"
+#include "xs_vec.h"
 #include "xs_time.h"
 #include "xs_glob.h"
 #include "xs_random.h"
@@ -31,7 +32,8 @@
 #include <sys/stat.h>
 
 xs_str *srv_basedir = NULL;
-xs_dict *srv_config = NULL;
+xs_dict * volatile srv_config = NULL;
+const srv_cfg * volatile srv_conf = NULL;
 xs_str *srv_baseurl = NULL;
 xs_str *srv_proxy_token_seed = NULL;
 
@@ -16,15 +16,63 @@
 #define MAX_THREADS 256
 #endif
 
+#define MAX_ROUTES 32
+
+/* job classes */
+#define JOB_HTTP    0   /* incoming connections */
+#define JOB_INPUT   1   /* incoming ActivityPub messages */
+#define JOB_OUTPUT  2   /* outgoing deliveries */
+#define JOB_MAINT   3   /* everything else (purge, links, email...) */
+#define JOB_CLASSES 4
+
 #ifndef MAX_CONVERSATION_LEVELS
 #define MAX_CONVERSATION_LEVELS 48
 #endif
 
 #define MD5_HEX_SIZE 33
 
+#ifdef __APPLE__
+/* Apple uses st_atimespec instead of st_atim etc */
+#define st_atim st_atimespec
+#define st_ctim st_ctimespec
+#define st_mtim st_mtimespec
+#endif
+
 extern double disk_layout;
 extern xs_str *srv_basedir;
-extern xs_dict *srv_config;
+extern xs_dict * volatile srv_config;
+
+/* server settings used in hot paths, parsed from srv_config */
+typedef struct {
+    int max_timeline_entries;
+    int queue_retry_minutes;
+    int queue_retry_max;
+    int min_account_age;
+    int timeline_purge_days;
+    int local_purge_days;
+    int shed_inbox_queue;
+    int shed_html_queue;
+    int shed_api_queue;
+    int shed_retry_after;
+    int inbox_rate;
+    int inbox_rate_burst;
+    int backfill_max;
+    xs_dict *inbox_rate_hosts;
+    xs_dict *fetch_fail_ttl;
+    int proxy_media;
+    int strict_public_timelines;
+    int show_instance_timeline;
+    int shared_inboxes;
+    int disable_inbox_collection;
+    int disable_history;
+    int disable_cache;
+    int disable_email_notifications;
+    int disable_block_notifications;
+    int hide_delete_post_button;
+    int public_social_graph;
+} srv_cfg;
+
+extern const srv_cfg * volatile srv_conf;
 extern xs_str *srv_baseurl;
 extern xs_str *srv_proxy_token_seed;
 
@@ -60,10 +108,28 @@ typedef struct {
     int srv_running;        /* server running on/off */
     int use_fcgi;           /* FastCGI use on/off */
     time_t srv_start_time;  /* start time */
-    int job_fifo_size;      /* job fifo size */
     int peak_job_fifo_size; /* maximum job fifo size seen */
     int n_threads;          /* number of configured threads */
     enum { THST_STOP, THST_WAIT, THST_IN, THST_QUEUE } th_state[MAX_THREADS];
+    int th_queue[MAX_THREADS];      /* jobs queued per thread */
+    int th_queued[MAX_THREADS][JOB_CLASSES]; /* ...and per class */
+    int th_class[MAX_THREADS];      /* class of the running job + 1 (0, none) */
+    long th_steals[MAX_THREADS];    /* jobs stolen from other threads */
+    long inbox_dups;        /* duplicate input messages accepted early */
+    long inbox_dup_bytes;   /* size of these messages */
+    long shed_inbox;        /* input messages rejected when overloaded */
+    long shed_html;         /* web pages rejected when overloaded */
+    long shed_html_cached;  /* web pages served from the cache instead */
+    long shed_api;          /* API requests rejected when overloaded */
+    long inbox_limited;     /* input messages rejected by the per-host rate limit */
+    long fetch_shared;      /* remote fetches answered by another thread's request */
+    int backfills;          /* queued ancestor requests */
+    int n_routes;           /* number of request routes */
+    struct {
+        char name[40];      /* method and path pattern */
+        long hits;          /* requests served */
+        double secs;        /* total time spent */
+    } routes[MAX_ROUTES];
 } srv_state;
 
 extern srv_state *p_state;
@@ -73,6 +139,7 @@ void snac_log(snac *user, xs_str *str);
     { snac_log((user), (str)); } } while (0)
 
 int srv_open(const char *basedir, int auto_upgrade);
+int srv_reload(void);
 void srv_free(void);
 
 int user_open(snac *snac, const char *uid);
@@ -107,6 +174,7 @@ xs_list *index_list(const char *fn, int max);
 int index_desc_next(FILE *f, char md5[MD5_HEX_SIZE]);
 int index_desc_first(FILE *f, char md5[MD5_HEX_SIZE], int skip);
 xs_list *index_list_desc(const char *fn, int skip, int show);
+xs_list *index_list_desc_pos(const char *fn, int *pos, int show);
 
 int object_add(const char *id, const xs_dict *obj);
 int object_add_ow(const char *id, const xs_dict *obj);
@@ -132,6 +200,11 @@ xs_list *object_children(const char *id);
 xs_list *object_likes(const char *id);
 xs_list *object_announces(const char *id);
 int object_parent(const char *md5, char parent[MD5_HEX_SIZE]);
+void object_thread_add(const char *md5, const char *p_md5);
+xs_list *object_ancestors(const char *md5);
+int object_root(const char *md5, char root[MD5_HEX_SIZE]);
+xs_list *object_descendants(const char *md5);
+xs_list *object_descendants_tree(const char *md5);
 
 int object_user_cache_add(snac *snac, const char *id, const char *cachedir);
 int object_user_cache_del(snac *snac, const char *id, const char *cachedir);
@@ -140,6 +213,7 @@ int follower_add(snac *snac, const char *actor);
 int follower_del(snac *snac, const char *actor);
 int follower_check(snac *snac, const char *actor);
 xs_list *follower_list(snac *snac);
+xs_list *follower_list_page(snac *snac, int *pos, int show, int *total);
 
 int pending_add(snac *user, const char *actor, const xs_dict *msg);
 int pending_check(snac *user, const char *actor);
@@ -157,6 +231,9 @@ xs_list *timeline_simple_list(snac *user, const char *idx_name, int skip, int sh
 xs_list *timeline_list(snac *snac, const char *idx_name, int skip, int show);
 int timeline_add(snac *snac, const char *id, const xs_dict *o_msg);
 int timeline_admire(snac *snac, const char *id, const char *admirer, int like);
+int timeline_home_check(snac *user, const xs_dict *msg);
+void timeline_home_drop(snac *user, const char *actor);
+void timeline_home_restore(snac *user, const char *actor);
 
 xs_list *timeline_top_level(snac *snac, const xs_list *list);
 xs_list *local_list(snac *snac, int max);
@@ -211,6 +288,7 @@ void list_distribute(snac *user, const char *who, const xs_dict *post);
 
 int actor_add(const char *actor, const xs_dict *msg);
 int actor_get(const char *actor, xs_dict **data);
+int actor_get_by_md5(const char *md5, xs_dict **data);
 int actor_get_refresh(snac *user, const char *actor, xs_dict **data);
 
 int static_get(snac *snac, const char *id, xs_val **data, int *size, const char *inm, xs_str **etag);
@@ -228,28 +306,60 @@ xs_list *history_list(snac *snac);
 
 void lastlog_write(snac *snac, const char *source);
 
+#define STATS_RESP_NODEINFO 0
+#define STATS_RESP_INSTANCE 1
+#define STATS_RESP_MAX      2
+
+void stats_lastlog_set(const char *uid, double t);
+void stats_post_add(void);
+void stats_post_del(void);
+void stats_recount(void);
+void stats_checkpoint(int force);
+void stats_get(int *users, int *umonth, int *uhyear, int *posts);
+int stats_response(int which, xs_str *(*build)(void),
+                   const char *inm, xs_str **body, xs_str **etag);
+
 xs_str *notify_check_time(snac *snac, int reset);
 void notify_add(snac *snac, const char *type, const char *utype,
                 const char *actor, const char *objid, const xs_dict *msg);
 xs_dict *notify_get(snac *snac, const char *id);
 int notify_new_num(snac *snac);
 xs_list *notify_list(snac *snac, int skip, int show);
+xs_list *notify_page(snac *snac, const char *max_tid, const char *min_tid, int show);
 void notify_clear(snac *snac);
+void notify_purge(snac *snac);
 
 void inbox_add(const char *inbox);
 void inbox_add_by_actor(const xs_dict *actor);
 xs_list *inbox_list(void);
-
+void inbox_host_status(const char *url, int status);
+void inbox_host_software(const char *url, const char *user_agent);
+int inbox_purge(int days);
+void inbox_checkpoint(int force);
+
+int fetch_fail_get(const char *signer, const char *url);
+void fetch_fail_add(const char *signer, const char *url, int status);
+void fetch_fail_ok(const char *url);
+void fetch_fail_checkpoint(int force);
+xs_list *fetch_fail_list(void);
+int fetch_fail_clear(const char *url);
+
+xs_str *_instance_block_fn(const char *instance);
 int is_instance_blocked(const char *instance);
 int instance_block(const char *instance);
 int instance_unblock(const char *instance);
+int instance_block_import(const char *fn);
 
 int content_match(const char *file, const xs_dict *msg);
+xs_str *content_filter_match(const char *file, const xs_dict *msg);
+void content_filter_checkpoint(int force);
 xs_list *content_search(snac *user, const char *regex,
             int priv, int skip, int show, int max_secs, int *timeout);
 
-void enqueue_input(snac *snac, const xs_dict *msg, const xs_dict *req, int retries);
-void enqueue_shared_input(const xs_dict *msg, const xs_dict *req, int retries);
+void enqueue_input(snac *snac, const xs_dict *msg, const xs_dict *req,
+                   const char *seen, int retries);
+void enqueue_shared_input(const xs_dict *msg, const xs_dict *req,
+                          const char *seen, int retries);
 void enqueue_output_raw(const char *keyid, const char *seckey,
                         const xs_dict *msg, const xs_str *inbox,
                         int retries, int p_status);
@@ -263,6 +373,9 @@ void enqueue_ntfy(const xs_str *msg, const char *ntfy_server, const char *ntfy_t
 void enqueue_message(snac *snac, const xs_dict *msg);
 void enqueue_close_question(snac *user, const char *id, int end_secs);
 void enqueue_object_request(snac *user, const char *id, int forward_secs);
+void enqueue_ancestor_request(snac *user, const char *id, int level);
+void enqueue_home_restore(snac *user, const char *actor);
+void enqueue_home_drop(snac *user, const char *actor);
 void enqueue_verify_links(snac *user);
 void enqueue_actor_refresh(snac *user, const char *actor, int forward_secs);
 int was_question_voted(snac *user, const char *id);
@@ -290,6 +403,7 @@ int check_signature(const xs_dict *req, xs_str **err);
 
 srv_state *srv_state_op(xs_str **fname, int op);
 void httpd(void);
+void httpd_routes_init(void);
 
 int webfinger_request_signed(snac *snac, const char *qs, xs_str **actor, xs_str **user);
 int webfinger_request(const char *qs, xs_str **actor, xs_str **user);
@@ -316,6 +430,9 @@ xs_dict *msg_note(snac *snac, const xs_str *content, const xs_val *rcpts,
 xs_dict *msg_undo(snac *snac, const xs_val *object);
 xs_dict *msg_delete(snac *snac, const char *id);
 xs_dict *msg_actor(snac *snac);
+xs_dict *msg_actor_cached(snac *snac);
+xs_str *msg_actor_json(snac *snac, xs_str **etag);
+void msg_actor_invalidate(snac *snac);
 xs_dict *msg_update(snac *snac, const xs_dict *object);
 xs_dict *msg_ping(snac *user, const char *rcpt);
 xs_dict *msg_pong(snac *user, const char *rcpt, const char *object);
@@ -343,7 +460,8 @@ void process_queue_item(xs_dict *q_item);
 int process_queue(void);
 
 int activitypub_get_handler(const xs_dict *req, const char *q_path,
-                            char **body, int *b_size, char **ctype);
+                            char **body, int *b_size, char **ctype, xs_str **etag);
+int inbox_rate_check(const xs_dict *req, const char *peer, int *retry_after);
 int activitypub_post_handler(const xs_dict *req, const char *q_path,
                              char *payload, int p_size,
                              char **body, int *b_size, char **ctype);
@@ -360,6 +478,8 @@ xs_str *html_timeline(snac *user, const xs_list *list, int read_only,
 int html_get_handler(const xs_dict *req, const char *q_path,
                      char **body, int *b_size, char **ctype,
                      xs_str **etag, xs_str **last_modified);
+int html_get_cached(const xs_dict *req, const char *q_path,
+                    char **body, int *b_size, xs_str **etag);
 
 int html_post_handler(const xs_dict *req, const char *q_path,
                       char *payload, int p_size,
@@ -372,11 +492,15 @@ int snac_init(const char *_basedir);
 int adduser(const char *uid);
 int resetpwd(snac *snac);
 int deluser(snac *user);
+void rm_rf(const char *dir);
 
 extern const char *snac_blurb;
 
 void job_post(const xs_val *job, int urgent);
-void job_wait(xs_val **job);
+int job_wait(int w, xs_val **job);
+int job_queued(int c);
+int job_running(int c);
+void job_done(int w, int c);
 
 int oauth_get_handler(const xs_dict *req, const char *q_path,
                       char **body, int *b_size, char **ctype);
@@ -384,7 +508,7 @@ int oauth_post_handler(const xs_dict *req, const char *q_path,
                        const char *payload, int p_size,
                        char **body, int *b_size, char **ctype);
 int mastoapi_get_handler(const xs_dict *req, const char *q_path,
-                         char **body, int *b_size, char **ctype);
+                         char **body, int *b_size, char **ctype, xs_str **etag);
 int mastoapi_post_handler(const xs_dict *req, const char *q_path,
                           const char *payload, int p_size,
                           char **body, int *b_size, char **ctype);
@@ -399,6 +523,8 @@ int mastoapi_patch_handler(const xs_dict *req, const char *q_path,
                           const char *payload, int p_size,
                           char **body, int *b_size, char **ctype);
 void mastoapi_purge(void);
+int token_add(const char *id, const xs_dict *token);
+void token_flush(int force);
 
 void verify_links(snac *user);
 
@@ -425,3 +551,5 @@ typedef struct {
 t_announcement *announcement(double after);
 
 xs_str *make_url(const char *href, const char *proxy, int by_token);
+
+int bench(const char *spec, const char *traffic_fn);
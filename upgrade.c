@@ -313,6 +313,79 @@ int snac_upgrade(xs_str **error)
 
             nf = 2.7;
         }
+        else
+        if (f < 2.8) {
+            /* build the conversation indexes */
+            xs *spec  = xs_fmt("%s/object/" "*/" "*_p.idx", srv_basedir);
+            xs *files = xs_glob(spec, 0, 0);
+            const char *v;
+            int c = 0;
+
+            while (xs_list_next(files, &v, &c)) {
+                xs *t_idx = xs_replace(v, "_p.idx", "_t.idx");
+                char p_md5[MD5_HEX_SIZE];
+
+                if (mtime(t_idx) == 0.0 && index_first(v, p_md5)) {
+                    xs *md5 = xs_dup(strrchr(v, '/') + 1);
+                    md5 = xs_crop_i(md5, 0, MD5_HEX_SIZE - 1);
+
+                    object_thread_add(md5, p_md5);
+                }
+            }
+
+            nf = 2.8;
+        }
+        else
+        if (f < 2.9) {
+            /* build the home timeline indexes */
+            xs *users = user_list();
+            const char *v;
+
+            xs_list_foreach(users, v) {
+                snac snac;
+
+                if (user_open(&snac, v)) {
+                    timeline_home_restore(&snac, NULL);
+                    user_free(&snac);
+                }
+            }
+
+            nf = 2.9;
+        }
+        else
+        if (f < 3.0) {
+            /* rename the block files created before the hosts were
+               normalized (with other case, or a port) */
+            xs *spec  = xs_fmt("%s/block/" "*", srv_basedir);
+            xs *files = xs_glob(spec, 0, 0);
+            const char *v;
+
+            xs_list_foreach(files, v) {
+                FILE *f;
+                xs *line = NULL;
+
+                if ((f = fopen(v, "r")) != NULL) {
+                    line = xs_readline(f);
+                    fclose(f);
+                }
+
+                if (line == NULL)
+                    continue;
+
+                line = xs_strip_i(line);
+                xs *n_fn = _instance_block_fn(line);
+
+                if (strcmp(n_fn, v) != 0) {
+                    /* already there with the new name? */
+                    if (mtime(n_fn) != 0.0)
+                        unlink(v);
+                    else
+                        rename(v, n_fn);
+                }
+            }
+
+            nf = 3.0;
+        }
 
         if (f < nf) {
             f          = nf;
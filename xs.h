@@ -52,6 +52,9 @@ typedef char xs_data;
 void *xs_free(void *ptr);
 void *_xs_realloc(void *ptr, size_t size, const char *file, int line, const char *func);
 #define xs_realloc(ptr, size) _xs_realloc(ptr, size, __FILE__, __LINE__, __func__)
+void xs_arena_start(size_t max_size);
+void xs_arena_stop(void);
+int xs_arena_hold(int hold);
 int _xs_blk_size(int sz);
 void _xs_destroy(char **var);
 #define xs_debug() raise(SIGTRAP)
@@ -164,8 +167,242 @@ unsigned int xs_hash_func(const char *data, int size);
 
 #ifdef XS_IMPLEMENTATION
 
+/** arenas **/
+
+/* A per-thread bump allocator. Between xs_arena_start() and
+   xs_arena_stop(), new allocations are taken from big blocks and
+   xs_free() is a no-op for them; xs_arena_stop() drops everything
+   at once. Values that must outlive it have to be allocated while
+   xs_arena_hold(1) is in effect. Big items and allocations over the
+   size limit go to the heap as usual. */
+
+#define XS_ARENA_BLK_SIZE (64 * 1024)
+#define XS_ARENA_MAX_ITEM (XS_ARENA_BLK_SIZE / 4)
+#define XS_ARENA_ALIGN 16
+#define XS_ARENA_MAX_BLKS 512
+#define XS_ARENA_TBL_SIZE (XS_ARENA_MAX_BLKS * 2)
+
+/* blocks are XS_ARENA_BLK_SIZE long and aligned to it, so the
+   block of any pointer is found by masking its address and
+   looking it up in a small hash table of the thread's blocks */
+
+typedef struct _xs_arena_blk {
+    struct _xs_arena_blk *next;
+    size_t size;                /* usable bytes in data */
+    size_t used;                /* used bytes in data */
+    size_t pad;                 /* keeps data aligned */
+    char data[];
+} xs_arena_blk;
+
+static _Thread_local struct {
+    int active;                 /* xs_arena_start() was called */
+    int held;                   /* allocate from the heap for now */
+    size_t max_size;            /* maximum size of all blocks */
+    size_t size;                /* current size of all blocks */
+    int n_blks;                 /* number of blocks */
+    xs_arena_blk *blks;         /* blocks, newest first */
+    xs_arena_blk *tbl[XS_ARENA_TBL_SIZE]; /* blocks by address */
+} _xs_arena;
+
+
+static int _xs_arena_slot(const void *blk)
+/* returns the first table slot for a block address */
+{
+    return ((size_t)blk / XS_ARENA_BLK_SIZE) % XS_ARENA_TBL_SIZE;
+}
+
+
+static void _xs_arena_tbl_add(xs_arena_blk *b)
+/* adds a block to the table (there is always room) */
+{
+    int i = _xs_arena_slot(b);
+
+    while (_xs_arena.tbl[i] != NULL)
+        i = (i + 1) % XS_ARENA_TBL_SIZE;
+
+    _xs_arena.tbl[i] = b;
+}
+
+
+static xs_arena_blk *_xs_arena_owner(const void *ptr)
+/* returns the arena block that holds ptr, if any */
+{
+    if (_xs_arena.n_blks == 0)
+        return NULL;
+
+    const void *base = (const char *)ptr - ((size_t)ptr % XS_ARENA_BLK_SIZE);
+    int i = _xs_arena_slot(base);
+    xs_arena_blk *b;
+
+    /* at most half full, so the probe sequence is short */
+    while ((b = _xs_arena.tbl[i]) != NULL) {
+        if ((const void *)b == base) {
+            if ((const char *)ptr >= b->data && (const char *)ptr < b->data + b->used)
+                return b;
+
+            break;
+        }
+
+        i = (i + 1) % XS_ARENA_TBL_SIZE;
+    }
+
+    return NULL;
+}
+
+
+static size_t *_xs_arena_hdr(const void *ptr)
+/* returns the header (the capacity) of an arena item */
+{
+    return (size_t *)((char *)ptr - XS_ARENA_ALIGN);
+}
+
+
+static void *_xs_arena_alloc(size_t cap)
+/* allocates cap (aligned) bytes from the arena, or returns NULL */
+{
+    xs_arena_blk *b = _xs_arena.blks;
+    size_t need = cap + XS_ARENA_ALIGN;
+
+    if (b == NULL || b->used + need > b->size) {
+        if (_xs_arena.size + XS_ARENA_BLK_SIZE > _xs_arena.max_size ||
+            _xs_arena.n_blks >= XS_ARENA_MAX_BLKS)
+            return NULL;
+
+        void *m;
+
+        if (posix_memalign(&m, XS_ARENA_BLK_SIZE, XS_ARENA_BLK_SIZE) != 0)
+            return NULL;
+
+        b = m;
+        b->size = XS_ARENA_BLK_SIZE - sizeof(xs_arena_blk);
+        b->used = 0;
+        b->next = _xs_arena.blks;
+        _xs_arena.blks = b;
+        _xs_arena.size += XS_ARENA_BLK_SIZE;
+        _xs_arena.n_blks++;
+
+        _xs_arena_tbl_add(b);
+    }
+
+    char *p = b->data + b->used + XS_ARENA_ALIGN;
+    b->used += need;
+
+    *_xs_arena_hdr(p) = cap;
+
+    return p;
+}
+
+
+static void *_xs_arena_realloc(xs_arena_blk *b, void *ptr, size_t size)
+/* reallocs inside the arena, or returns NULL */
+{
+    size_t cap = (size + XS_ARENA_ALIGN - 1) & ~((size_t)XS_ARENA_ALIGN - 1);
+    size_t o_cap = 0;
+
+    if (ptr != NULL) {
+        o_cap = *_xs_arena_hdr(ptr);
+
+        if (cap <= o_cap)
+            return ptr;
+
+        /* the last item of its block? grow it in place */
+        if ((char *)ptr + o_cap == b->data + b->used && b->used + cap - o_cap <= b->size) {
+            b->used += cap - o_cap;
+            *_xs_arena_hdr(ptr) = cap;
+
+            return ptr;
+        }
+    }
+
+    if (cap > XS_ARENA_MAX_ITEM)
+        return NULL;
+
+    void *n = _xs_arena_alloc(cap);
+
+    if (n != NULL && ptr != NULL)
+        memcpy(n, ptr, o_cap);
+
+    return n;
+}
+
+
+void xs_arena_start(size_t max_size)
+/* starts taking this thread's allocations from an arena */
+{
+    _xs_arena.active   = 1;
+    _xs_arena.held     = 0;
+    _xs_arena.max_size = max_size;
+}
+
+
+void xs_arena_stop(void)
+/* stops using the arena, dropping everything allocated in it */
+{
+    xs_arena_blk *b = _xs_arena.blks;
+
+    if (b != NULL) {
+        /* keep the newest block for the next time */
+        xs_arena_blk *n = b->next;
+
+        while (n != NULL) {
+            xs_arena_blk *nn = n->next;
+            free(n);
+            n = nn;
+        }
+
+        b->next = NULL;
+        b->used = 0;
+        _xs_arena.size   = XS_ARENA_BLK_SIZE;
+        _xs_arena.n_blks = 1;
+
+        memset(_xs_arena.tbl, '\0', sizeof(_xs_arena.tbl));
+        _xs_arena_tbl_add(b);
+    }
+
+    _xs_arena.active = 0;
+    _xs_arena.held   = 0;
+}
+
+
+int xs_arena_hold(int hold)
+/* if hold is set, new allocations come from the heap; returns the previous value */
+{
+    int prev = _xs_arena.held;
+
+    _xs_arena.held = hold;
+
+    return prev;
+}
+
+
 void *_xs_realloc(void *ptr, size_t size, const char *file, int line, const char *func)
 {
+    if (_xs_arena.active) {
+        xs_arena_blk *b = ptr != NULL ? _xs_arena_owner(ptr) : NULL;
+
+        if (b != NULL || (ptr == NULL && !_xs_arena.held)) {
+            void *n = NULL;
+
+            if (!_xs_arena.held)
+                n = _xs_arena_realloc(b, ptr, size);
+
+            if (n == NULL) {
+                /* too big, arena full or held: move to the heap */
+                if ((n = malloc(size)) == NULL) {
+                    fprintf(stderr, "ERROR: out of memory at %s:%d: %s()\n", file, line, func);
+                    abort();
+                }
+
+                if (ptr != NULL) {
+                    size_t o_cap = *_xs_arena_hdr(ptr);
+                    memcpy(n, ptr, o_cap < size ? o_cap : size);
+                }
+            }
+
+            return n;
+        }
+    }
+
     xs_val *ndata = realloc(ptr, size);
 
     if (ndata == NULL) {
@@ -210,6 +447,20 @@ void *_xs_realloc(void *ptr, size_t size, const char *file, int line, const char
 
 void *xs_free(void *ptr)
 {
+    if (_xs_arena.active && ptr != NULL) {
+        xs_arena_blk *b = _xs_arena_owner(ptr);
+
+        if (b != NULL) {
+            /* if it's the last item, give the space back */
+            size_t cap = *_xs_arena_hdr(ptr);
+
+            if ((char *)ptr + cap == b->data + b->used)
+                b->used -= cap + XS_ARENA_ALIGN;
+
+            return NULL;
+        }
+    }
+
 #ifdef XS_DEBUG
     if (ptr != NULL) {
         FILE *f = fopen("xs_memory.out", "a");
@@ -460,6 +711,19 @@ xs_val *xs_stock(int type)
     static xs_list *stock_list = NULL;
     static xs_dict *stock_dict = NULL;
 
+    if (stock_list == NULL || stock_dict == NULL) {
+        /* these live forever, so never take them from an arena */
+        int hold = xs_arena_hold(1);
+
+        if (stock_list == NULL)
+            stock_list = xs_list_new();
+
+        if (stock_dict == NULL)
+            stock_dict = xs_dict_new();
+
+        xs_arena_hold(hold);
+    }
+
     switch (type) {
     case 0:            return stock_0;
     case 1:            return stock_1;
@@ -467,15 +731,8 @@ xs_val *xs_stock(int type)
     case XSTYPE_TRUE:  return stock_true;
     case XSTYPE_FALSE: return stock_false;
 
-    case XSTYPE_LIST:
-        if (stock_list == NULL)
-            stock_list = xs_list_new();
-        return stock_list;
-
-    case XSTYPE_DICT:
-        if (stock_dict == NULL)
-            stock_dict = xs_dict_new();
-        return stock_dict;
+    case XSTYPE_LIST:  return stock_list;
+    case XSTYPE_DICT:  return stock_dict;
     }
 
     return NULL;
@@ -834,12 +1091,22 @@ const xs_val *xs_list_get(const xs_list *list, int num)
 {
     XS_ASSERT_TYPE(list, XSTYPE_LIST);
 
-    if (num < 0)
-        num = xs_list_len(list) + num;
-
     int c = 0;
     const xs_val *v;
 
+    if (num == -1) {
+        /* the last one: avoid walking the list twice */
+        const xs_val *last = NULL;
+
+        xs_list_foreach(list, v)
+            last = v;
+
+        return last;
+    }
+
+    if (num < 0)
+        num = xs_list_len(list) + num;
+
     xs_list_foreach(list, v) {
         if (c == num)
             return v;
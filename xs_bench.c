@@ -0,0 +1,553 @@
+/* copyright (c) 2022 - 2024 grunfink et al. / MIT license */
+
+/* Microbenchmarks for the xs library primitives used on snac's hot paths.
+   Build and run with 'make bench'. An optional argument restricts the
+   run to the benchmarks whose name contains it. The output is one
+   'name: nanoseconds per operation' line per benchmark. */
+
+#define XS_IMPLEMENTATION
+
+#include "xs.h"
+#include "xs_hex.h"
+#include "xs_io.h"
+#include "xs_unicode_tbl.h"
+#include "xs_unicode.h"
+#include "xs_json.h"
+#include "xs_openssl.h"
+#include "xs_set.h"
+#include "xs_vec.h"
+#include "xs_html.h"
+
+#include <time.h>
+
+/* minimum time to spend in each benchmark, in seconds */
+#define XSB_MIN_TIME 0.25
+
+/* a Create + Note as delivered by a Mastodon instance */
+static const char *xsb_ap_object =
+    "{\"@context\":[\"https://www.w3.org/ns/activitystreams\","
+    "{\"ostatus\":\"http://ostatus.org#\",\"atomUri\":\"ostatus:atomUri\","
+    "\"inReplyToAtomUri\":\"ostatus:inReplyToAtomUri\",\"conversation\":\"ostatus:conversation\","
+    "\"sensitive\":\"as:sensitive\",\"toot\":\"http://joinmastodon.org/ns#\","
+    "\"votersCount\":\"toot:votersCount\",\"Hashtag\":\"as:Hashtag\"}],"
+    "\"id\":\"https://mastodon.example/users/alice/statuses/112233445566778899/activity\","
+    "\"type\":\"Create\",\"actor\":\"https://mastodon.example/users/alice\","
+    "\"published\":\"2024-10-01T12:34:56Z\","
+    "\"to\":[\"https://www.w3.org/ns/activitystreams#Public\"],"
+    "\"cc\":[\"https://mastodon.example/users/alice/followers\",\"https://snac.example/bob\"],"
+    "\"object\":{\"id\":\"https://mastodon.example/users/alice/statuses/112233445566778899\","
+    "\"type\":\"Note\",\"summary\":null,\"inReplyTo\":\"https://snac.example/bob/p/1727700000.123456\","
+    "\"published\":\"2024-10-01T12:34:56Z\",\"url\":\"https://mastodon.example/@alice/112233445566778899\","
+    "\"attributedTo\":\"https://mastodon.example/users/alice\","
+    "\"to\":[\"https://www.w3.org/ns/activitystreams#Public\"],"
+    "\"cc\":[\"https://mastodon.example/users/alice/followers\",\"https://snac.example/bob\"],"
+    "\"sensitive\":false,\"atomUri\":\"https://mastodon.example/users/alice/statuses/112233445566778899\","
+    "\"conversation\":\"tag:mastodon.example,2024-10-01:objectId=987654321:objectType=Conversation\","
+    "\"content\":\"\\u003cp\\u003e\\u003cspan class=\\\"h-card\\\"\\u003e\\u003ca href=\\\"https://snac.example/bob\\\" "
+    "class=\\\"u-url mention\\\"\\u003e@\\u003cspan\\u003ebob\\u003c/span\\u003e\\u003c/a\\u003e\\u003c/span\\u003e "
+    "Ça marche très bien, merci! Straße, Ελληνικά, 日本語 \\ud83d\\ude00 "
+    "\\u003ca href=\\\"https://mastodon.example/tags/fediverse\\\" class=\\\"mention hashtag\\\" "
+    "rel=\\\"tag\\\"\\u003e#\\u003cspan\\u003efediverse\\u003c/span\\u003e\\u003c/a\\u003e\\u003c/p\\u003e\","
+    "\"attachment\":[{\"type\":\"Document\",\"mediaType\":\"image/png\","
+    "\"url\":\"https://files.mastodon.example/media_attachments/files/112/233/original/abc.png\","
+    "\"name\":\"A screenshot\",\"blurhash\":\"UFRfkBxu~qxuM{ofRjayRjWBj[ay\",\"width\":1280,\"height\":720}],"
+    "\"tag\":[{\"type\":\"Mention\",\"href\":\"https://snac.example/bob\",\"name\":\"@bob@snac.example\"},"
+    "{\"type\":\"Hashtag\",\"href\":\"https://mastodon.example/tags/fediverse\",\"name\":\"#fediverse\"}],"
+    "\"replies\":{\"id\":\"https://mastodon.example/users/alice/statuses/112233445566778899/replies\","
+    "\"type\":\"Collection\",\"first\":{\"type\":\"CollectionPage\","
+    "\"next\":\"https://mastodon.example/users/alice/statuses/112233445566778899/replies?only_other_accounts=true&page=true\","
+    "\"partOf\":\"https://mastodon.example/users/alice/statuses/112233445566778899/replies\",\"items\":[]}}},"
+    "\"signature\":{\"type\":\"RsaSignature2017\",\"creator\":\"https://mastodon.example/users/alice#main-key\","
+    "\"created\":\"2024-10-01T12:34:56Z\",\"signatureValue\":\"aGVsbG8gd29ybGQgdGhpcyBpcyBub3QgYSByZWFsIHNpZ25hdHVyZQ==\"}}";
+
+static const char *xsb_text =
+    "<p>Ça marche TRÈS bien & <b>Straße</b> \"ΕΛΛΗΝΙΚΆ\" 'Кириллица' — "
+    "日本語のテキスト; Some Plain ASCII Text With Mixed Case, 1234567890.</p>";
+
+static const char *filter = NULL;
+
+/* sink to keep the compiler from optimizing the work away */
+static volatile long xsb_sink = 0;
+
+/* start of the measured section of the current benchmark */
+static double xsb_t0 = 0.0;
+
+
+static double xsb_now(void)
+/* returns a monotonic time in seconds */
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+
+static void xsb_start(void)
+/* marks the end of a benchmark's setup */
+{
+    xsb_t0 = xsb_now();
+}
+
+
+static xs_str *xsb_key(int n)
+/* returns a key like the ones found in snac dicts (md5s) */
+{
+    char tmp[32];
+
+    snprintf(tmp, sizeof(tmp), "key-%d", n);
+
+    return xs_md5_hex(tmp, strlen(tmp));
+}
+
+
+static void xsb_run(const char *name, int size, long (*fn)(int size, int iters), int ops_per_iter)
+/* runs a benchmark until it takes a minimum time and prints the result */
+{
+    xs *full = size ? xs_fmt("%s.%d", name, size) : xs_dup(name);
+    int iters = 1;
+    double t;
+
+    if (filter && xs_str_in(full, filter) == -1)
+        return;
+
+    for (;;) {
+        xsb_start();
+
+        xsb_sink += fn(size, iters);
+        t = xsb_now() - xsb_t0;
+
+        if (t >= XSB_MIN_TIME || iters >= (1 << 28))
+            break;
+
+        /* grow the iteration count towards the minimum time */
+        if (t < XSB_MIN_TIME / 100.0)
+            iters *= 10;
+        else
+            iters = (int)((double)iters * XSB_MIN_TIME * 1.2 / t) + 1;
+    }
+
+    printf("%s: %.1f\n", full, t * 1000000000.0 / ((double)iters * ops_per_iter));
+    fflush(stdout);
+}
+
+
+/** dicts **/
+
+static long b_dict_set(int size, int iters)
+/* builds a dict of 'size' entries (ns per insertion) */
+{
+    xs *keys = xs_list_new();
+    long r = 0;
+    int n, i;
+
+    for (n = 0; n < size; n++) {
+        xs *k = xsb_key(n);
+        keys = xs_list_append(keys, k);
+    }
+
+    xsb_start();
+
+    for (i = 0; i < iters; i++) {
+        xs *d = xs_dict_new();
+        const char *k;
+
+        xs_list_foreach(keys, k)
+            d = xs_dict_set(d, k, k);
+
+        r += xs_size(d);
+    }
+
+    return r;
+}
+
+
+static long b_dict_set_arena(int size, int iters)
+/* like b_dict_set, but with each dict living in an arena */
+{
+    xs *keys = xs_list_new();
+    long r = 0;
+    int n, i;
+
+    for (n = 0; n < size; n++) {
+        xs *k = xsb_key(n);
+        keys = xs_list_append(keys, k);
+    }
+
+    xsb_start();
+
+    for (i = 0; i < iters; i++) {
+        xs_arena_start(16 * 1024 * 1024);
+
+        {
+            xs *d = xs_dict_new();
+            const char *k;
+
+            xs_list_foreach(keys, k)
+                d = xs_dict_set(d, k, k);
+
+            r += xs_size(d);
+        }
+
+        xs_arena_stop();
+    }
+
+    return r;
+}
+
+
+static long b_dict_get(int size, int iters)
+/* looks up existing keys in a dict of 'size' entries */
+{
+    xs *d = xs_dict_new();
+    xs *keys = xs_list_new();
+    long r = 0;
+    int n, i;
+
+    for (n = 0; n < size; n++) {
+        xs *k = xsb_key(n);
+        d = xs_dict_set(d, k, k);
+        keys = xs_list_append(keys, k);
+    }
+
+    xsb_start();
+
+    for (i = 0; i < iters; i++) {
+        const char *k;
+
+        xs_list_foreach(keys, k)
+            r += xs_dict_get(d, k) != NULL;
+    }
+
+    return r;
+}
+
+
+/** lists **/
+
+static long b_list_append(int size, int iters)
+/* builds a list of 'size' entries (ns per append) */
+{
+    long r = 0;
+    int i, n;
+
+    xsb_start();
+
+    for (i = 0; i < iters; i++) {
+        xs *l = xs_list_new();
+
+        for (n = 0; n < size; n++)
+            l = xs_list_append(l, "0123456789abcdef0123456789abcdef");
+
+        r += xs_size(l);
+    }
+
+    return r;
+}
+
+
+static long b_list_get(int size, int iters)
+/* gets elements by index from a list of 'size' entries */
+{
+    xs *l = xs_list_new();
+    long r = 0;
+    int i, n;
+
+    for (n = 0; n < size; n++) {
+        xs *k = xsb_key(n);
+        l = xs_list_append(l, k);
+    }
+
+    xsb_start();
+
+    for (i = 0; i < iters; i++) {
+        for (n = 0; n < 16; n++)
+            r += *xs_list_get(l, (size * n) / 16);
+    }
+
+    return r;
+}
+
+
+static long b_list_get_last(int size, int iters)
+/* gets the last element (a negative index) from a list of 'size' entries */
+{
+    xs *l = xs_list_new();
+    long r = 0;
+    int i, n;
+
+    for (n = 0; n < size; n++) {
+        xs *k = xsb_key(n);
+        l = xs_list_append(l, k);
+    }
+
+    xsb_start();
+
+    for (i = 0; i < iters; i++)
+        r += *xs_list_get(l, -1);
+
+    return r;
+}
+
+
+static long b_list_len(int size, int iters)
+/* counts the elements of a list of 'size' entries */
+{
+    xs *l = xs_list_new();
+    long r = 0;
+    int i, n;
+
+    for (n = 0; n < size; n++) {
+        xs *k = xsb_key(n);
+        l = xs_list_append(l, k);
+    }
+
+    xsb_start();
+
+    for (i = 0; i < iters; i++)
+        r += xs_list_len(l);
+
+    return r;
+}
+
+
+static long b_vec_get(int size, int iters)
+/* gets elements by index from a vector of 'size' entries */
+{
+    xs *l = xs_list_new();
+    xs_vec v;
+    long r = 0;
+    int i, n;
+
+    for (n = 0; n < size; n++) {
+        xs *k = xsb_key(n);
+        l = xs_list_append(l, k);
+    }
+
+    xs_vec_from_list(&v, l);
+
+    xsb_start();
+
+    for (i = 0; i < iters; i++) {
+        for (n = 0; n < 16; n++)
+            r += *xs_vec_get(&v, (size * n) / 16);
+    }
+
+    xs_vec_free(&v);
+
+    return r;
+}
+
+
+static long b_vec_roundtrip(int size, int iters)
+/* converts a list of 'size' entries to a vector and back (ns per element) */
+{
+    xs *l = xs_list_new();
+    long r = 0;
+    int i, n;
+
+    for (n = 0; n < size; n++) {
+        xs *k = xsb_key(n);
+        l = xs_list_append(l, k);
+    }
+
+    xsb_start();
+
+    for (i = 0; i < iters; i++) {
+        xs_vec v;
+
+        xs_vec_from_list(&v, l);
+        xs *l2 = xs_vec_to_list(&v);
+        xs_vec_free(&v);
+
+        r += xs_size(l2);
+    }
+
+    return r;
+}
+
+
+/** sets **/
+
+static long b_set_add(int size, int iters)
+/* adds 'size' entries (half of them repeated) to a set (ns per add) */
+{
+    xs *keys = xs_list_new();
+    long r = 0;
+    int i, n;
+
+    for (n = 0; n < size; n++) {
+        xs *k = xsb_key(n / 2);
+        keys = xs_list_append(keys, k);
+    }
+
+    xsb_start();
+
+    for (i = 0; i < iters; i++) {
+        xs_set s;
+        const char *k;
+
+        xs_set_init(&s);
+
+        xs_list_foreach(keys, k)
+            r += xs_set_add(&s, k);
+
+        xs_set_free(&s);
+    }
+
+    return r;
+}
+
+
+/** json **/
+
+static long b_json_loads(int size, int iters)
+/* parses an ActivityPub object */
+{
+    long r = 0;
+    int i;
+
+    (void)size;
+
+    xsb_start();
+
+    for (i = 0; i < iters; i++) {
+        xs *o = xs_json_loads(xsb_ap_object);
+        r += xs_size(o);
+    }
+
+    return r;
+}
+
+
+static long b_json_dumps(int size, int iters)
+/* serializes an ActivityPub object */
+{
+    xs *o = xs_json_loads(xsb_ap_object);
+    long r = 0;
+    int i;
+
+    (void)size;
+
+    xsb_start();
+
+    for (i = 0; i < iters; i++) {
+        xs *j = xs_json_dumps(o, 4);
+        r += strlen(j);
+    }
+
+    return r;
+}
+
+
+/** strings **/
+
+static long b_utf8_to_lower(int size, int iters)
+/* lowercases a mixed-script string */
+{
+    long r = 0;
+    int i;
+
+    (void)size;
+
+    xsb_start();
+
+    for (i = 0; i < iters; i++) {
+        xs *s = xs_utf8_to_lower(xsb_text);
+        r += strlen(s);
+    }
+
+    return r;
+}
+
+
+static long b_html_encode(int size, int iters)
+/* html-encodes a string */
+{
+    long r = 0;
+    int i;
+
+    (void)size;
+
+    xsb_start();
+
+    for (i = 0; i < iters; i++) {
+        xs *s = xs_html_encode(xsb_text);
+        r += strlen(s);
+    }
+
+    return r;
+}
+
+
+static long b_md5_hex(int size, int iters)
+/* md5s a buffer of 'size' bytes */
+{
+    char *buf = malloc(size);
+    long r = 0;
+    int i;
+
+    memset(buf, 'x', size);
+
+    xsb_start();
+
+    for (i = 0; i < iters; i++) {
+        xs *s = xs_md5_hex(buf, size);
+        r += *s;
+    }
+
+    free(buf);
+
+    return r;
+}
+
+
+int main(int argc, char *argv[])
+{
+    static const int sizes[] = { 10, 100, 1000, 10000, 0 };
+    int n;
+
+    if (argc > 1)
+        filter = argv[1];
+
+    for (n = 0; sizes[n]; n++)
+        xsb_run("dict_set", sizes[n], b_dict_set, sizes[n]);
+
+    for (n = 0; sizes[n]; n++)
+        xsb_run("dict_set_arena", sizes[n], b_dict_set_arena, sizes[n]);
+
+    for (n = 0; sizes[n]; n++)
+        xsb_run("dict_get", sizes[n], b_dict_get, sizes[n]);
+
+    for (n = 0; sizes[n]; n++)
+        xsb_run("list_append", sizes[n], b_list_append, sizes[n]);
+
+    for (n = 0; sizes[n]; n++)
+        xsb_run("list_get", sizes[n], b_list_get, 16);
+
+    for (n = 0; sizes[n]; n++)
+        xsb_run("list_get_last", sizes[n], b_list_get_last, 1);
+
+    for (n = 0; sizes[n]; n++)
+        xsb_run("list_len", sizes[n], b_list_len, 1);
+
+    for (n = 0; sizes[n]; n++)
+        xsb_run("vec_get", sizes[n], b_vec_get, 16);
+
+    for (n = 0; sizes[n]; n++)
+        xsb_run("vec_roundtrip", sizes[n], b_vec_roundtrip, sizes[n]);
+
+    for (n = 0; sizes[n]; n++)
+        xsb_run("set_add", sizes[n], b_set_add, sizes[n]);
+
+    xsb_run("json_loads", 0, b_json_loads, 1);
+    xsb_run("json_dumps", 0, b_json_dumps, 1);
+    xsb_run("utf8_to_lower", 0, b_utf8_to_lower, 1);
+    xsb_run("html_encode", 0, b_html_encode, 1);
+
+    xsb_run("md5_hex", 64, b_md5_hex, 1);
+    xsb_run("md5_hex", 4096, b_md5_hex, 1);
+
+    return 0;
+}
@@ -13,6 +13,11 @@ xs_list *xs_regex_replace_in(xs_str *str, const char *rx, const char *rep, int c
 #define xs_regex_replace_i(str, rx, rep) xs_regex_replace_in(str, rx, rep, XS_ALL)
 #define xs_regex_replace_n(str, rx, rep, count) xs_regex_replace_in(xs_dup(str), rx, rep, count)
 #define xs_regex_replace(str, rx, rep) xs_regex_replace_in(xs_dup(str), rx, rep, XS_ALL)
+void xs_regex_cache_stats(long *hits, long *misses, int *size);
+
+#ifndef XS_REGEX_CACHE_SIZE
+#define XS_REGEX_CACHE_SIZE 64
+#endif
 
 #ifdef XS_IMPLEMENTATION
 
@@ -22,6 +27,142 @@ xs_list *xs_regex_replace_in(xs_str *str, const char *rx, const char *rep, int c
 #endif
 
 #include <regex.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/** compiled regex cache **/
+
+/* The same few patterns are used over and over, so the compiled regexes
+   are kept in a small table shared by all threads. Entries being used
+   are never evicted; if all of them are busy, the regex is compiled
+   privately as before. */
+
+typedef struct {
+    char *rx;               /* the pattern (NULL if the slot is free) */
+    int flags;              /* regcomp() flags */
+    unsigned int hash;      /* hash of rx and flags */
+    int refs;               /* threads using it */
+    long used;              /* tick of the last use */
+    regex_t re;
+} _xs_regex_ent;
+
+static struct {
+    pthread_mutex_t mutex;
+    _xs_regex_ent ent[XS_REGEX_CACHE_SIZE];
+    long tick;
+    long hits;
+    long misses;
+} _xs_regex_cache = { PTHREAD_MUTEX_INITIALIZER, {{0}}, 0, 0, 0 };
+
+
+static unsigned int _xs_regex_hash(const char *rx, int flags)
+/* hashes a pattern and its flags */
+{
+    unsigned int h = 2166136261U ^ (unsigned int)flags;
+
+    while (*rx)
+        h = (h ^ (unsigned char)*rx++) * 16777619U;
+
+    return h;
+}
+
+
+static regex_t *_xs_regex_get(const char *rx, int flags, regex_t *priv)
+/* returns a compiled regex (from the cache or in priv), or NULL on error */
+{
+    unsigned int h = _xs_regex_hash(rx, flags);
+    _xs_regex_ent *e, *victim = NULL;
+    int n;
+
+    pthread_mutex_lock(&_xs_regex_cache.mutex);
+
+    _xs_regex_cache.tick++;
+
+    for (n = 0; n < XS_REGEX_CACHE_SIZE; n++) {
+        e = &_xs_regex_cache.ent[n];
+
+        if (e->rx != NULL && e->hash == h && e->flags == flags && strcmp(e->rx, rx) == 0) {
+            e->refs++;
+            e->used = _xs_regex_cache.tick;
+            _xs_regex_cache.hits++;
+
+            pthread_mutex_unlock(&_xs_regex_cache.mutex);
+            return &e->re;
+        }
+
+        /* the best slot to reuse: a free one, or the least recently used */
+        if (e->refs == 0 && (victim == NULL || (victim->rx != NULL &&
+            (e->rx == NULL || e->used < victim->used))))
+            victim = e;
+    }
+
+    _xs_regex_cache.misses++;
+
+    if (victim != NULL) {
+        if (victim->rx != NULL) {
+            regfree(&victim->re);
+            free(victim->rx);
+            victim->rx = NULL;
+        }
+
+        if (regcomp(&victim->re, rx, flags) == 0 && (victim->rx = strdup(rx)) != NULL) {
+            victim->flags = flags;
+            victim->hash  = h;
+            victim->refs  = 1;
+            victim->used  = _xs_regex_cache.tick;
+
+            pthread_mutex_unlock(&_xs_regex_cache.mutex);
+            return &victim->re;
+        }
+
+        /* compilation error: let the caller fail */
+        pthread_mutex_unlock(&_xs_regex_cache.mutex);
+        return NULL;
+    }
+
+    pthread_mutex_unlock(&_xs_regex_cache.mutex);
+
+    /* all slots busy */
+    return regcomp(priv, rx, flags) == 0 ? priv : NULL;
+}
+
+
+static void _xs_regex_release(regex_t *re, regex_t *priv)
+/* stops using a compiled regex */
+{
+    if (re == priv) {
+        regfree(priv);
+        return;
+    }
+
+    pthread_mutex_lock(&_xs_regex_cache.mutex);
+
+    _xs_regex_ent *e = (_xs_regex_ent *)((char *)re - offsetof(_xs_regex_ent, re));
+    e->refs--;
+
+    pthread_mutex_unlock(&_xs_regex_cache.mutex);
+}
+
+
+void xs_regex_cache_stats(long *hits, long *misses, int *size)
+/* returns the usage of the compiled regex cache */
+{
+    int n;
+
+    pthread_mutex_lock(&_xs_regex_cache.mutex);
+
+    *hits   = _xs_regex_cache.hits;
+    *misses = _xs_regex_cache.misses;
+    *size   = 0;
+
+    for (n = 0; n < XS_REGEX_CACHE_SIZE; n++) {
+        if (_xs_regex_cache.ent[n].rx != NULL)
+            (*size)++;
+    }
+
+    pthread_mutex_unlock(&_xs_regex_cache.mutex);
+}
+
 
 xs_list *xs_regex_split_n(const char *str, const char *rx, int count)
 /* splits str using regex as a separator, at most count times.
@@ -31,16 +172,16 @@ xs_list *xs_regex_split_n(const char *str, const char *rx, int count)
     len == odd: first part [ separator / next part ]...
 */
 {
-    regex_t re;
+    regex_t priv, *re;
     regmatch_t rm;
     int offset = 0;
     xs_list *list = xs_list_new();
     const char *p;
 
-    if (regcomp(&re, rx, REG_EXTENDED))
+    if ((re = _xs_regex_get(rx, REG_EXTENDED, &priv)) == NULL)
         return list;
 
-    while (count > 0 && !regexec(&re, (p = str + offset), 1, &rm, offset > 0 ? REG_NOTBOL : 0)) {
+    while (count > 0 && !regexec(re, (p = str + offset), 1, &rm, offset > 0 ? REG_NOTBOL : 0)) {
         /* add first the leading part of the string */
         xs *s1 = xs_str_new_sz(p, rm.rm_so);
         list = xs_list_append(list, s1);
@@ -58,7 +199,7 @@ xs_list *xs_regex_split_n(const char *str, const char *rx, int count)
     /* add the rest of the string */
     list = xs_list_append(list, p);
 
-    regfree(&re);
+    _xs_regex_release(re, &priv);
 
     return list;
 }
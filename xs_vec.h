@@ -0,0 +1,243 @@
+/* copyright (c) 2022 - 2024 grunfink et al. / MIT license */
+
+#ifndef _XS_VEC_H
+
+#define _XS_VEC_H
+
+/* A random-access companion to xs_list: O(1) length, indexing and
+   removal from both ends. Values loaded from a list point into a
+   private copy of it; appended values are owned copies. */
+
+typedef struct _xs_vec {
+    int len;                /* number of elements */
+    int start;              /* index of the first element in item */
+    int alloc;              /* allocated slots in item */
+    const xs_val **item;    /* pointers to the elements */
+    xs_list *base;          /* copy of the source list (if any) */
+    int base_size;          /* size of base */
+} xs_vec;
+
+void xs_vec_init(xs_vec *v);
+void xs_vec_from_list(xs_vec *v, const xs_list *list);
+xs_list *xs_vec_to_list(const xs_vec *v);
+void xs_vec_free(xs_vec *v);
+int xs_vec_len(const xs_vec *v);
+const xs_val *xs_vec_get(const xs_vec *v, int num);
+void xs_vec_append(xs_vec *v, const xs_val *data);
+void xs_vec_del(xs_vec *v, int num);
+void xs_vec_shift_n(xs_vec *v, int n);
+void xs_vec_pop_n(xs_vec *v, int n);
+
+
+#ifdef XS_IMPLEMENTATION
+
+
+void xs_vec_init(xs_vec *v)
+/* initializes an empty vector */
+{
+    v->len       = 0;
+    v->start     = 0;
+    v->alloc     = 0;
+    v->item      = NULL;
+    v->base      = NULL;
+    v->base_size = 0;
+}
+
+
+static int _xs_vec_owned(const xs_vec *v, const xs_val *p)
+/* returns true if the element was appended (and not loaded from the list) */
+{
+    return v->base == NULL || p < v->base || p >= v->base + v->base_size;
+}
+
+
+static void _xs_vec_room(xs_vec *v, int n)
+/* ensures there is room for n more elements at the end */
+{
+    if (v->start + v->len + n <= v->alloc)
+        return;
+
+    if (v->start > 0) {
+        /* reuse the slots freed at the beginning */
+        memmove(v->item, v->item + v->start, v->len * sizeof(*v->item));
+        v->start = 0;
+
+        if (v->len + n <= v->alloc)
+            return;
+    }
+
+    int alloc = v->alloc ? v->alloc : 32;
+
+    while (alloc < v->len + n)
+        alloc *= 2;
+
+    v->item  = xs_realloc(v->item, alloc * sizeof(*v->item));
+    v->alloc = alloc;
+}
+
+
+void xs_vec_from_list(xs_vec *v, const xs_list *list)
+/* initializes a vector with the elements of a list */
+{
+    xs_vec_init(v);
+
+    if (xs_type(list) != XSTYPE_LIST)
+        return;
+
+    /* one copy of the whole list; elements point into it */
+    v->base      = xs_dup(list);
+    v->base_size = xs_size(list);
+
+    int c = 0;
+    const xs_val *e;
+
+    while (xs_list_next(v->base, &e, &c)) {
+        _xs_vec_room(v, 1);
+        v->item[v->len++] = e;
+    }
+}
+
+
+xs_list *xs_vec_to_list(const xs_vec *v)
+/* creates a new list with the elements of the vector */
+{
+    int sz = 1 + _XS_TYPE_SIZE + 1;
+    int n;
+
+    /* compute the final size to allocate only once */
+    for (n = 0; n < v->len; n++)
+        sz += 1 + xs_size(v->item[v->start + n]);
+
+    xs_list *l = xs_realloc(NULL, _xs_blk_size(sz));
+    int offset = 1 + _XS_TYPE_SIZE;
+
+    l[0] = XSTYPE_LIST;
+    _xs_put_size(l, sz);
+
+    for (n = 0; n < v->len; n++) {
+        const xs_val *e = v->item[v->start + n];
+        int esz = xs_size(e);
+
+        l[offset++] = XSTYPE_LITEM;
+        memcpy(l + offset, e, esz);
+        offset += esz;
+    }
+
+    l[offset] = '\0';
+
+    return l;
+}
+
+
+void xs_vec_free(xs_vec *v)
+/* frees a vector */
+{
+    int n;
+
+    for (n = 0; n < v->len; n++) {
+        const xs_val *e = v->item[v->start + n];
+
+        if (_xs_vec_owned(v, e))
+            xs_free((xs_val *)e);
+    }
+
+    xs_free(v->item);
+    xs_free(v->base);
+
+    xs_vec_init(v);
+}
+
+
+int xs_vec_len(const xs_vec *v)
+/* returns the number of elements */
+{
+    return v->len;
+}
+
+
+const xs_val *xs_vec_get(const xs_vec *v, int num)
+/* returns the element #num (negative values count from the end) */
+{
+    if (num < 0)
+        num += v->len;
+
+    if (num < 0 || num >= v->len)
+        return NULL;
+
+    return v->item[v->start + num];
+}
+
+
+void xs_vec_append(xs_vec *v, const xs_val *data)
+/* appends a copy of data */
+{
+    if (data == NULL)
+        data = xs_stock(XSTYPE_NULL);
+
+    _xs_vec_room(v, 1);
+    v->item[v->start + v->len++] = xs_dup(data);
+}
+
+
+static void _xs_vec_drop(xs_vec *v, int idx)
+/* frees the element at the absolute slot idx, if owned */
+{
+    const xs_val *e = v->item[idx];
+
+    if (_xs_vec_owned(v, e))
+        xs_free((xs_val *)e);
+}
+
+
+void xs_vec_del(xs_vec *v, int num)
+/* deletes the element #num */
+{
+    if (num < 0)
+        num += v->len;
+
+    if (num < 0 || num >= v->len)
+        return;
+
+    _xs_vec_drop(v, v->start + num);
+
+    if (num == 0)
+        v->start++;
+    else
+    if (num < v->len - 1)
+        memmove(&v->item[v->start + num], &v->item[v->start + num + 1],
+            (v->len - num - 1) * sizeof(*v->item));
+
+    v->len--;
+}
+
+
+void xs_vec_shift_n(xs_vec *v, int n)
+/* deletes the first n elements */
+{
+    if (n > v->len)
+        n = v->len;
+
+    while (n-- > 0) {
+        _xs_vec_drop(v, v->start);
+        v->start++;
+        v->len--;
+    }
+}
+
+
+void xs_vec_pop_n(xs_vec *v, int n)
+/* deletes the last n elements */
+{
+    if (n > v->len)
+        n = v->len;
+
+    while (n-- > 0) {
+        v->len--;
+        _xs_vec_drop(v, v->start + v->len);
+    }
+}
+
+
+#endif /* XS_IMPLEMENTATION */
+
+#endif /* _XS_VEC_H */